@@ -0,0 +1,27 @@
+#-------------------------------------------------
+#
+# STM32 UART bootloader emulator for running iocflash without hardware
+#
+#-------------------------------------------------
+include ( ../prod.pri )
+TEMPLATE = app
+CONFIG += console
+TARGET = iocbootemu
+
+QT += core
+QT -= gui
+
+INCLUDEPATH += ../include
+
+# openpty
+LIBS += -lutil
+
+INCLUDEPATH += .
+
+SOURCES += main.cpp \
+    bootemulator.cpp \
+    gpiostandin.cpp
+
+HEADERS += \
+    bootemulator.h \
+    gpiostandin.h
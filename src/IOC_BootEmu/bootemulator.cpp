@@ -0,0 +1,669 @@
+#include "bootemulator.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QTimer>
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <pty.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <QLoggingCategory>
+Q_LOGGING_CATEGORY(DBG_IOCBOOTEMU, "IOCBootEmu.Bootloader", QtInfoMsg)
+
+BootEmulator::BootEmulator(const EmulatorOptions_t &a_Options, GpioStandIn *a_pGpio)
+    : m_Options(a_Options)
+    , m_pGpio(a_pGpio)
+    , m_MasterFd(-1)
+    , m_SlaveFd(-1)
+    , m_pNotifier(nullptr)
+    , m_State(eStateOff)
+    , m_PendingCmd(eGet)
+    , m_Address(0)
+    , m_Busy(false)
+    , m_Session(0)
+    , m_BootRan(false)
+    , m_ResetHeld(false)
+    , m_Flash(static_cast<int>(a_Options.m_flashSize), static_cast<char>(0xff))
+    , m_Random(a_Options.m_seed)
+    , m_ParityWarned(false)
+    , m_Resets(0)
+    , m_Commands(0)
+    , m_Writes(0)
+    , m_BytesWritten(0)
+    , m_BytesRead(0)
+    , m_PagesErased(0)
+    , m_Nacks(0)
+    , m_NacksInjected(0)
+    , m_BytesDropped(0)
+{
+    if(!m_Options.m_flashIn.isEmpty())
+    {
+        QFile file(m_Options.m_flashIn);
+        if(file.open(QIODevice::ReadOnly))
+        {
+            QByteArray content = file.read(m_Flash.size());
+            m_Flash.replace(0, content.size(), content);
+        }
+        else
+        {
+            qCWarning(DBG_IOCBOOTEMU, "Unable to read flash content: %s", qPrintable(m_Options.m_flashIn));
+        }
+    }
+
+    if(m_pGpio)
+    {
+        connect(m_pGpio, &GpioStandIn::linesChanged, this, &BootEmulator::linesChanged);
+        m_ResetHeld = m_pGpio->reset();
+    }
+}
+
+BootEmulator::~BootEmulator()
+{
+    delete m_pNotifier;
+    if(m_MasterFd >= 0)
+    {
+        ::close(m_MasterFd);
+    }
+    if(m_SlaveFd >= 0)
+    {
+        ::close(m_SlaveFd);
+    }
+    if(!m_Link.isEmpty())
+    {
+        QFile::remove(m_Link);
+    }
+}
+
+bool BootEmulator::open(const QString &a_Link)
+{
+    char name[64];
+    struct termios tio;
+
+    if(::openpty(&m_MasterFd, &m_SlaveFd, name, nullptr, nullptr) != 0)
+    {
+        qCWarning(DBG_IOCBOOTEMU, "openpty failed: %s", strerror(errno));
+        return false;
+    }
+
+    //The slave is kept open so the terminal survives the host closing and reopening it
+    ::tcgetattr(m_SlaveFd, &tio);
+    ::cfmakeraw(&tio);
+    ::tcsetattr(m_SlaveFd, TCSANOW, &tio);
+    ::fcntl(m_MasterFd, F_SETFL, ::fcntl(m_MasterFd, F_GETFL) | O_NONBLOCK);
+
+    m_PortName = QString::fromLocal8Bit(name);
+    if(!a_Link.isEmpty())
+    {
+        if(QFileInfo(a_Link).isSymLink())
+        {
+            QFile::remove(a_Link);
+        }
+        if(!QFile::link(m_PortName, a_Link))
+        {
+            qCWarning(DBG_IOCBOOTEMU, "Unable to create link %s", qPrintable(a_Link));
+            return false;
+        }
+        m_Link = a_Link;
+    }
+
+    m_pNotifier = new QSocketNotifier(m_MasterFd, QSocketNotifier::Read);
+    connect(m_pNotifier, &QSocketNotifier::activated, this, &BootEmulator::readyRead);
+
+    m_Clock.start();
+    if(!m_pGpio)
+    {
+        restart(true);
+    }
+    else if(!m_ResetHeld)
+    {
+        restart(m_pGpio->boot0());
+    }
+    return true;
+}
+
+void BootEmulator::report(void) const
+{
+    qCInfo(DBG_IOCBOOTEMU, "%d resets, %d commands, %d writes (%lld bytes), %lld bytes read, %d pages erased",
+           m_Resets, m_Commands, m_Writes, m_BytesWritten, m_BytesRead, m_PagesErased);
+    qCInfo(DBG_IOCBOOTEMU, "%d NACKs sent, %d injected, %d bytes dropped",
+           m_Nacks, m_NacksInjected, m_BytesDropped);
+}
+
+void BootEmulator::readyRead(void)
+{
+    char buffer[4096];
+    ssize_t length;
+
+    while((length = ::read(m_MasterFd, buffer, sizeof(buffer))) > 0)
+    {
+        //Nothing listens while the MCU is in reset, starting, or running the application
+        if(m_State == eStateOff || m_State == eStateApp)
+        {
+            continue;
+        }
+
+        //With another frame format every byte arrives with framing or parity errors
+        if(m_Options.m_checkParity && !parityOk())
+        {
+            if(!m_ParityWarned)
+            {
+                qCWarning(DBG_IOCBOOTEMU, "Host port is not 8E1, input ignored");
+                m_ParityWarned = true;
+            }
+            continue;
+        }
+
+        for(ssize_t i = 0; i < length; i++)
+        {
+            if(fault(m_Options.m_dropRate))
+            {
+                m_BytesDropped++;
+                continue;
+            }
+            m_Input.append(buffer[i]);
+        }
+    }
+
+    process();
+}
+
+void BootEmulator::linesChanged(bool a_Boot0, bool a_Reset)
+{
+    if(a_Reset && !m_ResetHeld)
+    {
+        m_ResetHeld = true;
+        m_Session++;
+        m_State = eStateOff;
+        m_Busy = false;
+        m_Input.clear();
+    }
+    else if(!a_Reset && m_ResetHeld)
+    {
+        //BOOT0 is sampled when reset is released
+        m_ResetHeld = false;
+        restart(a_Boot0);
+    }
+}
+
+void BootEmulator::process(void)
+{
+    qint32 used;
+
+    while(!m_Busy && !m_Input.isEmpty() && (used = processFrame()) > 0)
+    {
+        m_Input.remove(0, used);
+    }
+}
+
+qint32 BootEmulator::processFrame(void)
+{
+    const uchar *data = reinterpret_cast<const uchar *>(m_Input.constData());
+    qint32 size = m_Input.size();
+    quint8 checksum = 0;
+
+    switch(m_State)
+    {
+        case eStateAutobaud:
+            if(data[0] == eAutoBaudSig)
+            {
+                qCInfo(DBG_IOCBOOTEMU, "Autobaud after %lld ms", m_Clock.elapsed());
+                m_State = eStateCommand;
+                reply(QByteArray(1, static_cast<char>(BOOT_ACK)));
+            }
+            return 1;
+        case eStateCommand:
+            if(size < 2)
+            {
+                return 0;
+            }
+            if(data[1] != static_cast<quint8>(~data[0]))
+            {
+                nack();
+            }
+            else
+            {
+                handleCommand(data[0]);
+            }
+            return 2;
+        case eStateAddress:
+            if(size < 5)
+            {
+                return 0;
+            }
+            if((data[0] ^ data[1] ^ data[2] ^ data[3]) != data[4])
+            {
+                nack();
+            }
+            else
+            {
+                handleAddress((data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3]);
+            }
+            return 5;
+        case eStateReadLength:
+            if(size < 2)
+            {
+                return 0;
+            }
+            if(data[1] != static_cast<quint8>(~data[0]) || !inFlash(m_Address, data[0] + 1u))
+            {
+                nack();
+            }
+            else
+            {
+                QByteArray answer(1, static_cast<char>(BOOT_ACK));
+                answer.append(m_Flash.mid(m_Address - FLASH_BASE_ADDRESS, data[0] + 1));
+                m_BytesRead += data[0] + 1;
+                m_State = eStateCommand;
+                reply(answer, m_Options.m_latencyMs);
+            }
+            return 2;
+        case eStateWriteData:
+            {
+                qint32 length = data[0] + 1;
+                if(size < length + 2)
+                {
+                    return 0;
+                }
+                if(m_Options.m_dropWrites.remove(m_Writes + 1))
+                {
+                    //Lose the checksum, the bootloader waits for a byte the host already sent
+                    m_Input.remove(length + 1, 1);
+                    m_BytesDropped++;
+                    return 0;
+                }
+                for(qint32 i = 0; i <= length; i++)
+                {
+                    checksum ^= data[i];
+                }
+                if(checksum != data[length + 1])
+                {
+                    nack();
+                }
+                else
+                {
+                    handleWrite(length, reinterpret_cast<const char *>(data + 1));
+                }
+                return length + 2;
+            }
+        case eStateErase:
+            if(data[0] == 0xff)
+            {
+                if(size < 2)
+                {
+                    return 0;
+                }
+                if(data[1] != 0x00)
+                {
+                    nack();
+                }
+                else
+                {
+                    handleErase(QList<quint32>());
+                }
+                return 2;
+            }
+            else
+            {
+                qint32 count = data[0] + 1;
+                QList<quint32> pages;
+                if(size < count + 2)
+                {
+                    return 0;
+                }
+                for(qint32 i = 0; i <= count; i++)
+                {
+                    checksum ^= data[i];
+                    if(i > 0)
+                    {
+                        pages.append(data[i]);
+                    }
+                }
+                if(checksum != data[count + 1])
+                {
+                    nack();
+                }
+                else
+                {
+                    handleErase(pages);
+                }
+                return count + 2;
+            }
+        case eStateExtErase:
+            {
+                if(size < 2)
+                {
+                    return 0;
+                }
+                quint16 code = (data[0] << 8) | data[1];
+                if(code >= 0xfff0)
+                {
+                    //Special erase: 0xffff mass erase, 0xfffe bank 1, 0xfffd bank 2. One bank here.
+                    if(size < 3)
+                    {
+                        return 0;
+                    }
+                    if((data[0] ^ data[1]) != data[2] || code < 0xfffd)
+                    {
+                        nack();
+                    }
+                    else
+                    {
+                        handleErase(QList<quint32>());
+                    }
+                    return 3;
+                }
+
+                qint32 count = code + 1;
+                qint32 length = 2 + count * 2 + 1;
+                QList<quint32> pages;
+                if(size < length)
+                {
+                    return 0;
+                }
+                for(qint32 i = 0; i < length - 1; i++)
+                {
+                    checksum ^= data[i];
+                }
+                for(qint32 i = 0; i < count; i++)
+                {
+                    pages.append((data[2 + i * 2] << 8) | data[3 + i * 2]);
+                }
+                if(checksum != data[length - 1])
+                {
+                    nack();
+                }
+                else
+                {
+                    handleErase(pages);
+                }
+                return length;
+            }
+        default:
+            return size;
+    }
+}
+
+void BootEmulator::handleCommand(quint8 a_Cmd)
+{
+    QByteArray answer(1, static_cast<char>(BOOT_ACK));
+    quint8 version = m_Options.m_extErase ? 0x31 : 0x22;
+
+    m_Commands++;
+    qCDebug(DBG_IOCBOOTEMU, "Command 0x%02x", a_Cmd);
+
+    switch(a_Cmd)
+    {
+        case eGet:
+            {
+                QByteArray commands;
+                commands.append(static_cast<char>(eGet));
+                commands.append(static_cast<char>(eGetVersion));
+                commands.append(static_cast<char>(eGetID));
+                commands.append(static_cast<char>(eReadMem));
+                commands.append(static_cast<char>(eGo));
+                commands.append(static_cast<char>(eWriteMem));
+                commands.append(static_cast<char>(m_Options.m_extErase ? eExtErase : eErase));
+                answer.append(static_cast<char>(commands.size()));
+                answer.append(static_cast<char>(version));
+                answer.append(commands);
+                answer.append(static_cast<char>(BOOT_ACK));
+            }
+            break;
+        case eGetVersion:
+            answer.append(static_cast<char>(version));
+            answer.append(QByteArray(2, 0x00));   //Option bytes
+            answer.append(static_cast<char>(BOOT_ACK));
+            break;
+        case eGetID:
+            answer.append(static_cast<char>(1));
+            answer.append(static_cast<char>(m_Options.m_pid >> 8));
+            answer.append(static_cast<char>(m_Options.m_pid & 0xff));
+            answer.append(static_cast<char>(BOOT_ACK));
+            break;
+        case eReadMem:
+        case eGo:
+        case eWriteMem:
+            m_PendingCmd = static_cast<BootCMD_t>(a_Cmd);
+            m_State = eStateAddress;
+            break;
+        case eErase:
+        case eExtErase:
+            if((a_Cmd == eExtErase) != m_Options.m_extErase)
+            {
+                nack();
+                return;
+            }
+            m_State = a_Cmd == eErase ? eStateErase : eStateExtErase;
+            break;
+        default:
+            nack();
+            return;
+    }
+    reply(answer, m_Options.m_latencyMs);
+}
+
+void BootEmulator::handleAddress(quint32 a_Address)
+{
+    switch(m_PendingCmd)
+    {
+        case eGo:
+            //Acknowledged right away, the jump ends the session
+            qCInfo(DBG_IOCBOOTEMU, "Go 0x%08x", a_Address);
+            reply(QByteArray(1, static_cast<char>(BOOT_ACK)));
+            leaveBoot();
+            return;
+        case eReadMem:
+            if(!inFlash(a_Address, 1))
+            {
+                nack();
+                return;
+            }
+            m_State = eStateReadLength;
+            break;
+        case eWriteMem:
+            //Flash is written in words
+            if(!inFlash(a_Address, 1) || (a_Address & 0x3))
+            {
+                nack();
+                return;
+            }
+            m_State = eStateWriteData;
+            break;
+        default:
+            nack();
+            return;
+    }
+    m_Address = a_Address;
+    reply(QByteArray(1, static_cast<char>(BOOT_ACK)), m_Options.m_latencyMs);
+}
+
+void BootEmulator::handleWrite(quint32 a_Length, const char *a_Data)
+{
+    m_Writes++;
+
+    if(m_Options.m_nackWrites.contains(m_Writes) || fault(m_Options.m_nackRate))
+    {
+        qCInfo(DBG_IOCBOOTEMU, "Write %d to 0x%08x: injected NACK", m_Writes, m_Address);
+        m_NacksInjected++;
+        nack();
+        return;
+    }
+
+    if(!inFlash(m_Address, a_Length))
+    {
+        nack();
+        return;
+    }
+
+    char *flash = m_Flash.data() + (m_Address - FLASH_BASE_ADDRESS);
+    for(quint32 i = 0; i < a_Length; i++)
+    {
+        //Bits only go from 1 to 0 without an erase, the flash controller refuses to program a written word
+        if(static_cast<quint8>(flash[i]) != 0xff && static_cast<quint8>(a_Data[i]) != 0xff && flash[i] != a_Data[i])
+        {
+            qCWarning(DBG_IOCBOOTEMU, "Write %d: 0x%08x is already programmed", m_Writes, m_Address + i);
+            nack();
+            return;
+        }
+    }
+    for(quint32 i = 0; i < a_Length; i++)
+    {
+        flash[i] &= a_Data[i];
+    }
+
+    m_BytesWritten += a_Length;
+    m_State = eStateCommand;
+    reply(QByteArray(1, static_cast<char>(BOOT_ACK)), m_Options.m_latencyMs + m_Options.m_writeTimeMs);
+}
+
+void BootEmulator::handleErase(const QList<quint32> &a_Pages)
+{
+    quint32 pageCount = m_Options.m_flashSize / m_Options.m_pageSize;
+    qint32 erased = 0;
+
+    if(a_Pages.isEmpty())
+    {
+        qCInfo(DBG_IOCBOOTEMU, "Mass erase");
+        m_Flash.fill(static_cast<char>(0xff));
+        erased = pageCount;
+    }
+    else
+    {
+        for(quint32 page : a_Pages)
+        {
+            if(page >= pageCount)
+            {
+                nack();
+                return;
+            }
+        }
+        qCInfo(DBG_IOCBOOTEMU, "Erase %d pages", a_Pages.count());
+        for(quint32 page : a_Pages)
+        {
+            m_Flash.replace(page * m_Options.m_pageSize, m_Options.m_pageSize, QByteArray(m_Options.m_pageSize, static_cast<char>(0xff)));
+        }
+        erased = a_Pages.count();
+    }
+
+    m_PagesErased += erased;
+    m_State = eStateCommand;
+    reply(QByteArray(1, static_cast<char>(BOOT_ACK)), m_Options.m_latencyMs + erased * m_Options.m_eraseTimeMs);
+}
+
+void BootEmulator::reply(const QByteArray &a_Bytes, qint32 a_DelayMs)
+{
+    if(a_DelayMs <= 0)
+    {
+        if(::write(m_MasterFd, a_Bytes.constData(), a_Bytes.size()) != a_Bytes.size())
+        {
+            qCWarning(DBG_IOCBOOTEMU, "Reply lost: %s", strerror(errno));
+        }
+        return;
+    }
+
+    //Like the real bootloader, nothing is read while a command executes
+    quint32 session = m_Session;
+    m_Busy = true;
+    QTimer::singleShot(a_DelayMs, this, [this, session, a_Bytes]()
+    {
+        if(session != m_Session)
+        {
+            return;   //Reset meanwhile
+        }
+        m_Busy = false;
+        reply(a_Bytes);
+        process();
+    });
+}
+
+void BootEmulator::nack(void)
+{
+    m_Nacks++;
+    m_State = eStateCommand;
+    reply(QByteArray(1, static_cast<char>(BOOT_NACK)), m_Options.m_latencyMs);
+}
+
+void BootEmulator::restart(bool a_Boot)
+{
+    quint32 session = ++m_Session;
+
+    m_Resets++;
+    m_State = eStateOff;
+    m_Busy = false;
+    m_Input.clear();
+
+    QTimer::singleShot(m_Options.m_bootTimeMs, this, [this, session, a_Boot]()
+    {
+        if(session != m_Session)
+        {
+            return;
+        }
+        m_Clock.start();
+        if(a_Boot)
+        {
+            qCInfo(DBG_IOCBOOTEMU, "Bootloader started");
+            m_State = eStateAutobaud;
+            m_BootRan = true;
+        }
+        else
+        {
+            leaveBoot();
+        }
+    });
+}
+
+void BootEmulator::leaveBoot(void)
+{
+    m_State = eStateApp;
+
+    if(!m_BootRan)
+    {
+        return;
+    }
+    m_BootRan = false;
+
+    qCInfo(DBG_IOCBOOTEMU, "Application started");
+    if(!m_Options.m_flashOut.isEmpty())
+    {
+        QSaveFile file(m_Options.m_flashOut);
+        if(!file.open(QIODevice::WriteOnly) || file.write(m_Flash) != m_Flash.size() || !file.commit())
+        {
+            qCWarning(DBG_IOCBOOTEMU, "Unable to write flash content: %s", qPrintable(m_Options.m_flashOut));
+        }
+    }
+    report();
+    emit bootLeft();
+
+    if(!m_pGpio)
+    {
+        //No reset line, serve the next host right away
+        restart(true);
+    }
+}
+
+bool BootEmulator::parityOk(void) const
+{
+    struct termios tio;
+
+    if(::tcgetattr(m_SlaveFd, &tio) != 0)
+    {
+        return true;
+    }
+    return (tio.c_cflag & CSIZE) == CS8 && (tio.c_cflag & PARENB) && !(tio.c_cflag & PARODD);
+}
+
+bool BootEmulator::fault(double a_Rate)
+{
+    return a_Rate > 0.0 && std::uniform_real_distribution<double>(0.0, 1.0)(m_Random) < a_Rate;
+}
+
+bool BootEmulator::inFlash(quint32 a_Address, quint32 a_Length) const
+{
+    return a_Address >= FLASH_BASE_ADDRESS &&
+           static_cast<quint64>(a_Address - FLASH_BASE_ADDRESS) + a_Length <= m_Options.m_flashSize;
+}
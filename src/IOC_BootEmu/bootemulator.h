@@ -0,0 +1,216 @@
+#ifndef BOOT_EMULATOR_H
+#define BOOT_EMULATOR_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QString>
+#include <QSet>
+#include <QSocketNotifier>
+#include <QElapsedTimer>
+#include <random>
+
+#include "gpiostandin.h"
+
+
+//! \brief Behaviour of the emulated MCU and the faults to inject
+struct EmulatorOptions_t
+{
+    EmulatorOptions_t() : m_pid(0x410), m_extErase(false), m_flashSize(128 * 1024), m_pageSize(1024),
+        m_bootTimeMs(2), m_latencyMs(0), m_writeTimeMs(0), m_eraseTimeMs(0), m_nackRate(0.0), m_dropRate(0.0),
+        m_seed(1), m_checkParity(true), m_exitOnLeave(false)
+    {
+    }
+
+    //! \brief Product ID returned by Get ID
+    quint16 m_pid;
+
+    //! \brief Bootloader v3.x: extended erase instead of erase
+    bool m_extErase;
+
+    //! \brief Flash size and erase page size, bytes
+    quint32 m_flashSize;
+    quint32 m_pageSize;
+
+    //! \brief Time from reset release until the bootloader listens
+    qint32 m_bootTimeMs;
+
+    //! \brief Delay of the final ACK of every command
+    qint32 m_latencyMs;
+
+    //! \brief Time to program one write memory frame
+    qint32 m_writeTimeMs;
+
+    //! \brief Time to erase one page, mass erase takes it once per page
+    qint32 m_eraseTimeMs;
+
+    //! \brief Probability of NACKing a valid write memory frame
+    double m_nackRate;
+
+    //! \brief Probability of losing a received byte
+    double m_dropRate;
+
+    //! \brief Seed of the fault injection, runs with the same seed inject the same faults
+    quint32 m_seed;
+
+    //! \brief Write memory frames (1 = first) that are NACKed
+    QSet<qint32> m_nackWrites;
+
+    //! \brief Write memory frames (1 = first) that lose their checksum byte
+    QSet<qint32> m_dropWrites;
+
+    //! \brief Ignore bytes unless the host configured the port for 8 data bits, even parity
+    bool m_checkParity;
+
+    //! \brief Flash content loaded at start, raw binary from the flash base address
+    QString m_flashIn;
+
+    //! \brief Flash content written each time the MCU leaves the bootloader
+    QString m_flashOut;
+
+    //! \brief Quit once the MCU leaves the bootloader
+    bool m_exitOnLeave;
+};
+
+
+//! \brief STM32 UART bootloader (AN3155) served on a pseudo terminal.
+//! Implements Get, Get Version, Get ID, Read Memory, Go, Write Memory, Erase and Extended Erase
+//! on a flash array, with configurable timing and fault injection. The bootloader runs
+//! when reset is released with BOOT0 set on the GPIO stand-in, or always without one.
+class BootEmulator : public QObject
+{
+    Q_OBJECT
+
+    public:
+        //! \brief ctor
+        //! \param a_pGpio - GPIO stand-in, nullptr to run the bootloader right away
+        BootEmulator(const EmulatorOptions_t &a_Options, GpioStandIn *a_pGpio);
+
+        //! \brief dtor
+        ~BootEmulator();
+
+        //! \brief Open the pseudo terminal
+        //! \param a_Link - symlink to create to the terminal, none if empty
+        //! \return false on error
+        bool open(const QString &a_Link);
+
+        //! \brief Path of the terminal the host opens
+        const QString &portName(void) const { return m_PortName; }
+
+        //! \brief Log the counters of the session
+        void report(void) const;
+
+        //! \brief IO Controller bootloader ACK signal def
+        static const quint8 BOOT_ACK = 0x79;
+
+        //! \brief IO Controller bootloader NACK signal def
+        static const quint8 BOOT_NACK = 0x1F;
+
+        //! \brief Flash memory start address
+        static const quint32 FLASH_BASE_ADDRESS = 0x08000000u;
+
+    signals:
+        //! \brief The MCU left the bootloader, by Go or by a reset into the application
+        void bootLeft(void);
+
+    private slots:
+        //! \brief Bytes from the host
+        void readyRead(void);
+
+        //! \brief GPIO stand-in lines changed
+        void linesChanged(bool a_Boot0, bool a_Reset);
+
+    private:
+        //! \brief Copy constructor blocked
+        BootEmulator(const BootEmulator &a_Right);
+
+        //! \brief Assignment operator blocked
+        BootEmulator &operator=(const BootEmulator &a_Right);
+
+        //! \brief Bootloader commands
+        enum BootCMD_t {eGet = 0x00, eGetVersion = 0x01, eGetID = 0x02, eReadMem = 0x11, eGo = 0x21,
+                        eWriteMem = 0x31, eErase = 0x43, eExtErase = 0x44, eAutoBaudSig = 0x7F};
+
+        //! \brief What the bootloader waits for
+        enum State_t {eStateOff = 0x00, eStateApp, eStateAutobaud, eStateCommand, eStateAddress, eStateReadLength,
+                      eStateWriteData, eStateErase, eStateExtErase};
+
+        //! \brief Handle buffered input as far as complete frames are available
+        void process(void);
+
+        //! \brief Handle a complete frame of the current state
+        //! \return number of input bytes used, 0 if the frame is not complete yet
+        qint32 processFrame(void);
+
+        void handleCommand(quint8 a_Cmd);
+        void handleAddress(quint32 a_Address);
+        void handleWrite(quint32 a_Length, const char *a_Data);
+        void handleErase(const QList<quint32> &a_Pages);
+
+        //! \brief Send a_Bytes after a_DelayMs, input is not read meanwhile
+        void reply(const QByteArray &a_Bytes, qint32 a_DelayMs = 0);
+
+        //! \brief Send a NACK and wait for the next command
+        void nack(void);
+
+        //! \brief Reset the MCU: start the bootloader, or the application, after the boot time
+        void restart(bool a_Boot);
+
+        //! \brief The bootloader jumps to the application
+        void leaveBoot(void);
+
+        //! \brief True if the host configured 8 data bits with even parity
+        bool parityOk(void) const;
+
+        //! \brief Draw a fault with probability a_Rate
+        bool fault(double a_Rate);
+
+        bool inFlash(quint32 a_Address, quint32 a_Length) const;
+
+        EmulatorOptions_t m_Options;
+        GpioStandIn *m_pGpio;
+
+        int m_MasterFd;
+        int m_SlaveFd;
+        QString m_PortName;
+        QString m_Link;
+        QSocketNotifier *m_pNotifier;
+
+        State_t m_State;
+        BootCMD_t m_PendingCmd;
+        quint32 m_Address;
+
+        //! \brief Received bytes not handled yet
+        QByteArray m_Input;
+
+        //! \brief Waiting for a delayed reply, input is held back
+        bool m_Busy;
+
+        //! \brief Incremented on every reset, delayed replies of an older session are dropped
+        quint32 m_Session;
+
+        //! \brief The bootloader ran since the last time the MCU left it
+        bool m_BootRan;
+
+        bool m_ResetHeld;
+
+        QByteArray m_Flash;
+
+        std::mt19937 m_Random;
+
+        //! \brief Parity mismatch already reported
+        bool m_ParityWarned;
+
+        //! \brief Counters
+        qint32 m_Resets;
+        qint32 m_Commands;
+        qint32 m_Writes;
+        qint64 m_BytesWritten;
+        qint64 m_BytesRead;
+        qint32 m_PagesErased;
+        qint32 m_Nacks;
+        qint32 m_NacksInjected;
+        qint32 m_BytesDropped;
+        QElapsedTimer m_Clock;
+};
+
+#endif // BOOT_EMULATOR_H
@@ -0,0 +1,106 @@
+#include "gpiostandin.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+
+#include <QLoggingCategory>
+Q_LOGGING_CATEGORY(DBG_IOCBOOTEMU_GPIO, "IOCBootEmu.Gpio", QtInfoMsg)
+
+GpioStandIn::GpioStandIn(const QString &a_Dir, const QString &a_Boot0, const QString &a_Reset, QObject *a_pParent)
+    : QObject(a_pParent)
+    , m_Boot0Path(QDir(a_Dir).filePath(a_Boot0))
+    , m_ResetPath(QDir(a_Dir).filePath(a_Reset))
+    , m_Boot0Offset(0)
+    , m_ResetOffset(0)
+    , m_Boot0(false)
+    , m_Reset(false)
+{
+    connect(&m_Watcher, &QFileSystemWatcher::fileChanged, this, &GpioStandIn::fileChanged);
+}
+
+bool GpioStandIn::open(void)
+{
+    if(!QDir().mkpath(QFileInfo(m_Boot0Path).path()) ||
+       !writeState(m_Boot0Path, false) ||
+       !writeState(m_ResetPath, false))
+    {
+        qCWarning(DBG_IOCBOOTEMU_GPIO, "Unable to create GPIO line files in %s", qPrintable(QFileInfo(m_Boot0Path).path()));
+        return false;
+    }
+
+    readStates(m_Boot0Path, &m_Boot0Offset);
+    readStates(m_ResetPath, &m_ResetOffset);
+    m_Watcher.addPath(m_Boot0Path);
+    m_Watcher.addPath(m_ResetPath);
+    return true;
+}
+
+void GpioStandIn::fileChanged(const QString &a_Path)
+{
+    QList<bool> boot0 = readStates(m_Boot0Path, &m_Boot0Offset);
+    QList<bool> reset = readStates(m_ResetPath, &m_ResetOffset);
+
+    //Removed and created again, watch the new file
+    if(!m_Watcher.files().contains(a_Path) && QFile::exists(a_Path))
+    {
+        m_Watcher.addPath(a_Path);
+    }
+
+    //BOOT0 is set up before the reset pulse
+    if(!boot0.isEmpty())
+    {
+        m_Boot0 = boot0.last();
+    }
+
+    for(bool state : reset)
+    {
+        if(state != m_Reset)
+        {
+            qCDebug(DBG_IOCBOOTEMU_GPIO) << "boot0:" << m_Boot0 << "reset:" << state;
+            m_Reset = state;
+            emit linesChanged(m_Boot0, m_Reset);
+        }
+    }
+}
+
+QList<bool> GpioStandIn::readStates(const QString &a_Path, qint64 *a_pOffset)
+{
+    QList<bool> states;
+    QFile file(a_Path);
+
+    if(!file.open(QIODevice::ReadOnly))
+    {
+        return states;
+    }
+    if(file.size() < *a_pOffset)
+    {
+        //Started over
+        *a_pOffset = 0;
+    }
+    file.seek(*a_pOffset);
+
+    //A line without its end is not written completely yet
+    QByteArray data = file.readAll();
+    qint32 end = data.lastIndexOf('\n') + 1;
+    for(const QByteArray &line : data.left(end).split('\n'))
+    {
+        if(!line.isEmpty())
+        {
+            states.append(line.at(0) == '1');
+        }
+    }
+    *a_pOffset += end;
+    return states;
+}
+
+bool GpioStandIn::writeState(const QString &a_Path, bool a_State)
+{
+    QFile file(a_Path);
+
+    if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        return false;
+    }
+    return file.write(a_State ? "1\n" : "0\n") == 2;
+}
@@ -0,0 +1,53 @@
+#ifndef GPIO_STAND_IN_H
+#define GPIO_STAND_IN_H
+
+#include <QObject>
+#include <QString>
+#include <QFileSystemWatcher>
+
+
+//! \brief Stand-in for the mcu_boot0 and mcu_reset GPIO lines.
+//! Each line is a file in a directory that gets one line, "0" or "1", appended per logical state
+//! change. The Gpio class of libIOCGpio writes these files instead of real lines when
+//! IOC_GPIO_SIM_DIR names the directory. Every reset pulse is seen even if change events coalesce.
+class GpioStandIn : public QObject
+{
+    Q_OBJECT
+
+    public:
+        //! \brief ctor
+        //! \param a_Dir - directory of the line files
+        //! \param a_Boot0, a_Reset - line names, as given to iocflash --target
+        GpioStandIn(const QString &a_Dir, const QString &a_Boot0, const QString &a_Reset, QObject *a_pParent = nullptr);
+
+        //! \brief Create the line files, BOOT0 low and reset released
+        //! \return false on error
+        bool open(void);
+
+        bool boot0(void) const { return m_Boot0; }
+        bool reset(void) const { return m_Reset; }
+
+    signals:
+        //! \brief A line changed state, emitted once per reset transition
+        void linesChanged(bool a_Boot0, bool a_Reset);
+
+    private slots:
+        void fileChanged(const QString &a_Path);
+
+    private:
+        //! \brief States appended to a line file since a_pOffset, a_pOffset is moved past them
+        static QList<bool> readStates(const QString &a_Path, qint64 *a_pOffset);
+
+        //! \brief Start a line file over with a single state
+        static bool writeState(const QString &a_Path, bool a_State);
+
+        QString m_Boot0Path;
+        QString m_ResetPath;
+        qint64 m_Boot0Offset;
+        qint64 m_ResetOffset;
+        bool m_Boot0;
+        bool m_Reset;
+        QFileSystemWatcher m_Watcher;
+};
+
+#endif // GPIO_STAND_IN_H
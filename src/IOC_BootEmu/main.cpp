@@ -0,0 +1,209 @@
+#include "bootemulator.h"
+#include "gpiostandin.h"
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <iostream>
+#include <cstdlib>
+#include <csignal>
+
+extern "C" {
+static void signal_handler(__attribute__((unused)) int a_signal)
+{
+    qApp->quit();
+}
+}
+
+//! \brief Parse a comma separated list of write numbers
+static bool parseList(const QString &a_Arg, QSet<qint32> *a_pSet)
+{
+    for(const QString &item : a_Arg.split(','))
+    {
+        bool ok;
+        qint32 value = item.toInt(&ok);
+        if(!ok || value < 1)
+        {
+            return false;
+        }
+        a_pSet->insert(value);
+    }
+    return true;
+}
+
+static void usage(const char *a_pName)
+{
+    std::cout << "Usage: " << a_pName << " [options]" << std::endl
+              << "Emulates the STM32 UART bootloader of the IO Controller on a pseudo terminal, the" << std::endl
+              << "terminal path is printed on stdout. Run iocflash with IOC_GPIO_SIM_DIR set to the" << std::endl
+              << "--gpio-dir directory and --target=PTY,BOOT0,BOOT1,RESET." << std::endl
+              << "  --link=PATH         symlink to the terminal" << std::endl
+              << "  --gpio-dir=DIR      GPIO stand-in directory, without it the bootloader always runs" << std::endl
+              << "  --boot0=NAME        BOOT0 line name (default mcu_boot0)" << std::endl
+              << "  --reset=NAME        reset line name (default mcu_reset)" << std::endl
+              << "  --pid=ID            product ID returned by Get ID (default 0x410)" << std::endl
+              << "  --ext-erase         bootloader v3.1, extended erase instead of erase" << std::endl
+              << "  --flash-size=KB     flash size (default 128)" << std::endl
+              << "  --page-size=BYTES   erase page size (default 1024)" << std::endl
+              << "  --flash-in=FILE     initial flash content, raw binary" << std::endl
+              << "  --flash-out=FILE    flash content written when the MCU leaves the bootloader" << std::endl
+              << "  --boot-time=MS      time from reset release until the bootloader listens (default 2)" << std::endl
+              << "  --latency=MS        delay of every reply" << std::endl
+              << "  --write-time=MS     time to program one write memory frame" << std::endl
+              << "  --erase-time=MS     time to erase one page" << std::endl
+              << "  --nack-rate=P       probability of NACKing a write memory frame" << std::endl
+              << "  --drop-rate=P       probability of losing a received byte" << std::endl
+              << "  --seed=N            fault injection seed (default 1)" << std::endl
+              << "  --nack-write=N,...  NACK these write memory frames, first is 1" << std::endl
+              << "  --drop-write=N,...  lose the checksum byte of these write memory frames" << std::endl
+              << "  --no-parity-check   answer even if the host port is not 8E1" << std::endl
+              << "  --exit-on-leave     quit when the MCU leaves the bootloader" << std::endl << std::flush;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    QStringList cmdLineArgs = a.arguments();
+    EmulatorOptions_t options;
+    QString link;
+    QString gpioDir;
+    QString boot0 = "mcu_boot0";
+    QString reset = "mcu_reset";
+    bool ok = true;
+
+    for(qint32 i = 1; i < cmdLineArgs.size() && ok; i++)
+    {
+        const QString &arg = cmdLineArgs.at(i);
+        QString value = arg.mid(arg.indexOf('=') + 1);
+
+        if(arg.startsWith("--link="))
+        {
+            link = value;
+        }
+        else if(arg.startsWith("--gpio-dir="))
+        {
+            gpioDir = value;
+        }
+        else if(arg.startsWith("--boot0="))
+        {
+            boot0 = value;
+        }
+        else if(arg.startsWith("--reset="))
+        {
+            reset = value;
+        }
+        else if(arg.startsWith("--pid="))
+        {
+            options.m_pid = value.toUShort(&ok, 0);
+        }
+        else if(arg == "--ext-erase")
+        {
+            options.m_extErase = true;
+        }
+        else if(arg.startsWith("--flash-size="))
+        {
+            options.m_flashSize = value.toUInt(&ok, 0) * 1024;
+        }
+        else if(arg.startsWith("--page-size="))
+        {
+            options.m_pageSize = value.toUInt(&ok, 0);
+            ok = ok && options.m_pageSize > 0;
+        }
+        else if(arg.startsWith("--flash-in="))
+        {
+            options.m_flashIn = value;
+        }
+        else if(arg.startsWith("--flash-out="))
+        {
+            options.m_flashOut = value;
+        }
+        else if(arg.startsWith("--boot-time="))
+        {
+            options.m_bootTimeMs = value.toInt(&ok);
+        }
+        else if(arg.startsWith("--latency="))
+        {
+            options.m_latencyMs = value.toInt(&ok);
+        }
+        else if(arg.startsWith("--write-time="))
+        {
+            options.m_writeTimeMs = value.toInt(&ok);
+        }
+        else if(arg.startsWith("--erase-time="))
+        {
+            options.m_eraseTimeMs = value.toInt(&ok);
+        }
+        else if(arg.startsWith("--nack-rate="))
+        {
+            options.m_nackRate = value.toDouble(&ok);
+        }
+        else if(arg.startsWith("--drop-rate="))
+        {
+            options.m_dropRate = value.toDouble(&ok);
+        }
+        else if(arg.startsWith("--seed="))
+        {
+            options.m_seed = value.toUInt(&ok, 0);
+        }
+        else if(arg.startsWith("--nack-write="))
+        {
+            ok = parseList(value, &options.m_nackWrites);
+        }
+        else if(arg.startsWith("--drop-write="))
+        {
+            ok = parseList(value, &options.m_dropWrites);
+        }
+        else if(arg == "--no-parity-check")
+        {
+            options.m_checkParity = false;
+        }
+        else if(arg == "--exit-on-leave")
+        {
+            options.m_exitOnLeave = true;
+        }
+        else
+        {
+            ok = false;
+        }
+
+        if(!ok)
+        {
+            std::cout << "Bad option: " << qPrintable(arg) << std::endl;
+        }
+    }
+
+    if(!ok || options.m_flashSize == 0 || options.m_flashSize % options.m_pageSize != 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    GpioStandIn *gpio = nullptr;
+    if(!gpioDir.isEmpty())
+    {
+        gpio = new GpioStandIn(gpioDir, boot0, reset, &a);
+        if(!gpio->open())
+        {
+            return EXIT_FAILURE;
+        }
+    }
+
+    BootEmulator emulator(options, gpio);
+    if(!emulator.open(link))
+    {
+        return EXIT_FAILURE;
+    }
+    if(options.m_exitOnLeave)
+    {
+        QObject::connect(&emulator, &BootEmulator::bootLeft, &a, &QCoreApplication::quit, Qt::QueuedConnection);
+    }
+
+    signal(SIGINT, &signal_handler);   // Ctrl-C
+    signal(SIGTERM, &signal_handler);  // kill
+
+    std::cout << qPrintable(emulator.portName()) << std::endl << std::flush;
+
+    int ret = a.exec();
+    emulator.report();
+    return ret;
+}
@@ -8,7 +8,7 @@ TEMPLATE = app
 CONFIG += console
 TARGET = iocflash
 
-QT += core
+QT += core concurrent network
 QT -= gui
 
 # The VitalSim2 setup
@@ -41,10 +41,29 @@ INCLUDEPATH += . ../Common
 SOURCES += main.cpp \
     ioctrlcommcontroller.cpp \
     iocontrollerupdatethread.cpp \
-    iocontrollercommthread.cpp
+    iocontrollercommthread.cpp \
+    flashimage.cpp \
+    flashplancache.cpp \
+    flashjournal.cpp \
+    flashstats.cpp \
+    flashgeometry.cpp \
+    flashinstalled.cpp \
+    flashtiming.cpp \
+    flashprogress.cpp \
+    flashservice.cpp
 
 HEADERS += \
     ioctrlcommcontroller.h \
     iocontrollerupdatethread.h \
     SWversion.h \
-    iocontrollercommthread.h
+    iocontrollercommthread.h \
+    flashoptions.h \
+    flashimage.h \
+    flashplancache.h \
+    flashjournal.h \
+    flashstats.h \
+    flashgeometry.h \
+    flashinstalled.h \
+    flashtiming.h \
+    flashprogress.h \
+    flashservice.h
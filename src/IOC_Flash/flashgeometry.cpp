@@ -0,0 +1,97 @@
+#include "flashgeometry.h"
+
+#include <algorithm>
+
+//Erase timeouts are the datasheet maxima, F2/F4 at x8 parallelism as the bootloader may run at any voltage range
+static const FlashChip_t s_Chips[] =
+{
+    {0x412, "STM32F10x low density",               0,   100, {{32,  1024, 50}, {0, 0, 0}}},
+    {0x410, "STM32F10x medium density",            0,   100, {{128, 1024, 50}, {0, 0, 0}}},
+    {0x414, "STM32F10x high density",              0,   100, {{256, 2048, 50}, {0, 0, 0}}},
+    {0x418, "STM32F105/107 connectivity line",     0,   100, {{128, 2048, 50}, {0, 0, 0}}},
+    {0x420, "STM32F100 medium density value line", 0,   100, {{128, 1024, 50}, {0, 0, 0}}},
+    {0x428, "STM32F100 high density value line",   0,   100, {{256, 2048, 50}, {0, 0, 0}}},
+    {0x430, "STM32F10x XL density",                256, 100, {{512, 2048, 50}, {0, 0, 0}}},
+    {0x444, "STM32F03x",                           0,   100, {{32,  1024, 50}, {0, 0, 0}}},
+    {0x440, "STM32F05x/F030x8",                    0,   100, {{64,  1024, 50}, {0, 0, 0}}},
+    {0x448, "STM32F07x",                           0,   100, {{64,  2048, 50}, {0, 0, 0}}},
+    {0x442, "STM32F09x",                           0,   100, {{128, 2048, 50}, {0, 0, 0}}},
+    {0x438, "STM32F303x4-8/F334",                  0,   100, {{32,  2048, 50}, {0, 0, 0}}},
+    {0x422, "STM32F30xxB/C",                       0,   100, {{128, 2048, 50}, {0, 0, 0}}},
+    {0x460, "STM32G07x/08x",                       0,   100, {{64,  2048, 50}, {0, 0, 0}}},
+    {0x468, "STM32G431/441",                       0,   100, {{64,  2048, 50}, {0, 0, 0}}},
+    {0x411, "STM32F2",                             0, 32000, {{4, 16384, 800}, {1, 65536, 2400}, {7, 131072, 4000}, {0, 0, 0}}},
+    {0x413, "STM32F40x/41x",                       0, 32000, {{4, 16384, 800}, {1, 65536, 2400}, {7, 131072, 4000}, {0, 0, 0}}},
+    {0x419, "STM32F42x/43x",                       12, 32000, {{4, 16384, 800}, {1, 65536, 2400}, {7, 131072, 4000},
+                                                               {4, 16384, 800}, {1, 65536, 2400}, {7, 131072, 4000}, {0, 0, 0}}},
+    {0x423, "STM32F401xB/C",                       0,  8000, {{4, 16384, 800}, {1, 65536, 2400}, {1, 131072, 4000}, {0, 0, 0}}},
+    {0x433, "STM32F401xD/E",                       0, 16000, {{4, 16384, 800}, {1, 65536, 2400}, {3, 131072, 4000}, {0, 0, 0}}},
+    {0x431, "STM32F411xC/E",                       0, 16000, {{4, 16384, 800}, {1, 65536, 2400}, {3, 131072, 4000}, {0, 0, 0}}},
+};
+
+FlashGeometry::FlashGeometry(quint16 a_Pid)
+{
+    m_pChip = find(a_Pid);
+    if(!m_pChip)
+    {
+        m_pChip = find(DEFAULT_PID);
+    }
+
+    m_SectorStart.append(0);
+    for(const FlashSectorRun_t *run = m_pChip->m_runs; run->m_count > 0; run++)
+    {
+        for(quint16 i = 0; i < run->m_count; i++)
+        {
+            m_SectorStart.append(m_SectorStart.last() + run->m_size);
+        }
+    }
+}
+
+const FlashChip_t *FlashGeometry::find(quint16 a_Pid)
+{
+    for(const FlashChip_t &chip : s_Chips)
+    {
+        if(chip.m_pid == a_Pid)
+        {
+            return &chip;
+        }
+    }
+    return nullptr;
+}
+
+bool FlashGeometry::isKnown(quint16 a_Pid)
+{
+    return find(a_Pid) != nullptr;
+}
+
+qint32 FlashGeometry::sectorAt(quint32 a_Address) const
+{
+    if(a_Address < FLASH_BASE_ADDRESS || a_Address - FLASH_BASE_ADDRESS >= flashSize())
+    {
+        return -1;
+    }
+
+    //First sector starting after the address, the one before holds it
+    QVector<quint32>::const_iterator next = std::upper_bound(m_SectorStart.constBegin(), m_SectorStart.constEnd(),
+                                                             a_Address - FLASH_BASE_ADDRESS);
+    return static_cast<qint32>(next - m_SectorStart.constBegin()) - 1;
+}
+
+qint32 FlashGeometry::eraseTimeoutMs(qint32 a_Sector) const
+{
+    for(const FlashSectorRun_t *run = m_pChip->m_runs; run->m_count > 0; run++)
+    {
+        if(a_Sector < run->m_count)
+        {
+            return run->m_eraseTimeoutMs;
+        }
+        a_Sector -= run->m_count;
+    }
+    return 0;
+}
+
+bool FlashGeometry::contains(quint32 a_Address, quint32 a_Length) const
+{
+    return a_Address >= FLASH_BASE_ADDRESS &&
+           static_cast<quint64>(a_Address - FLASH_BASE_ADDRESS) + a_Length <= flashSize();
+}
@@ -0,0 +1,92 @@
+#ifndef FLASH_GEOMETRY_H
+#define FLASH_GEOMETRY_H
+
+#include <QtGlobal>
+#include <QVector>
+
+
+//! \brief A run of equally sized erase sectors. STM32F0/F1/F3/G0/G4 call them pages.
+struct FlashSectorRun_t
+{
+    quint16 m_count;
+    quint32 m_size;
+
+    //! \brief Max time to erase one sector of the run
+    qint32 m_eraseTimeoutMs;
+};
+
+//! \brief Flash layout of the devices sharing a bootloader product ID (see AN2606)
+struct FlashChip_t
+{
+    quint16 m_pid;
+    const char *m_name;
+
+    //! \brief Sectors per bank on dual bank devices, 0 for single bank
+    quint16 m_bankSectors;
+
+    //! \brief Max time of a mass or bank erase
+    qint32 m_massEraseTimeoutMs;
+
+    //! \brief Sectors from the flash base address up, terminated by a run of count 0
+    FlashSectorRun_t m_runs[7];
+};
+
+
+//! \brief Erase sectors and size of the main flash of an IO Controller MCU, by the product ID
+//! the bootloader returns for Get ID. The largest flash of a product ID is assumed.
+class FlashGeometry
+{
+    public:
+        //! \brief Product ID of the IO Controller MCU, used until the bootloader is asked
+        static const quint16 DEFAULT_PID = 0x410;
+
+        //! \brief Start of main flash, sector 0
+        static const quint32 FLASH_BASE_ADDRESS = 0x08000000u;
+
+        //! \brief Geometry of a_Pid, of DEFAULT_PID if a_Pid is not in the table
+        explicit FlashGeometry(quint16 a_Pid = DEFAULT_PID);
+
+        //! \brief True if a_Pid is in the table
+        static bool isKnown(quint16 a_Pid);
+
+        quint16 pid(void) const { return m_pChip->m_pid; }
+        const char *name(void) const { return m_pChip->m_name; }
+
+        //! \brief Size of main flash, bytes
+        quint32 flashSize(void) const { return m_SectorStart.last(); }
+
+        qint32 sectorCount(void) const { return m_SectorStart.count() - 1; }
+
+        //! \brief Sector holding a_Address, -1 if outside main flash
+        qint32 sectorAt(quint32 a_Address) const;
+
+        //! \brief First address of a_Sector
+        quint32 sectorAddress(qint32 a_Sector) const { return FLASH_BASE_ADDRESS + m_SectorStart.at(a_Sector); }
+
+        quint32 sectorSize(qint32 a_Sector) const { return m_SectorStart.at(a_Sector + 1) - m_SectorStart.at(a_Sector); }
+
+        //! \brief Max time to erase a_Sector
+        qint32 eraseTimeoutMs(qint32 a_Sector) const;
+
+        //! \brief Max time of a mass or bank erase
+        qint32 massEraseTimeoutMs(void) const { return m_pChip->m_massEraseTimeoutMs; }
+
+        //! \brief Sectors per bank on dual bank devices, 0 for single bank
+        qint32 bankSectors(void) const { return m_pChip->m_bankSectors; }
+
+        //! \brief True if a_Length bytes at a_Address are all in main flash
+        bool contains(quint32 a_Address, quint32 a_Length) const;
+
+        bool operator==(const FlashGeometry &a_Right) const { return m_pChip == a_Right.m_pChip; }
+        bool operator!=(const FlashGeometry &a_Right) const { return m_pChip != a_Right.m_pChip; }
+
+    private:
+        static const FlashChip_t *find(quint16 a_Pid);
+
+        const FlashChip_t *m_pChip;
+
+        //! \brief Offset of each sector from the flash base, followed by the flash size
+        QVector<quint32> m_SectorStart;
+};
+
+#endif // FLASH_GEOMETRY_H
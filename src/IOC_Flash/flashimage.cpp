@@ -0,0 +1,797 @@
+#include "flashimage.h"
+
+#include <QElapsedTimer>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#include <QLoggingCategory>
+Q_LOGGING_CATEGORY(DBG_IOCFLASH_IMAGE,"IOCFlash.Image", QtInfoMsg)
+
+FlashImage::FlashImage()
+    : m_imageSize(0)
+    , m_error(eNoError)
+    , m_format(eFormatUnknown)
+    , m_parseTimeNs(0)
+    , m_allocations(0)
+{
+}
+
+void FlashImage::clear(void)
+{
+    m_data.clear();
+    m_segments.clear();
+    m_blocks.clear();
+    m_imageSize = 0;
+    m_error = eNoError;
+    m_format = eFormatUnknown;
+    m_parseTimeNs = 0;
+    m_allocations = 0;
+}
+
+void FlashImage::assign(const QByteArray &a_Data, qint64 a_ImageSize,
+                        const QVector<FlashSegment_t> &a_Segments, const QVector<FlashBlock_t> &a_Blocks)
+{
+    clear();
+    m_data = a_Data;
+    m_imageSize = a_ImageSize;
+    m_segments = a_Segments;
+    m_blocks = a_Blocks;
+}
+
+bool FlashImage::readUint(const uchar **a_pCurr, const uchar *a_pEnd, qint32 a_Size, quint32 *a_pValue, quint32 *a_pChecksum)
+{
+    quint32 value = 0;
+
+    if(a_pEnd - *a_pCurr < a_Size)
+    {
+        return false;
+    }
+
+    for(qint32 i = 0; i < a_Size; i++)
+    {
+        quint8 c = *(*a_pCurr)++;
+        value = (value << 8) | c;
+        *a_pChecksum += c;
+    }
+    *a_pValue = value;
+    return true;
+}
+
+void FlashImage::appendUint(QByteArray *a_pData, quint32 a_Value, qint32 a_Size, quint32 *a_pChecksum)
+{
+    for(qint32 i = a_Size - 1; i >= 0; i--)
+    {
+        quint8 c = static_cast<quint8>(a_Value >> (8 * i));
+        a_pData->append(static_cast<char>(c));
+        *a_pChecksum += c;
+    }
+}
+
+bool FlashImage::readHexByte(const uchar **a_pCurr, const uchar *a_pEnd, quint8 *a_pValue, quint8 *a_pChecksum)
+{
+    quint8 value = 0;
+
+    if(a_pEnd - *a_pCurr < 2)
+    {
+        return false;
+    }
+
+    for(qint32 i = 0; i < 2; i++)
+    {
+        uchar c = *(*a_pCurr)++;
+        if(c >= '0' && c <= '9')
+        {
+            value = (value << 4) | (c - '0');
+        }
+        else if(c >= 'A' && c <= 'F')
+        {
+            value = (value << 4) | (c - 'A' + 10);
+        }
+        else if(c >= 'a' && c <= 'f')
+        {
+            value = (value << 4) | (c - 'a' + 10);
+        }
+        else
+        {
+            return false;
+        }
+    }
+    *a_pValue = value;
+    *a_pChecksum += value;
+    return true;
+}
+
+const uchar *FlashImage::skipSpace(const uchar *a_pCurr, const uchar *a_pEnd)
+{
+    while(a_pCurr < a_pEnd && (*a_pCurr == '\r' || *a_pCurr == '\n' || *a_pCurr == ' ' || *a_pCurr == '\t'))
+    {
+        a_pCurr++;
+    }
+    return a_pCurr;
+}
+
+FlashImage::Format_t FlashImage::detectFormat(const uchar *a_Data, qint64 a_Size)
+{
+    const uchar *curr;
+
+    if(a_Size >= 4 && a_Data[0] == 0x7f && a_Data[1] == 'I' && a_Data[2] == 'A' && a_Data[3] == 'R')
+    {
+        return eFormatSim;
+    }
+
+    curr = skipSpace(a_Data, a_Data + a_Size);
+    if(a_Data + a_Size - curr >= 2)
+    {
+        if(curr[0] == ':' && isxdigit(curr[1]))
+        {
+            return eFormatIntelHex;
+        }
+        if(curr[0] == 'S' && curr[1] >= '0' && curr[1] <= '9')
+        {
+            return eFormatSrec;
+        }
+    }
+
+    return eFormatBin;
+}
+
+bool FlashImage::load(const uchar *a_Data, qint64 a_Size, quint32 a_BinBaseAddress)
+{
+    //A new format needs a parse function and a rule in detectFormat
+    switch(detectFormat(a_Data, a_Size))
+    {
+        case eFormatSim:
+            return parseSim(a_Data, a_Size);
+        case eFormatIntelHex:
+            return parseIntelHex(a_Data, a_Size);
+        case eFormatSrec:
+            return parseSrec(a_Data, a_Size);
+        default:
+            return parseBin(a_Data, a_Size, a_BinBaseAddress);
+    }
+}
+
+void FlashImage::beginParse(Format_t a_Format, qint64 a_Reserve)
+{
+    m_parseTimer.start();
+    clear();
+    m_format = a_Format;
+
+    //Record data can never be larger than this, one allocation for the whole image
+    m_data.reserve(static_cast<int>(a_Reserve));
+    m_allocations++;
+}
+
+bool FlashImage::finishParse(void)
+{
+    if(!sortSegments())
+    {
+        m_error = eErrorOverlap;
+        return false;
+    }
+
+    m_imageSize = m_data.size();
+    m_parseTimeNs = m_parseTimer.nsecsElapsed();
+
+    qCDebug(DBG_IOCFLASH_IMAGE) << "Parsed" << m_segments.count() << "segments," << m_data.size() << "bytes";
+    return true;
+}
+
+bool FlashImage::parseSim(const uchar *a_Data, qint64 a_Size)
+{
+    const uchar *curr = a_Data;
+    const uchar *end = a_Data + a_Size;
+    quint32 checksum = 0;
+    quint32 value;
+    bool proceed = true;
+
+    beginParse(eFormatSim, a_Size);
+
+    // Read file header.
+    if(!readUint(&curr, end, 4, &value, &checksum) || value != 0x7f494152) // magic
+    {
+        m_error = eErrorFormat;
+        return false;
+    }
+
+    if(!readUint(&curr, end, 4, &value, &checksum) ||   // flags (not used)
+       !readUint(&curr, end, 4, &value, &checksum) ||   // hdr_bytes (not used in tiny mode)
+       !readUint(&curr, end, 2, &value, &checksum))     // version (not used)
+    {
+        m_error = eErrorFormat;
+        return false;
+    }
+
+    // Loop over all records.
+    while(proceed)
+    {
+        quint32 recordTag;
+        quint32 drecStart;
+        quint32 drecBytes;
+
+        if(!readUint(&curr, end, 1, &recordTag, &checksum))
+        {
+            m_error = eErrorFormat;
+            return false;
+        }
+
+        switch(recordTag)
+        {
+            case 1: // Data record.
+                if(!readUint(&curr, end, 1, &value, &checksum) ||   // segtype (not used)
+                   !readUint(&curr, end, 2, &value, &checksum) ||   // flags (not used)
+                   !readUint(&curr, end, 4, &drecStart, &checksum) ||
+                   !readUint(&curr, end, 4, &drecBytes, &checksum) ||
+                   drecBytes > static_cast<quint32>(end - curr))
+                {
+                    m_error = eErrorFormat;
+                    return false;
+                }
+
+                for(quint32 i = 0; i < drecBytes; i++)
+                {
+                    checksum += curr[i];
+                }
+                addSegment(drecStart, curr, drecBytes);
+                curr += drecBytes;
+                break;
+            case 2: // Entry record (not used in flash loader).
+                if(!readUint(&curr, end, 4, &value, &checksum) ||
+                   !readUint(&curr, end, 1, &value, &checksum))
+                {
+                    m_error = eErrorFormat;
+                    return false;
+                }
+                break;
+            case 3: // End record.
+            {
+                // The checksum itself is not part of the calculated checsum.
+                quint32 fileChecksum = 0;
+                if(!readUint(&curr, end, 4, &value, &fileChecksum))
+                {
+                    m_error = eErrorFormat;
+                    return false;
+                }
+                checksum += value; // Should be zero, verified below.
+                proceed = false;
+                break;
+            }
+            default:
+                m_error = eErrorBadRecord;
+                return false;
+        }
+    }
+
+    if(checksum)
+    {
+        m_error = eErrorChecksum;
+        return false;
+    }
+
+    return finishParse();
+}
+
+QByteArray FlashImage::simFile(quint32 a_Address, const QByteArray &a_Data)
+{
+    QByteArray file;
+    quint32 checksum = 0;
+
+    file.reserve(a_Data.size() + 32);
+
+    // File header, as read by parseSim.
+    appendUint(&file, 0x7f494152, 4, &checksum);   // magic
+    appendUint(&file, 0, 4, &checksum);            // flags
+    appendUint(&file, 14, 4, &checksum);           // hdr_bytes
+    appendUint(&file, 1, 2, &checksum);            // version
+
+    // One data record.
+    appendUint(&file, 1, 1, &checksum);
+    appendUint(&file, 0, 1, &checksum);            // segtype
+    appendUint(&file, 0, 2, &checksum);            // flags
+    appendUint(&file, a_Address, 4, &checksum);
+    appendUint(&file, static_cast<quint32>(a_Data.size()), 4, &checksum);
+    for(qint32 i = 0; i < a_Data.size(); i++)
+    {
+        checksum += static_cast<quint8>(a_Data.at(i));
+    }
+    file.append(a_Data);
+
+    // End record, its checksum makes the sum of the file zero.
+    quint32 unused = 0;
+    appendUint(&file, 3, 1, &checksum);
+    appendUint(&file, 0u - checksum, 4, &unused);
+    return file;
+}
+
+bool FlashImage::parseIntelHex(const uchar *a_Data, qint64 a_Size)
+{
+    const uchar *curr = a_Data;
+    const uchar *end = a_Data + a_Size;
+    quint32 base = 0;
+    uchar record[255];
+    bool proceed = true;
+
+    //Two characters per byte
+    beginParse(eFormatIntelHex, a_Size / 2);
+
+    // Loop over all records, ":LLAAAATT<data>CC".
+    while(proceed)
+    {
+        quint8 sum = 0;
+        quint8 length;
+        quint8 addrHigh;
+        quint8 addrLow;
+        quint8 type;
+        quint8 checksum;
+
+        curr = skipSpace(curr, end);
+        if(curr == end || *curr++ != ':' ||
+           !readHexByte(&curr, end, &length, &sum) ||
+           !readHexByte(&curr, end, &addrHigh, &sum) ||
+           !readHexByte(&curr, end, &addrLow, &sum) ||
+           !readHexByte(&curr, end, &type, &sum))
+        {
+            m_error = eErrorFormat;
+            return false;
+        }
+
+        for(qint32 i = 0; i < length; i++)
+        {
+            if(!readHexByte(&curr, end, &record[i], &sum))
+            {
+                m_error = eErrorFormat;
+                return false;
+            }
+        }
+
+        // The checksum makes the sum of all record bytes zero.
+        if(!readHexByte(&curr, end, &checksum, &sum))
+        {
+            m_error = eErrorFormat;
+            return false;
+        }
+        if(sum)
+        {
+            m_error = eErrorChecksum;
+            return false;
+        }
+
+        switch(type)
+        {
+            case 0x00: // Data record.
+                if(length)
+                {
+                    addSegment(base + ((addrHigh << 8) | addrLow), record, length);
+                }
+                break;
+            case 0x01: // End of file record.
+                proceed = false;
+                break;
+            case 0x02: // Extended segment address record.
+            case 0x04: // Extended linear address record.
+                if(length != 2)
+                {
+                    m_error = eErrorBadRecord;
+                    return false;
+                }
+                base = static_cast<quint32>((record[0] << 8) | record[1]) << (type == 0x02 ? 4 : 16);
+                break;
+            case 0x03: // Start segment address record (not used in flash loader).
+            case 0x05: // Start linear address record (not used in flash loader).
+                break;
+            default:
+                m_error = eErrorBadRecord;
+                return false;
+        }
+    }
+
+    return finishParse();
+}
+
+bool FlashImage::parseSrec(const uchar *a_Data, qint64 a_Size)
+{
+    const uchar *curr = a_Data;
+    const uchar *end = a_Data + a_Size;
+    uchar record[255];
+    bool proceed = true;
+
+    //Two characters per byte
+    beginParse(eFormatSrec, a_Size / 2);
+
+    // Loop over all records, "St<count><address><data><checksum>".
+    while(proceed)
+    {
+        quint8 sum = 0;
+        quint8 count;
+        quint8 type;
+        quint8 checksum;
+        qint32 addrBytes;
+        quint32 address = 0;
+
+        curr = skipSpace(curr, end);
+        if(end - curr < 2 || curr[0] != 'S' || curr[1] < '0' || curr[1] > '9')
+        {
+            m_error = eErrorFormat;
+            return false;
+        }
+        type = curr[1] - '0';
+        curr += 2;
+
+        switch(type)
+        {
+            case 0:
+            case 1:
+            case 5:
+            case 9:
+                addrBytes = 2;
+                break;
+            case 2:
+            case 6:
+            case 8:
+                addrBytes = 3;
+                break;
+            case 3:
+            case 7:
+                addrBytes = 4;
+                break;
+            default:
+                m_error = eErrorBadRecord;
+                return false;
+        }
+
+        // The count covers address, data and checksum.
+        if(!readHexByte(&curr, end, &count, &sum) || count < addrBytes + 1)
+        {
+            m_error = eErrorFormat;
+            return false;
+        }
+
+        for(qint32 i = 0; i < count - 1; i++)
+        {
+            if(!readHexByte(&curr, end, &record[i], &sum))
+            {
+                m_error = eErrorFormat;
+                return false;
+            }
+        }
+        for(qint32 i = 0; i < addrBytes; i++)
+        {
+            address = (address << 8) | record[i];
+        }
+
+        // The checksum is the ones complement of the sum of the other record bytes.
+        if(!readHexByte(&curr, end, &checksum, &sum))
+        {
+            m_error = eErrorFormat;
+            return false;
+        }
+        if(sum != 0xff)
+        {
+            m_error = eErrorChecksum;
+            return false;
+        }
+
+        switch(type)
+        {
+            case 1: // Data records.
+            case 2:
+            case 3:
+                if(count - 1 > addrBytes)
+                {
+                    addSegment(address, record + addrBytes, count - 1 - addrBytes);
+                }
+                break;
+            case 7: // Termination records.
+            case 8:
+            case 9:
+                proceed = false;
+                break;
+            default: // Header and record count (not used in flash loader).
+                break;
+        }
+    }
+
+    return finishParse();
+}
+
+bool FlashImage::parseBin(const uchar *a_Data, qint64 a_Size, quint32 a_BaseAddress)
+{
+    beginParse(eFormatBin, a_Size);
+
+    if(a_Size <= 0 || static_cast<quint64>(a_BaseAddress) + a_Size > 0x100000000ull)
+    {
+        m_error = eErrorFormat;
+        return false;
+    }
+
+    addSegment(a_BaseAddress, a_Data, static_cast<quint32>(a_Size));
+
+    return finishParse();
+}
+
+void FlashImage::addSegment(quint32 a_Address, const uchar *a_Data, quint32 a_Length)
+{
+    if(!m_segments.isEmpty() &&
+       m_segments.last().m_address + m_segments.last().m_length == a_Address)
+    {
+        //Continues the previous record, which also ends the backing buffer
+        m_segments.last().m_length += a_Length;
+    }
+    else
+    {
+        FlashSegment_t segment;
+        segment.m_address = a_Address;
+        segment.m_length = a_Length;
+        segment.m_offset = m_data.size();
+        if(m_segments.size() == m_segments.capacity())
+        {
+            m_allocations++;
+        }
+        m_segments.append(segment);
+    }
+    m_data.append(reinterpret_cast<const char *>(a_Data), static_cast<int>(a_Length));
+}
+
+bool FlashImage::sortSegments(void)
+{
+    std::sort(m_segments.begin(), m_segments.end(),
+              [](const FlashSegment_t &a, const FlashSegment_t &b) { return a.m_address < b.m_address; });
+
+    for(qint32 i = 1; i < m_segments.count(); i++)
+    {
+        const FlashSegment_t &prev = m_segments.at(i - 1);
+        if(static_cast<quint64>(prev.m_address) + prev.m_length > m_segments.at(i).m_address)
+        {
+            qCWarning(DBG_IOCFLASH_IMAGE, "Records overlap at 0x%08x", m_segments.at(i).m_address);
+            return false;
+        }
+    }
+    return true;
+}
+
+void FlashImage::buildBlocks(quint16 a_BlockSize, quint16 a_WriteAlign)
+{
+    qint32 count = 0;
+    qint32 i = 0;
+    quint32 addr;
+
+    //Drop joined blocks from an earlier build
+    m_data.truncate(static_cast<int>(m_imageSize));
+    m_blocks.clear();
+
+    for(const FlashSegment_t &segment : m_segments)
+    {
+        count += segment.m_length / a_BlockSize + 2;
+    }
+    m_blocks.reserve(count);
+    m_allocations++;
+
+    if(m_segments.isEmpty())
+    {
+        return;
+    }
+
+    addr = m_segments.at(0).m_address;
+    while(i < m_segments.count())
+    {
+        const FlashSegment_t &segment = m_segments.at(i);
+        quint32 blockStart = addr & ~static_cast<quint32>(a_BlockSize - 1);
+        quint64 blockEnd = static_cast<quint64>(blockStart) + a_BlockSize;
+        quint64 segmentEnd = static_cast<quint64>(segment.m_address) + segment.m_length;
+        qint32 last = i;
+
+        //Following segments starting in the same block are written together with this one
+        while(last + 1 < m_segments.count() && m_segments.at(last + 1).m_address < blockEnd)
+        {
+            last++;
+        }
+
+        if(last == i && (addr % a_WriteAlign) == 0)
+        {
+            FlashBlock_t block;
+            block.m_address = addr;
+            block.m_length = static_cast<quint16>(qMin(segmentEnd, blockEnd) - addr);
+            block.m_offset = segment.m_offset + (addr - segment.m_address);
+            m_blocks.append(block);
+        }
+        else
+        {
+            m_blocks.append(joinBlock(i, last, addr & ~static_cast<quint32>(a_WriteAlign - 1), blockEnd));
+        }
+
+        //Step to the next block boundary, or to the next segment
+        const FlashSegment_t &lastSegment = m_segments.at(last);
+        if(static_cast<quint64>(lastSegment.m_address) + lastSegment.m_length > blockEnd)
+        {
+            i = last;
+            addr = static_cast<quint32>(blockEnd);
+        }
+        else
+        {
+            i = last + 1;
+            if(i < m_segments.count())
+            {
+                addr = m_segments.at(i).m_address;
+            }
+        }
+    }
+
+    qCDebug(DBG_IOCFLASH_IMAGE) << m_blocks.count() << "blocks for" << m_segments.count() << "segments";
+}
+
+FlashBlock_t FlashImage::joinBlock(qint32 a_First, qint32 a_Last, quint32 a_Start, quint64 a_End)
+{
+    const FlashSegment_t &lastSegment = m_segments.at(a_Last);
+    quint64 end = qMin(static_cast<quint64>(lastSegment.m_address) + lastSegment.m_length, a_End);
+    qint64 offset = m_data.size();
+    qint32 capacity = m_data.capacity();
+    FlashBlock_t block;
+
+    block.m_address = a_Start;
+    block.m_length = static_cast<quint16>(end - a_Start);
+    block.m_offset = offset;
+
+    m_data.resize(static_cast<int>(offset + block.m_length));
+    if(m_data.capacity() != capacity)
+    {
+        m_allocations++;
+    }
+    memset(m_data.data() + offset, 0xff, block.m_length);
+
+    for(qint32 i = a_First; i <= a_Last; i++)
+    {
+        const FlashSegment_t &segment = m_segments.at(i);
+        quint32 from = qMax(segment.m_address, a_Start);
+        quint64 to = qMin(static_cast<quint64>(segment.m_address) + segment.m_length, end);
+
+        if(from < to)
+        {
+            memcpy(m_data.data() + offset + (from - a_Start),
+                   m_data.constData() + segment.m_offset + (from - segment.m_address),
+                   static_cast<size_t>(to - from));
+        }
+    }
+
+    return block;
+}
+
+bool FlashImage::parsePatch(const QString &a_Text, FlashPatch_t *a_pPatch)
+{
+    qint32 colon = a_Text.indexOf(':');
+    QByteArray hex = a_Text.mid(colon + 1).trimmed().toLatin1().toLower();
+    bool ok = false;
+
+    if(colon > 0)
+    {
+        a_pPatch->m_address = a_Text.left(colon).trimmed().toUInt(&ok, 0);
+    }
+    a_pPatch->m_data = QByteArray::fromHex(hex);
+
+    //fromHex skips anything that is not a hex digit
+    return ok && !hex.isEmpty() && a_pPatch->m_data.toHex() == hex &&
+           static_cast<quint64>(a_pPatch->m_address) + a_pPatch->m_data.size() <= 0x100000000ull;
+}
+
+void FlashImage::writePatch(const FlashPatch_t &a_Patch)
+{
+    quint32 addr = a_Patch.m_address;
+    quint64 end = static_cast<quint64>(addr) + a_Patch.m_data.size();
+    QVector<FlashSegment_t> gaps;
+
+    for(const FlashSegment_t &segment : m_segments)
+    {
+        quint64 segmentEnd = static_cast<quint64>(segment.m_address) + segment.m_length;
+
+        if(addr >= end)
+        {
+            break;
+        }
+        if(segmentEnd <= addr)
+        {
+            continue;
+        }
+
+        if(segment.m_address > addr)
+        {
+            FlashSegment_t gap;
+            gap.m_address = addr;
+            gap.m_length = static_cast<quint32>(qMin<quint64>(segment.m_address, end) - addr);
+            gaps.append(gap);
+            addr += gap.m_length;
+        }
+        if(addr < end)
+        {
+            quint32 length = static_cast<quint32>(qMin(segmentEnd, end) - addr);
+            memcpy(m_data.data() + segment.m_offset + (addr - segment.m_address),
+                   a_Patch.m_data.constData() + (addr - a_Patch.m_address), length);
+            addr += length;
+        }
+    }
+    if(addr < end)
+    {
+        FlashSegment_t gap;
+        gap.m_address = addr;
+        gap.m_length = static_cast<quint32>(end - addr);
+        gaps.append(gap);
+    }
+
+    for(FlashSegment_t &gap : gaps)
+    {
+        gap.m_offset = m_data.size();
+        m_data.append(a_Patch.m_data.constData() + (gap.m_address - a_Patch.m_address), static_cast<int>(gap.m_length));
+        m_segments.append(gap);
+    }
+
+    //The gaps were outside all segments, nothing can overlap
+    if(!gaps.isEmpty())
+    {
+        sortSegments();
+    }
+}
+
+QVector<FlashBlock_t> FlashImage::applyPatches(const QList<FlashPatch_t> &a_Patches, quint16 a_BlockSize, quint16 a_WriteAlign,
+                                               QVector<FlashBlock_t> *a_pBlocks)
+{
+    QVector<quint32> windows;
+    QVector<FlashBlock_t> rebuilt;
+
+    //The bytes of a cached plan are a read-only mapping, they are copied once here
+    m_data.detach();
+
+    for(const FlashPatch_t &patch : a_Patches)
+    {
+        if(patch.m_data.isEmpty())
+        {
+            continue;
+        }
+        writePatch(patch);
+
+        quint64 last = static_cast<quint64>(patch.m_address) + patch.m_data.size() - 1;
+        for(quint64 window = patch.m_address & ~static_cast<quint32>(a_BlockSize - 1); window <= last; window += a_BlockSize)
+        {
+            if(!windows.contains(static_cast<quint32>(window)))
+            {
+                windows.append(static_cast<quint32>(window));
+            }
+        }
+    }
+    std::sort(windows.begin(), windows.end());
+
+    for(quint32 window : windows)
+    {
+        quint64 windowEnd = static_cast<quint64>(window) + a_BlockSize;
+        qint32 first = 0;
+        qint32 last;
+
+        //Blocks never cross a window boundary
+        for(qint32 i = 0; i < a_pBlocks->count();)
+        {
+            if(a_pBlocks->at(i).m_address >= window && a_pBlocks->at(i).m_address < windowEnd)
+            {
+                a_pBlocks->remove(i);
+            }
+            else
+            {
+                i++;
+            }
+        }
+
+        //The patch made sure there is a segment in the window
+        while(static_cast<quint64>(m_segments.at(first).m_address) + m_segments.at(first).m_length <= window)
+        {
+            first++;
+        }
+        last = first;
+        while(last + 1 < m_segments.count() && m_segments.at(last + 1).m_address < windowEnd)
+        {
+            last++;
+        }
+
+        quint32 start = qMax(m_segments.at(first).m_address, window) & ~static_cast<quint32>(a_WriteAlign - 1);
+        rebuilt.append(joinBlock(first, last, start, windowEnd));
+    }
+
+    qCDebug(DBG_IOCFLASH_IMAGE) << a_Patches.count() << "patches," << rebuilt.count() << "blocks rebuilt";
+    return rebuilt;
+}
@@ -0,0 +1,189 @@
+#ifndef FLASH_IMAGE_H
+#define FLASH_IMAGE_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QList>
+#include <QString>
+#include <QVector>
+
+
+//! \brief A contiguous address range of the image, stored at m_offset in the image backing buffer
+struct FlashSegment_t
+{
+    quint32 m_address;
+    quint32 m_length;
+    qint64 m_offset;
+};
+
+//! \brief One write memory transaction, a view into the image backing buffer
+struct FlashBlock_t
+{
+    quint32 m_address;
+    quint16 m_length;
+    qint64 m_offset;
+};
+
+
+//! \brief Bytes written over the image for one unit, e.g. a serial number or calibration block
+struct FlashPatch_t
+{
+    quint32 m_address;
+    QByteArray m_data;
+};
+
+
+//! \brief Sparse flash image: sorted, non-overlapping segments over one backing buffer.
+//! Blocks are views into the same buffer. Only blocks that join several segments or need
+//! an aligned start are copied, into the end of the backing buffer after the image bytes.
+class FlashImage
+{
+    public:
+        //! \brief Parse errors
+        enum Error_t {eNoError = 0x00, eErrorFormat, eErrorBadRecord, eErrorChecksum, eErrorOverlap};
+
+        //! \brief Supported image file formats
+        enum Format_t {eFormatUnknown = 0x00, eFormatSim, eFormatIntelHex, eFormatSrec, eFormatBin};
+
+        //! \brief ctor
+        FlashImage();
+
+        //! \brief Forget the current image
+        void clear(void);
+
+        //! \brief Guess the format of an image file from its first bytes.
+        //! Anything that is not .sim, Intel HEX or S-record is taken as raw binary.
+        static Format_t detectFormat(const uchar *a_Data, qint64 a_Size);
+
+        //! \brief Detect the format of an image file and parse it
+        //! \param a_Data - file content, only read
+        //! \param a_Size - number of bytes in a_Data
+        //! \param a_BinBaseAddress - flash address of the first byte of a raw binary file
+        //! \return false on error, see error()
+        bool load(const uchar *a_Data, qint64 a_Size, quint32 a_BinBaseAddress);
+
+        //! \brief Parse an IAR simple code (.sim) file in a single pass
+        //! \param a_Data - file content, only read
+        //! \param a_Size - number of bytes in a_Data
+        //! \return false on error, see error()
+        bool parseSim(const uchar *a_Data, qint64 a_Size);
+
+        //! \brief Write a_Data as an IAR simple code (.sim) file of one data record at a_Address, parseSim reads it back
+        static QByteArray simFile(quint32 a_Address, const QByteArray &a_Data);
+
+        //! \brief Parse an Intel HEX file in a single pass, records are decoded straight into the image
+        bool parseIntelHex(const uchar *a_Data, qint64 a_Size);
+
+        //! \brief Parse a Motorola S-record file in a single pass, records are decoded straight into the image
+        bool parseSrec(const uchar *a_Data, qint64 a_Size);
+
+        //! \brief Take a raw binary file as one segment starting at a_BaseAddress
+        bool parseBin(const uchar *a_Data, qint64 a_Size, quint32 a_BaseAddress);
+
+        //! \brief Cut the image into write blocks aligned to a_BlockSize address boundaries.
+        //! Segments sharing a block are joined with 0xff filling the gap, so each block
+        //! boundary costs exactly one write. Blocks start on an a_WriteAlign boundary.
+        //! \param a_BlockSize - max bytes per write, power of two
+        //! \param a_WriteAlign - required start address alignment, power of two
+        void buildBlocks(quint16 a_BlockSize, quint16 a_WriteAlign);
+
+        //! \brief Parse a patch written as "ADDR:HEX", I.E "0x0807ff00:0102a0ff"
+        //! \return false if the address or the hex bytes are bad
+        static bool parsePatch(const QString &a_Text, FlashPatch_t *a_pPatch);
+
+        //! \brief Write patches over an image that is already cut into blocks, without parsing it again.
+        //! Patched bytes inside segments are changed in place, bytes outside them become new segments.
+        //! Only the a_BlockSize windows touched by a patch get new blocks; a_pBlocks loses its blocks
+        //! in those windows and keeps viewing the unchanged bytes everywhere else.
+        //! \param a_pBlocks - blocks the image is written with, e.g. the trimmed blocks of a cached plan
+        //! \return the new blocks of the touched windows, in address order
+        QVector<FlashBlock_t> applyPatches(const QList<FlashPatch_t> &a_Patches, quint16 a_BlockSize, quint16 a_WriteAlign,
+                                           QVector<FlashBlock_t> *a_pBlocks);
+
+        //! \brief Take over an already parsed and cut image, e.g. from a cached plan
+        //! \param a_Data - backing buffer as returned by data()
+        //! \param a_ImageSize - number of image bytes at the start of a_Data
+        void assign(const QByteArray &a_Data, qint64 a_ImageSize,
+                    const QVector<FlashSegment_t> &a_Segments, const QVector<FlashBlock_t> &a_Blocks);
+
+        //! \brief Backing buffer, image bytes followed by joined blocks
+        const QByteArray &data(void) const { return m_data; }
+
+        //! \brief Image content at a backing buffer offset
+        const char *constData(qint64 a_Offset) const { return m_data.constData() + a_Offset; }
+
+        //! \brief Image content of a block
+        const char *blockData(const FlashBlock_t &a_Block) const { return constData(a_Block.m_offset); }
+
+        const QVector<FlashSegment_t> &segments(void) const { return m_segments; }
+        const QVector<FlashBlock_t> &blocks(void) const { return m_blocks; }
+
+        //! \brief Total number of image bytes
+        qint64 size(void) const { return m_imageSize; }
+
+        Error_t error(void) const { return m_error; }
+
+        //! \brief Format of the last parsed file
+        Format_t format(void) const { return m_format; }
+
+        //! \brief Time spent in the last parse
+        qint64 parseTimeNs(void) const { return m_parseTimeNs; }
+
+        //! \brief Number of buffer allocations made by the last parse and block build
+        qint32 allocations(void) const { return m_allocations; }
+
+    private:
+        //! \brief Read a big endian uint of a_Size bytes and add its bytes to the checksum
+        //! \return false if the data ends before a_Size bytes
+        static bool readUint(const uchar **a_pCurr, const uchar *a_pEnd, qint32 a_Size, quint32 *a_pValue, quint32 *a_pChecksum);
+
+        //! \brief Append a_Value as a big endian uint of a_Size bytes and add its bytes to the checksum
+        static void appendUint(QByteArray *a_pData, quint32 a_Value, qint32 a_Size, quint32 *a_pChecksum);
+
+        //! \brief Read one byte written as two hex digits and add it to the checksum
+        //! \return false if the data ends or is not a hex digit
+        static bool readHexByte(const uchar **a_pCurr, const uchar *a_pEnd, quint8 *a_pValue, quint8 *a_pChecksum);
+
+        //! \brief Skip line ends and other white space between text records
+        static const uchar *skipSpace(const uchar *a_pCurr, const uchar *a_pEnd);
+
+        //! \brief Start parsing a file of a_Format, reserving a_Reserve bytes for the image
+        void beginParse(Format_t a_Format, qint64 a_Reserve);
+
+        //! \brief Sort and check the segments once all records are read
+        bool finishParse(void);
+
+        //! \brief Add a data record to the image, merging it with the previous segment when contiguous
+        void addSegment(quint32 a_Address, const uchar *a_Data, quint32 a_Length);
+
+        //! \brief Sort segments by address when the file had them out of order and check for overlaps
+        bool sortSegments(void);
+
+        //! \brief Copy the parts of segments a_First..a_Last that fall in [a_Start, a_End) to the end of
+        //! the backing buffer, gaps filled with 0xff
+        //! \return the block viewing the copy
+        FlashBlock_t joinBlock(qint32 a_First, qint32 a_Last, quint32 a_Start, quint64 a_End);
+
+        //! \brief Write one patch into the segments, adding segments for bytes outside them
+        void writePatch(const FlashPatch_t &a_Patch);
+
+        //! \brief Image bytes, all segments back to back, followed by joined blocks and patched bytes outside the image
+        QByteArray m_data;
+
+        //! \brief Number of image bytes at the start of m_data
+        qint64 m_imageSize;
+
+        //! \brief Sorted address ranges of the image
+        QVector<FlashSegment_t> m_segments;
+
+        //! \brief Write blocks, views into m_data
+        QVector<FlashBlock_t> m_blocks;
+
+        Error_t m_error;
+        Format_t m_format;
+        QElapsedTimer m_parseTimer;
+        qint64 m_parseTimeNs;
+        qint32 m_allocations;
+};
+
+#endif // FLASH_IMAGE_H
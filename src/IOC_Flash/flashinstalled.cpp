@@ -0,0 +1,64 @@
+#include "flashinstalled.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSettings>
+
+#include <QLoggingCategory>
+Q_LOGGING_CATEGORY(DBG_IOCFLASH_INSTALLED,"IOCFlash.Installed", QtInfoMsg)
+
+FlashInstalled::FlashInstalled(const QString &a_StateDir, const QString &a_Port)
+    : m_Path(QDir(a_StateDir).filePath("installed-" + QString(a_Port).replace('/', '_')))
+{
+}
+
+bool FlashInstalled::matches(const QByteArray &a_ImageHash, const QString &a_Version)
+{
+    if(!QFile::exists(m_Path))
+    {
+        return false;
+    }
+
+    QSettings record(m_Path, QSettings::IniFormat);
+    if(record.value("image").toByteArray() != a_ImageHash)
+    {
+        qCInfo(DBG_IOCFLASH_INSTALLED) << "Another image was flashed last";
+        return false;
+    }
+
+    QString version = record.value("version").toString();
+    if(version.isEmpty())
+    {
+        //First start since the update
+        record.setValue("version", a_Version);
+        record.sync();
+        return true;
+    }
+    if(version != a_Version)
+    {
+        qCInfo(DBG_IOCFLASH_INSTALLED) << "Image was flashed, but version" << qPrintable(version) << "is running";
+        return false;
+    }
+    return true;
+}
+
+void FlashInstalled::recordImage(const QByteArray &a_ImageHash)
+{
+    QDir().mkpath(QFileInfo(m_Path).absolutePath());
+
+    QSettings record(m_Path, QSettings::IniFormat);
+    record.setValue("image", a_ImageHash);
+    record.remove("version");
+    record.sync();
+
+    if(record.status() != QSettings::NoError)
+    {
+        qCWarning(DBG_IOCFLASH_INSTALLED) << "Unable to write" << qPrintable(m_Path);
+    }
+}
+
+void FlashInstalled::remove(void)
+{
+    QFile::remove(m_Path);
+}
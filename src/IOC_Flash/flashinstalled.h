@@ -0,0 +1,34 @@
+#ifndef FLASH_INSTALLED_H
+#define FLASH_INSTALLED_H
+
+#include <QByteArray>
+#include <QString>
+
+
+//! \brief The image last flashed to one IO Controller and the user SW version it reported
+//! afterwards, kept on disk so an update of the same image can be skipped
+class FlashInstalled
+{
+    public:
+        //! \brief ctor
+        //! \param a_StateDir - directory of the record, kept across reboots unlike the plan cache
+        //! \param a_Port - serial device of the IO Controller
+        FlashInstalled(const QString &a_StateDir, const QString &a_Port);
+
+        //! \brief True if a_ImageHash is the image flashed last and a_Version is what it reported.
+        //! The first version reported after the update is recorded and matches.
+        //! \param a_ImageHash - content hash of the image to flash
+        //! \param a_Version - user SW version reported by the running firmware
+        bool matches(const QByteArray &a_ImageHash, const QString &a_Version);
+
+        //! \brief Record a successful update, its version is recorded when it is first seen running
+        void recordImage(const QByteArray &a_ImageHash);
+
+        //! \brief Forget the record, the flash content is not known
+        void remove(void);
+
+    private:
+        QString m_Path;
+};
+
+#endif // FLASH_INSTALLED_H
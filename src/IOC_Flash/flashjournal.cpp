@@ -0,0 +1,98 @@
+#include "flashjournal.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSettings>
+#include <QStringList>
+
+#include <QLoggingCategory>
+Q_LOGGING_CATEGORY(DBG_IOCFLASH_JOURNAL,"IOCFlash.Journal", QtInfoMsg)
+
+FlashJournal::FlashJournal()
+    : m_AckedAddress(0)
+{
+}
+
+void FlashJournal::open(const QString &a_Path, const QByteArray &a_ImageHash)
+{
+    m_Path = a_Path;
+    m_ImageHash = a_ImageHash;
+    m_AckedAddress = 0;
+    m_ErasedPages.clear();
+
+    if(!QFile::exists(m_Path))
+    {
+        return;
+    }
+
+    QSettings journal(m_Path, QSettings::IniFormat);
+    if(journal.value("image").toByteArray() != m_ImageHash)
+    {
+        qCInfo(DBG_IOCFLASH_JOURNAL) << "Journal is for another image, starting over";
+        return;
+    }
+
+    m_AckedAddress = journal.value("acked").toString().toUInt(nullptr, 0);
+    for(const QString &page : journal.value("erased").toString().split(' ', QString::SkipEmptyParts))
+    {
+        m_ErasedPages.append(static_cast<quint16>(page.toUInt()));
+    }
+
+    qCInfo(DBG_IOCFLASH_JOURNAL, "Journal: %d pages erased, acknowledged up to 0x%08x", m_ErasedPages.count(), m_AckedAddress);
+}
+
+void FlashJournal::recordErased(const QList<quint16> &a_Pages)
+{
+    for(quint16 page : a_Pages)
+    {
+        if(!m_ErasedPages.contains(page))
+        {
+            m_ErasedPages.append(page);
+        }
+    }
+}
+
+void FlashJournal::recordAcked(quint32 a_EndAddress)
+{
+    m_AckedAddress = a_EndAddress;
+}
+
+void FlashJournal::save(void)
+{
+    QStringList pages;
+
+    if(m_Path.isEmpty())
+    {
+        return;
+    }
+
+    for(quint16 page : m_ErasedPages)
+    {
+        pages.append(QString::number(page));
+    }
+
+    QDir().mkpath(QFileInfo(m_Path).absolutePath());
+
+    QSettings journal(m_Path, QSettings::IniFormat);
+    journal.setValue("image", m_ImageHash);
+    journal.setValue("acked", "0x" + QString::number(m_AckedAddress, 16));
+    journal.setValue("erased", pages.join(' '));
+    journal.sync();
+
+    if(journal.status() != QSettings::NoError)
+    {
+        qCWarning(DBG_IOCFLASH_JOURNAL) << "Unable to write journal" << qPrintable(m_Path);
+    }
+}
+
+void FlashJournal::remove(void)
+{
+    m_AckedAddress = 0;
+    m_ErasedPages.clear();
+
+    if(!m_Path.isEmpty())
+    {
+        QFile::remove(m_Path);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef FLASH_JOURNAL_H
+#define FLASH_JOURNAL_H
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+
+
+//! \brief Progress of an update of one IO Controller, kept on disk so an interrupted
+//! update of the same image can resume instead of starting over
+class FlashJournal
+{
+    public:
+        //! \brief ctor
+        FlashJournal();
+
+        //! \brief Load the journal at a_Path. Progress recorded for another image is dropped.
+        //! \param a_Path - journal file
+        //! \param a_ImageHash - content hash of the image being flashed
+        void open(const QString &a_Path, const QByteArray &a_ImageHash);
+
+        //! \brief True if the update keeps this journal, I.E open was called
+        bool isOpen(void) const { return !m_Path.isEmpty(); }
+
+        //! \brief True if blocks of this image were acknowledged by the IO Controller
+        bool hasProgress(void) const { return m_AckedAddress != 0; }
+
+        //! \brief End address of the last block acknowledged, 0 if none
+        quint32 ackedAddress(void) const { return m_AckedAddress; }
+
+        //! \brief Pages erased for this image
+        const QList<quint16> &erasedPages(void) const { return m_ErasedPages; }
+
+        //! \brief Record erased pages
+        void recordErased(const QList<quint16> &a_Pages);
+
+        //! \brief Record an acknowledged block
+        //! \param a_EndAddress - address following the last byte of the block
+        void recordAcked(quint32 a_EndAddress);
+
+        //! \brief Write the journal to disk
+        void save(void);
+
+        //! \brief Forget all progress and delete the journal file
+        void remove(void);
+
+    private:
+        QString m_Path;
+        QByteArray m_ImageHash;
+        quint32 m_AckedAddress;
+        QList<quint16> m_ErasedPages;
+};
+
+#endif // FLASH_JOURNAL_H
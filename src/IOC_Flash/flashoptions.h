@@ -0,0 +1,92 @@
+#ifndef FLASH_OPTIONS_H
+#define FLASH_OPTIONS_H
+
+#include <QDir>
+#include <QList>
+#include <QString>
+#include "flashgeometry.h"
+#include "flashimage.h"
+
+
+//! \brief One IO Controller to flash: its bootloader UART and the GPIO lines driving boot mode and reset
+struct FlashTarget_t
+{
+    FlashTarget_t() : m_boot0("mcu_boot0"), m_boot1("mcu_boot1"), m_reset("mcu_reset")
+    {
+    }
+
+    //! \brief Serial device, I.E "/dev/ttymxc3"
+    QString m_port;
+
+    //! \brief GPIO line names
+    QString m_boot0;
+    QString m_boot1;
+    QString m_reset;
+};
+
+//! \brief Command line options controlling how the IO Controller is flashed
+struct FlashOptions_t
+{
+    FlashOptions_t() : m_delta(false), m_verify(false), m_useCache(true), m_resume(true), m_verifyOnly(false), m_ifChanged(false), m_fastExit(false),
+        m_cacheDir(QDir::tempPath() + "/iocflash-cache"), m_stateDir("/var/lib/iocflash"), m_binBaseAddress(0x08000000u),
+        m_chipId(FlashGeometry::DEFAULT_PID), m_dumpAddress(FlashGeometry::FLASH_BASE_ADDRESS), m_dumpLength(0),
+        m_progressFd(-1)
+    {
+    }
+
+    //! \brief Read back the current flash and only erase/program pages that differ
+    bool m_delta;
+
+    //! \brief Read back and compare the programmed blocks before leaving the bootloader
+    bool m_verify;
+
+    //! \brief Load the flash plan from the plan cache when the image was seen before
+    bool m_useCache;
+
+    //! \brief Continue an interrupted update of the same image from the journal in m_cacheDir
+    bool m_resume;
+
+    //! \brief Read back and compare the flash with the image without erasing or programming
+    bool m_verifyOnly;
+
+    //! \brief Skip targets running the firmware last flashed from this image
+    bool m_ifChanged;
+
+    //! \brief Start the application with the bootloader GO command and wait for it to answer, instead of a reset
+    bool m_fastExit;
+
+    //! \brief Directory of the plan cache and the update journals
+    QString m_cacheDir;
+
+    //! \brief Directory of the installed image records, it must survive a reboot for --if-changed
+    QString m_stateDir;
+
+    //! \brief Flash address of the first byte of a raw binary image
+    quint32 m_binBaseAddress;
+
+    //! \brief Product ID of the chip expected, the plan is made for it until the bootloader tells the real one
+    quint16 m_chipId;
+
+    //! \brief --dump: read memory into this file, .sim or raw binary by its suffix
+    QString m_dumpFile;
+
+    //! \brief --dump: first address read
+    quint32 m_dumpAddress;
+
+    //! \brief --dump: bytes read, 0 for up to the end of flash
+    quint32 m_dumpLength;
+
+    //! \brief --patch: bytes written over the image for this unit, later patches win where they overlap
+    QList<FlashPatch_t> m_patches;
+
+    //! \brief --progress: descriptor the progress lines are written to, -1 for none
+    int m_progressFd;
+
+    //! \brief Write a JSON timing summary of the update to this file, none if empty
+    QString m_statsJson;
+
+    //! \brief IO Controllers flashed concurrently. Empty: the --com-port controller with the default GPIO lines
+    QList<FlashTarget_t> m_targets;
+};
+
+#endif // FLASH_OPTIONS_H
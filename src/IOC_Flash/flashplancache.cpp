@@ -0,0 +1,341 @@
+#include "flashplancache.h"
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <cstddef>
+#include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <QLoggingCategory>
+Q_LOGGING_CATEGORY(DBG_IOCFLASH_PLAN_CACHE,"IOCFlash.PlanCache", QtInfoMsg)
+
+namespace
+{
+    //! \brief Plan file header, followed by segments, blocks, erase pages and image bytes
+    struct PlanHeader_t
+    {
+        quint32 m_magic;
+        quint32 m_version;
+        quint32 m_segmentSize;
+        quint32 m_blockSize;
+        FlashPlanLayout_t m_layout;
+        qint32 m_parseError;
+        qint32 m_segmentCount;
+        qint32 m_blockCount;
+        qint32 m_erasePageCount;
+        qint64 m_imageSize;
+        qint64 m_dataSize;
+
+        //! \brief SHA-256 of everything after the header
+        char m_payloadHash[32];
+    };
+
+    const quint32 PLAN_MAGIC = 0x50434f49; // "IOCP"
+
+    qint64 alignUp(qint64 a_Value)
+    {
+        return (a_Value + 7) & ~static_cast<qint64>(7);
+    }
+}
+
+FlashPlanCache::FlashPlanCache()
+    : m_pMapped(nullptr)
+{
+}
+
+FlashPlanCache::~FlashPlanCache()
+{
+    release();
+}
+
+void FlashPlanCache::setDirectory(const QString &a_Dir)
+{
+    m_Dir = a_Dir;
+}
+
+QByteArray FlashPlanCache::contentHash(const QByteArray &a_FileData)
+{
+    return QCryptographicHash::hash(a_FileData, QCryptographicHash::Sha256).toHex();
+}
+
+QByteArray FlashPlanCache::contentHash(const QByteArray &a_FileHash, const QList<FlashPatch_t> &a_Patches)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+
+    if(a_Patches.isEmpty())
+    {
+        return a_FileHash;
+    }
+
+    hash.addData(a_FileHash);
+    for(const FlashPatch_t &patch : a_Patches)
+    {
+        hash.addData(QByteArray::number(patch.m_address, 16) + ':' + patch.m_data.toHex() + '\n');
+    }
+    return hash.result().toHex();
+}
+
+QString FlashPlanCache::planPath(const QByteArray &a_Key) const
+{
+    return QDir(m_Dir).filePath(QString::fromLatin1(a_Key) + ".plan");
+}
+
+void FlashPlanCache::release(void)
+{
+    if(m_pMapped)
+    {
+        m_File.unmap(m_pMapped);
+        m_pMapped = nullptr;
+    }
+    if(m_File.isOpen())
+    {
+        m_File.close();
+    }
+}
+
+bool FlashPlanCache::load(const QByteArray &a_Key, const FlashPlanLayout_t &a_Layout, FlashImage *a_pImage,
+                          QVector<FlashBlock_t> *a_pBlocks, QList<quint16> *a_pErasePages, qint32 *a_pParseError)
+{
+    PlanHeader_t header;
+    qint64 pos;
+
+    release();
+    if(!secureDirectory(false))
+    {
+        return false;
+    }
+    m_File.setFileName(planPath(a_Key));
+    if(!m_File.open(QIODevice::ReadOnly))
+    {
+        return false;
+    }
+
+    if(m_File.size() < static_cast<qint64>(sizeof(header)) ||
+       (m_pMapped = m_File.map(0, m_File.size())) == nullptr)
+    {
+        release();
+        return false;
+    }
+
+    memcpy(&header, m_pMapped, sizeof(header));
+    pos = alignUp(sizeof(header));
+
+    if(header.m_magic != PLAN_MAGIC || header.m_version != FORMAT_VERSION ||
+       header.m_segmentSize != sizeof(FlashSegment_t) || header.m_blockSize != sizeof(FlashBlock_t) ||
+       memcmp(&header.m_layout, &a_Layout, sizeof(a_Layout)) != 0 ||
+       header.m_segmentCount < 0 || header.m_blockCount < 0 || header.m_erasePageCount < 0 ||
+       header.m_imageSize < 0 || header.m_dataSize < header.m_imageSize ||
+       m_File.size() != pos + alignUp(header.m_segmentCount * sizeof(FlashSegment_t)) +
+                        alignUp(header.m_blockCount * sizeof(FlashBlock_t)) +
+                        alignUp(header.m_erasePageCount * sizeof(quint16)) + header.m_dataSize)
+    {
+        qCInfo(DBG_IOCFLASH_PLAN_CACHE) << "Stale plan, rebuilding:" << qPrintable(m_File.fileName());
+        release();
+        return false;
+    }
+
+    //Catches a damaged plan of the right size, the directory check keeps others from writing one
+    QByteArray payloadHash = QCryptographicHash::hash(QByteArray::fromRawData(reinterpret_cast<const char *>(m_pMapped + pos),
+                                                                              static_cast<int>(m_File.size() - pos)),
+                                                      QCryptographicHash::Sha256);
+    if(memcmp(payloadHash.constData(), header.m_payloadHash, sizeof(header.m_payloadHash)) != 0)
+    {
+        qCWarning(DBG_IOCFLASH_PLAN_CACHE) << "Damaged plan, rebuilding:" << qPrintable(m_File.fileName());
+        release();
+        return false;
+    }
+
+    QVector<FlashSegment_t> segments(header.m_segmentCount);
+    memcpy(segments.data(), m_pMapped + pos, header.m_segmentCount * sizeof(FlashSegment_t));
+    pos += alignUp(header.m_segmentCount * sizeof(FlashSegment_t));
+
+    a_pBlocks->resize(header.m_blockCount);
+    memcpy(a_pBlocks->data(), m_pMapped + pos, header.m_blockCount * sizeof(FlashBlock_t));
+    pos += alignUp(header.m_blockCount * sizeof(FlashBlock_t));
+
+    a_pErasePages->clear();
+    for(qint32 i = 0; i < header.m_erasePageCount; i++)
+    {
+        quint16 page;
+        memcpy(&page, m_pMapped + pos + i * sizeof(quint16), sizeof(page));
+        a_pErasePages->append(page);
+    }
+    pos += alignUp(header.m_erasePageCount * sizeof(quint16));
+
+    if(!checkRanges(header.m_imageSize, header.m_dataSize, a_Layout, segments, *a_pBlocks))
+    {
+        qCWarning(DBG_IOCFLASH_PLAN_CACHE) << "Plan views bytes outside its image, rebuilding:" << qPrintable(m_File.fileName());
+        a_pBlocks->clear();
+        release();
+        return false;
+    }
+
+    //The image bytes are used from the mapping, not copied
+    a_pImage->assign(QByteArray::fromRawData(reinterpret_cast<const char *>(m_pMapped + pos), static_cast<int>(header.m_dataSize)),
+                     header.m_imageSize, segments, *a_pBlocks);
+    *a_pParseError = header.m_parseError;
+
+    return true;
+}
+
+bool FlashPlanCache::store(const QByteArray &a_Key, const FlashPlanLayout_t &a_Layout, const FlashImage &a_Image,
+                           const QVector<FlashBlock_t> &a_Blocks, const QList<quint16> &a_ErasePages, qint32 a_ParseError)
+{
+    PlanHeader_t header;
+    QByteArray plan;
+
+    if(!secureDirectory(true))
+    {
+        return false;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.m_magic = PLAN_MAGIC;
+    header.m_version = FORMAT_VERSION;
+    header.m_segmentSize = sizeof(FlashSegment_t);
+    header.m_blockSize = sizeof(FlashBlock_t);
+    header.m_layout = a_Layout;
+    header.m_parseError = a_ParseError;
+    header.m_segmentCount = a_Image.segments().count();
+    header.m_blockCount = a_Blocks.count();
+    header.m_erasePageCount = a_ErasePages.count();
+    header.m_imageSize = a_Image.size();
+    header.m_dataSize = a_Image.data().size();
+
+    plan.reserve(static_cast<int>(alignUp(sizeof(header)) + alignUp(header.m_segmentCount * sizeof(FlashSegment_t)) +
+                                  alignUp(header.m_blockCount * sizeof(FlashBlock_t)) +
+                                  alignUp(header.m_erasePageCount * sizeof(quint16)) + header.m_dataSize));
+
+    plan.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    plan.resize(static_cast<int>(alignUp(plan.size())));
+    plan.append(reinterpret_cast<const char *>(a_Image.segments().constData()), header.m_segmentCount * sizeof(FlashSegment_t));
+    plan.resize(static_cast<int>(alignUp(plan.size())));
+    plan.append(reinterpret_cast<const char *>(a_Blocks.constData()), header.m_blockCount * sizeof(FlashBlock_t));
+    plan.resize(static_cast<int>(alignUp(plan.size())));
+    for(quint16 page : a_ErasePages)
+    {
+        plan.append(reinterpret_cast<const char *>(&page), sizeof(page));
+    }
+    plan.resize(static_cast<int>(alignUp(plan.size())));
+    plan.append(a_Image.data());
+
+    qint32 payload = static_cast<qint32>(alignUp(sizeof(header)));
+    QByteArray payloadHash = QCryptographicHash::hash(QByteArray::fromRawData(plan.constData() + payload, plan.size() - payload),
+                                                      QCryptographicHash::Sha256);
+    memcpy(plan.data() + offsetof(PlanHeader_t, m_payloadHash), payloadHash.constData(), sizeof(header.m_payloadHash));
+
+    QSaveFile file(planPath(a_Key));
+    if(!file.open(QIODevice::WriteOnly) || file.write(plan) != plan.size() || !file.commit())
+    {
+        qCWarning(DBG_IOCFLASH_PLAN_CACHE) << "Unable to write plan" << qPrintable(file.fileName());
+        return false;
+    }
+
+    prune();
+    return true;
+}
+
+bool FlashPlanCache::secureDirectory(bool a_Create) const
+{
+    struct stat info;
+
+    if(a_Create && !QDir().mkpath(m_Dir))
+    {
+        qCWarning(DBG_IOCFLASH_PLAN_CACHE) << "Unable to create cache directory" << qPrintable(m_Dir);
+        return false;
+    }
+    if(lstat(qPrintable(m_Dir), &info) != 0)
+    {
+        return false;
+    }
+
+    //Under /tmp anybody could have made the directory first and put plans in it
+    if(!S_ISDIR(info.st_mode) || info.st_uid != geteuid())
+    {
+        qCWarning(DBG_IOCFLASH_PLAN_CACHE) << "Cache directory" << qPrintable(m_Dir) << "is not a directory of this user, not using it";
+        return false;
+    }
+    if((info.st_mode & (S_IRWXG | S_IRWXO)) != 0 && chmod(qPrintable(m_Dir), S_IRWXU) != 0)
+    {
+        qCWarning(DBG_IOCFLASH_PLAN_CACHE) << "Unable to restrict cache directory" << qPrintable(m_Dir);
+        return false;
+    }
+    return true;
+}
+
+bool FlashPlanCache::checkRanges(qint64 a_ImageSize, qint64 a_DataSize, const FlashPlanLayout_t &a_Layout,
+                                 const QVector<FlashSegment_t> &a_Segments, const QVector<FlashBlock_t> &a_Blocks)
+{
+    for(qint32 i = 0; i < a_Segments.count(); i++)
+    {
+        const FlashSegment_t &segment = a_Segments.at(i);
+        if(segment.m_offset < 0 || segment.m_offset + segment.m_length > a_ImageSize ||
+           static_cast<quint64>(segment.m_address) + segment.m_length > 0x100000000ull ||
+           (i > 0 && static_cast<quint64>(a_Segments.at(i - 1).m_address) + a_Segments.at(i - 1).m_length > segment.m_address))
+        {
+            return false;
+        }
+    }
+
+    for(const FlashBlock_t &block : a_Blocks)
+    {
+        quint64 blockEnd = static_cast<quint64>(block.m_address) + block.m_length;
+        bool inSegment = false;
+
+        if(block.m_offset < 0 || block.m_offset + block.m_length > a_DataSize || block.m_length > a_Layout.m_blockSize)
+        {
+            return false;
+        }
+
+        for(const FlashSegment_t &segment : a_Segments)
+        {
+            quint64 segmentEnd = static_cast<quint64>(segment.m_address) + segment.m_length;
+            if(block.m_offset < a_ImageSize)
+            {
+                //A view into the image bytes of one segment
+                inSegment = block.m_address >= segment.m_address && blockEnd <= segmentEnd &&
+                            block.m_offset == segment.m_offset + (block.m_address - segment.m_address);
+            }
+            else
+            {
+                //A joined copy, holding bytes of at least one segment
+                inSegment = block.m_address < segmentEnd && blockEnd > segment.m_address;
+            }
+            if(inSegment)
+            {
+                break;
+            }
+        }
+        if(!inSegment)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void FlashPlanCache::prune(void)
+{
+    QDir dir(m_Dir);
+    QStringList plans = dir.entryList(QStringList() << "*.plan", QDir::Files, QDir::Time);
+
+    //Newest first
+    for(qint32 i = MAX_ENTRIES; i < plans.count(); i++)
+    {
+        dir.remove(plans.at(i));
+    }
+}
+
+void FlashPlanCache::clear(void)
+{
+    QDir dir(m_Dir);
+
+    release();
+    for(const QString &plan : dir.entryList(QStringList() << "*.plan", QDir::Files))
+    {
+        dir.remove(plan);
+    }
+}
@@ -0,0 +1,110 @@
+#ifndef FLASH_PLAN_CACHE_H
+#define FLASH_PLAN_CACHE_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QList>
+#include <QString>
+#include <QVector>
+#include "flashimage.h"
+
+
+//! \brief Parameters a cached plan was built for. A plan built with other values is rebuilt.
+struct FlashPlanLayout_t
+{
+    quint16 m_blockSize;
+    quint16 m_writeAlign;
+    quint32 m_flashBase;
+
+    //! \brief Product ID of the chip whose flash sectors the erase pages are numbered in
+    quint32 m_chipId;
+
+    //! \brief Address a raw binary image is loaded at
+    quint32 m_binBaseAddress;
+};
+
+
+//! \brief Directory of ready-to-flash plans (image bytes, write blocks, erase pages and parse result)
+//! keyed by the SHA-256 of the image file. A cached plan is memory mapped, the image bytes are used
+//! straight from the mapping.
+class FlashPlanCache
+{
+    public:
+        //! \brief ctor
+        FlashPlanCache();
+
+        //! \brief dtor
+        ~FlashPlanCache();
+
+        //! \brief Set the cache directory, created on first store
+        void setDirectory(const QString &a_Dir);
+
+        //! \brief Hash identifying an image file
+        static QByteArray contentHash(const QByteArray &a_FileData);
+
+        //! \brief Hash identifying an image file with per unit patches written over it.
+        //! The plan is still cached under the hash of the file, this one keys journals and installed records.
+        //! \param a_FileHash - contentHash of the image file
+        static QByteArray contentHash(const QByteArray &a_FileHash, const QList<FlashPatch_t> &a_Patches);
+
+        //! \brief Load a cached plan
+        //! \param a_Key - content hash of the image file
+        //! \param a_Layout - parameters the plan must have been built for
+        //! \param a_pImage - gets the image, its bytes stay mapped until the next load or destruction
+        //! \param a_pBlocks - gets the blocks to write
+        //! \param a_pErasePages - gets the pages to erase
+        //! \param a_pParseError - gets the parse result stored with the plan
+        //! \return false if there is no valid plan for a_Key and a_Layout
+        bool load(const QByteArray &a_Key, const FlashPlanLayout_t &a_Layout, FlashImage *a_pImage,
+                  QVector<FlashBlock_t> *a_pBlocks, QList<quint16> *a_pErasePages, qint32 *a_pParseError);
+
+        //! \brief Store a plan, replacing any plan with the same key
+        //! \return false if the plan could not be written
+        bool store(const QByteArray &a_Key, const FlashPlanLayout_t &a_Layout, const FlashImage &a_Image,
+                   const QVector<FlashBlock_t> &a_Blocks, const QList<quint16> &a_ErasePages, qint32 a_ParseError);
+
+        //! \brief Remove all cached plans
+        void clear(void);
+
+    private:
+        //! \brief Copy constructor blocked
+        FlashPlanCache(const FlashPlanCache &a_Right);
+
+        //! \brief Assignment operator blocked
+        FlashPlanCache &operator=(const FlashPlanCache &a_Right);
+
+        //! \brief Path of the plan file for a key
+        QString planPath(const QByteArray &a_Key) const;
+
+        //! \brief Check the cache directory belongs to this user and only this user can write it
+        //! \param a_Create - create it first if missing
+        //! \return false if plans in it must not be trusted or stored
+        bool secureDirectory(bool a_Create) const;
+
+        //! \brief Check every segment and block of a loaded plan views bytes inside the plan,
+        //! in address order, and every block holds bytes of a segment
+        static bool checkRanges(qint64 a_ImageSize, qint64 a_DataSize, const FlashPlanLayout_t &a_Layout,
+                                const QVector<FlashSegment_t> &a_Segments, const QVector<FlashBlock_t> &a_Blocks);
+
+        //! \brief Remove the oldest plans when there are more than MAX_ENTRIES
+        void prune(void);
+
+        //! \brief Unmap and close the currently loaded plan
+        void release(void);
+
+        //! \brief Bumped whenever the plan file layout changes, older plans are rebuilt
+        static const quint32 FORMAT_VERSION = 4;
+
+        //! \brief Max number of plans kept in the cache directory
+        static const qint32 MAX_ENTRIES = 32;
+
+        QString m_Dir;
+
+        //! \brief The loaded plan file, kept open while mapped
+        QFile m_File;
+
+        //! \brief Mapping of m_File
+        uchar *m_pMapped;
+};
+
+#endif // FLASH_PLAN_CACHE_H
@@ -0,0 +1,171 @@
+#include "flashprogress.h"
+
+#include <QJsonDocument>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <QLoggingCategory>
+Q_LOGGING_CATEGORY(DBG_IOCFLASH_PROGRESS,"IOCFlash.Progress", QtInfoMsg)
+
+FlashProgress::FlashProgress(int a_Fd, QObject *a_pParent)
+    : QObject(a_pParent)
+    , m_Fd(a_Fd)
+    , m_Dropped(0)
+{
+    if(fcntl(m_Fd, F_GETFD) < 0)
+    {
+        qCWarning(DBG_IOCFLASH_PROGRESS, "Progress descriptor %d is not open", m_Fd);
+    }
+
+    m_Clock.start();
+    m_Timer.setTimerType(Qt::CoarseTimer);
+    connect(&m_Timer, &QTimer::timeout, this, &FlashProgress::writeLines);
+}
+
+void FlashProgress::track(IoControllerUpdateThread *a_pThread)
+{
+    Target_t target;
+    target.m_port = a_pThread->target().m_port;
+    target.m_phase = FlashStats::ePhaseCount;
+    target.m_done = 0;
+    target.m_total = 0;
+    target.m_blocks = 0;
+    target.m_changed = false;
+    target.m_phaseDone = 0;
+    target.m_phaseMs = 0;
+    target.m_lineDone = 0;
+    target.m_lineMs = 0;
+    m_Targets.insert(a_pThread, target);
+
+    //Called once per block, only the counters are taken
+    connect(a_pThread, &IoControllerUpdateThread::progress, this,
+            [this, a_pThread](FlashStats::Phase_t a_Phase, qint64 a_Done, qint64 a_Total)
+    {
+        Target_t &target = m_Targets[a_pThread];
+        if(target.m_phase != a_Phase)
+        {
+            target.m_phase = a_Phase;
+            target.m_blocks = 0;
+            target.m_phaseDone = target.m_lineDone = target.m_done = 0;
+            target.m_phaseMs = target.m_lineMs = m_Clock.elapsed();
+        }
+        target.m_done = a_Done;
+        target.m_total = a_Total;
+        target.m_blocks++;
+        target.m_changed = true;
+    });
+
+    if(!m_Timer.isActive())
+    {
+        m_Timer.start(PROGRESS_INTERVAL);
+    }
+}
+
+void FlashProgress::finished(IoControllerUpdateThread *a_pThread, bool a_Result)
+{
+    Target_t target = m_Targets.take(a_pThread);
+    disconnect(a_pThread, nullptr, this, nullptr);
+
+    if(target.m_changed)
+    {
+        writeProgress(&target);
+    }
+
+    QJsonObject line;
+    line["port"] = target.m_port;
+    line["phase"] = "done";
+    line["result"] = a_Result;
+    line["ms"] = m_Clock.elapsed();
+    writeLine(line, true);
+
+    if(m_Targets.isEmpty())
+    {
+        //The timer stays until the rest of the last line is written
+        if(m_Pending.isEmpty())
+        {
+            m_Timer.stop();
+        }
+        if(m_Dropped > 0)
+        {
+            qCInfo(DBG_IOCFLASH_PROGRESS, "%d progress lines dropped, the reader was behind", m_Dropped);
+        }
+    }
+}
+
+void FlashProgress::writeLines(void)
+{
+    if(flushPending() && m_Targets.isEmpty())
+    {
+        m_Timer.stop();
+        return;
+    }
+
+    for(Target_t &target : m_Targets)
+    {
+        if(target.m_changed)
+        {
+            writeProgress(&target);
+        }
+    }
+}
+
+void FlashProgress::writeProgress(Target_t *a_pTarget)
+{
+    qint64 now = m_Clock.elapsed();
+    qint64 rate = (a_pTarget->m_done - a_pTarget->m_lineDone) * 1000 / qMax<qint64>(now - a_pTarget->m_lineMs, 1);
+    qint64 avgRate = (a_pTarget->m_done - a_pTarget->m_phaseDone) * 1000 / qMax<qint64>(now - a_pTarget->m_phaseMs, 1);
+    QJsonObject line;
+
+    line["port"] = a_pTarget->m_port;
+    line["phase"] = FlashStats::phaseName(a_pTarget->m_phase);
+    line["done"] = a_pTarget->m_done;
+    line["total"] = a_pTarget->m_total;
+    line["blocks"] = a_pTarget->m_blocks;
+    line["bytes_per_s"] = rate;
+    line["avg_bytes_per_s"] = avgRate;
+    line["eta_ms"] = avgRate > 0 ? (a_pTarget->m_total - a_pTarget->m_done) * 1000 / avgRate : -1;
+    line["ms"] = now;
+    writeLine(line);
+
+    a_pTarget->m_lineDone = a_pTarget->m_done;
+    a_pTarget->m_lineMs = now;
+    a_pTarget->m_changed = false;
+}
+
+void FlashProgress::writeLine(const QJsonObject &a_Line, bool a_Keep)
+{
+    if(!flushPending() && !a_Keep)
+    {
+        m_Dropped++;
+        return;
+    }
+
+    m_Pending += QJsonDocument(a_Line).toJson(QJsonDocument::Compact) + '\n';
+    flushPending();
+}
+
+bool FlashProgress::flushPending(void)
+{
+    while(!m_Pending.isEmpty())
+    {
+        struct pollfd pollFd;
+        pollFd.fd = m_Fd;
+        pollFd.events = POLLOUT;
+        pollFd.revents = 0;
+
+        //A pipe that polls writable takes PIPE_BUF bytes, more than a line
+        if(poll(&pollFd, 1, 0) != 1 || !(pollFd.revents & POLLOUT))
+        {
+            return false;
+        }
+
+        ssize_t written = ::write(m_Fd, m_Pending.constData(), static_cast<size_t>(m_Pending.size()));
+        if(written <= 0)
+        {
+            return false;
+        }
+        m_Pending.remove(0, static_cast<int>(written));
+    }
+    return true;
+}
@@ -0,0 +1,91 @@
+#ifndef FLASH_PROGRESS_H
+#define FLASH_PROGRESS_H
+
+#include <QObject>
+#include <QMap>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include "iocontrollerupdatethread.h"
+
+
+//! \brief --progress: one JSON line per target and PROGRESS_INTERVAL while it reports progress
+//!   {"port": "/dev/ttymxc3", "phase": "program", "done": 20480, "total": 65536, "blocks": 80,
+//!    "bytes_per_s": 9830, "avg_bytes_per_s": 9611, "eta_ms": 4688, "ms": 3120}
+//! and a last one when its update is finished
+//!   {"port": "/dev/ttymxc3", "phase": "done", "result": true, "ms": 9950}
+//! The update only stores its counters here, the lines are written from a timer once poll() tells the
+//! descriptor takes data. Lines are dropped while the reader is behind, the update never waits for it.
+//! The flags of the descriptor are left alone, it is usually shared with the caller.
+class FlashProgress : public QObject
+{
+    Q_OBJECT
+
+    public:
+        //! \brief ctor
+        //! \param a_Fd - descriptor the lines are written to
+        explicit FlashProgress(int a_Fd, QObject *a_pParent = nullptr);
+
+        //! \brief Report the progress of a_pThread until finished is called for it
+        void track(IoControllerUpdateThread *a_pThread);
+
+        //! \brief The update of a_pThread is done, write its last lines
+        void finished(IoControllerUpdateThread *a_pThread, bool a_Result);
+
+        //! \brief Time between the lines of a target
+        static const qint32 PROGRESS_INTERVAL = 250; //ms
+
+    private:
+        //! \brief Copy constructor blocked
+        FlashProgress(const FlashProgress &a_Right);
+
+        //! \brief Assignment operator blocked
+        FlashProgress &operator=(const FlashProgress &a_Right);
+
+        struct Target_t
+        {
+            QString m_port;
+            FlashStats::Phase_t m_phase;
+            qint64 m_done;
+            qint64 m_total;
+            qint32 m_blocks;
+
+            //! \brief Progress reported since the last line
+            bool m_changed;
+
+            //! \brief Bytes done and time at the start of the phase and at the last line
+            qint64 m_phaseDone;
+            qint64 m_phaseMs;
+            qint64 m_lineDone;
+            qint64 m_lineMs;
+        };
+
+        //! \brief Write the line of a target and start the next interval
+        void writeProgress(Target_t *a_pTarget);
+
+        //! \brief Queue one line and write it, dropped while an earlier line is still not written
+        //! \param a_Keep - queue the line even behind an unwritten one, for the last line of a target
+        void writeLine(const QJsonObject &a_Line, bool a_Keep = false);
+
+        //! \brief Write m_Pending as far as the descriptor takes it without waiting
+        //! \return true if all of it was written
+        bool flushPending(void);
+
+        int m_Fd;
+
+        //! \brief Rest of a line the descriptor did not take yet, written before any other line
+        QByteArray m_Pending;
+
+        QTimer m_Timer;
+        QElapsedTimer m_Clock;
+        QMap<IoControllerUpdateThread *, Target_t> m_Targets;
+
+        //! \brief Lines dropped as the reader was behind
+        qint32 m_Dropped;
+
+    private slots:
+        //! \brief Write the lines of the targets that progressed
+        void writeLines(void);
+};
+
+#endif // FLASH_PROGRESS_H
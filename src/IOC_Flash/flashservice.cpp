@@ -0,0 +1,349 @@
+#include "flashservice.h"
+#include "flashinstalled.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QtConcurrent>
+#include <grp.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <QLoggingCategory>
+Q_LOGGING_CATEGORY(DBG_IOCFLASH_SERVICE,"IOCFlash.Service", QtInfoMsg)
+
+FlashService::FlashService(const QList<FlashTarget_t> &a_Targets, const FlashOptions_t &a_Options, QObject *a_pParent)
+    : QObject(a_pParent)
+    , m_Options(a_Options)
+    , m_JobSerial(0)
+{
+    connect(&m_Server, &QLocalServer::newConnection, this, &FlashService::newConnection);
+
+    for(const FlashTarget_t &target : a_Targets)
+    {
+        Target_t *pTarget = new Target_t;
+        pTarget->m_target = target;
+        pTarget->m_busy = false;
+
+        //The GPIO lines are requested here and kept
+        pTarget->m_pUpdater = new IoControllerUpdateThread(target);
+        connect(pTarget->m_pUpdater, &IoControllerUpdateThread::updateFinished, this, [this, pTarget](bool a_Result)
+        {
+            QJsonObject reply;
+            reply["result"] = a_Result;
+            reply["bytes"] = pTarget->m_pUpdater->bytesProgrammed();
+
+            if(pTarget->m_running.m_op == "flash")
+            {
+                //A failed update may have left anything in flash
+                FlashInstalled installed(pTarget->m_running.m_options.m_stateDir, pTarget->m_target.m_port);
+                if(a_Result)
+                {
+                    installed.recordImage(pTarget->m_pUpdater->imageHash());
+                }
+                else
+                {
+                    installed.remove();
+                }
+            }
+            finishJob(pTarget, reply);
+        });
+        connect(pTarget->m_pUpdater, &IoControllerUpdateThread::progress, this,
+                [pTarget](FlashStats::Phase_t a_Phase, qint64 a_Done, qint64 a_Total)
+        {
+            QJsonObject event;
+            event["event"] = "progress";
+            event["phase"] = FlashStats::phaseName(a_Phase);
+            event["done"] = a_Done;
+            event["total"] = a_Total;
+            send(pTarget->m_running, event);
+        });
+
+        pTarget->m_pPort = new QextSerialPort(target.m_port, QextSerialPort::EventDriven);
+        //Not the QextSerialPort defaults, the UART has no RTS/CTS. Baud rate and parity are set per job.
+        pTarget->m_pPort->setFlowControl(FLOW_OFF);
+        pTarget->m_pPort->setDataBits(DATA_8);
+        pTarget->m_pPort->setStopBits(STOP_1);
+        if(pTarget->m_pPort->open(QIODevice::ReadWrite))
+        {
+            pTarget->m_pUpdater->setSerialPort(pTarget->m_pPort);
+        }
+        else
+        {
+            //Each job tries to open it again
+            qCWarning(DBG_IOCFLASH_SERVICE) << "Unable to open serial port:" << qPrintable(target.m_port);
+            delete pTarget->m_pPort;
+            pTarget->m_pPort = nullptr;
+        }
+
+        m_Targets.append(pTarget);
+    }
+}
+
+FlashService::~FlashService()
+{
+    for(Target_t *pTarget : m_Targets)
+    {
+        delete pTarget->m_pUpdater;
+        delete pTarget->m_pPort;
+        delete pTarget;
+    }
+}
+
+bool FlashService::listen(const QString &a_SocketName, const QString &a_Group)
+{
+    QLocalSocket probe;
+    struct group *pGroup = nullptr;
+
+    if(!a_Group.isEmpty() && (pGroup = getgrnam(qPrintable(a_Group))) == nullptr)
+    {
+        qCWarning(DBG_IOCFLASH_SERVICE) << "Unknown group" << qPrintable(a_Group);
+        return false;
+    }
+
+    //Only a socket nobody answers on is stale
+    probe.connectToServer(a_SocketName);
+    if(probe.waitForConnected(SOCKET_PROBE_TIMEOUT))
+    {
+        qCWarning(DBG_IOCFLASH_SERVICE) << "Another daemon is serving" << qPrintable(a_SocketName);
+        return false;
+    }
+    QLocalServer::removeServer(a_SocketName);
+
+    QLocalServer::SocketOptions access = QLocalServer::UserAccessOption;
+    if(pGroup)
+    {
+        access |= QLocalServer::GroupAccessOption;
+    }
+    m_Server.setSocketOptions(access);
+    if(!m_Server.listen(a_SocketName))
+    {
+        qCWarning(DBG_IOCFLASH_SERVICE) << "Unable to listen on" << qPrintable(a_SocketName) << ":" << qPrintable(m_Server.errorString());
+        return false;
+    }
+
+    //The socket got the group of the daemon, hand it to a_Group
+    if(pGroup && chown(qPrintable(m_Server.fullServerName()), static_cast<uid_t>(-1), pGroup->gr_gid) != 0)
+    {
+        qCWarning(DBG_IOCFLASH_SERVICE) << "Unable to give" << qPrintable(m_Server.fullServerName()) << "to group" << qPrintable(a_Group);
+        m_Server.close();
+        return false;
+    }
+
+    qCInfo(DBG_IOCFLASH_SERVICE) << "Serving" << m_Targets.count() << "targets on" << qPrintable(m_Server.fullServerName());
+    return true;
+}
+
+void FlashService::newConnection(void)
+{
+    while(QLocalSocket *client = m_Server.nextPendingConnection())
+    {
+        connect(client, &QLocalSocket::readyRead, this, &FlashService::readRequests);
+        connect(client, &QLocalSocket::disconnected, client, &QObject::deleteLater);
+    }
+}
+
+void FlashService::readRequests(void)
+{
+    QLocalSocket *client = qobject_cast<QLocalSocket *>(sender());
+
+    while(client->canReadLine())
+    {
+        request(client, client->readLine().trimmed());
+    }
+
+    if(client->bytesAvailable() > MAX_REQUEST_LENGTH)
+    {
+        qCWarning(DBG_IOCFLASH_SERVICE) << "Request too long, disconnecting client";
+        client->disconnectFromServer();
+    }
+}
+
+void FlashService::request(QLocalSocket *a_pClient, const QByteArray &a_Line)
+{
+    QJsonParseError parseError;
+    QJsonDocument document = QJsonDocument::fromJson(a_Line, &parseError);
+    QJsonObject request = document.object();
+    Target_t *pTarget = m_Targets.isEmpty() ? nullptr : m_Targets.first();
+    Job_t job;
+    QString error;
+    QString badPatch;
+
+    job.m_serial = ++m_JobSerial;
+    job.m_client = a_pClient;
+    job.m_id = request.value("id");
+    job.m_op = request.value("op").toString();
+    job.m_file = request.value("file").toString();
+    job.m_options = m_Options;
+    job.m_options.m_delta = request.value("delta").toBool(m_Options.m_delta);
+    job.m_options.m_verify = request.value("verify").toBool(m_Options.m_verify);
+    job.m_options.m_resume = request.value("resume").toBool(m_Options.m_resume);
+    job.m_options.m_fastExit = request.value("go").toBool(m_Options.m_fastExit);
+    job.m_options.m_verifyOnly = (job.m_op == "verify");
+
+    //Per unit patches replace the ones given on the command line
+    if(request.contains("patch"))
+    {
+        job.m_options.m_patches.clear();
+        for(const QJsonValue &text : request.value("patch").toArray())
+        {
+            FlashPatch_t patch;
+            if(!FlashImage::parsePatch(text.toString(), &patch))
+            {
+                badPatch = text.toString();
+            }
+            job.m_options.m_patches.append(patch);
+        }
+    }
+
+    if(request.contains("port"))
+    {
+        pTarget = nullptr;
+        for(Target_t *pCandidate : m_Targets)
+        {
+            if(pCandidate->m_target.m_port == request.value("port").toString())
+            {
+                pTarget = pCandidate;
+            }
+        }
+    }
+
+    if(!document.isObject())
+    {
+        error = "bad request: " + parseError.errorString();
+    }
+    else if(!badPatch.isEmpty())
+    {
+        error = "bad patch: " + badPatch;
+    }
+    else if(job.m_op != "flash" && job.m_op != "verify" && job.m_op != "version")
+    {
+        error = "unknown op";
+    }
+    else if(job.m_op != "version" && job.m_file.isEmpty())
+    {
+        error = "no file";
+    }
+    else if(!pTarget)
+    {
+        error = "unknown port";
+    }
+
+    if(!error.isEmpty())
+    {
+        QJsonObject event;
+        event["event"] = "error";
+        event["message"] = error;
+        send(job, event);
+        return;
+    }
+
+    QJsonObject event;
+    event["event"] = "queued";
+    event["position"] = pTarget->m_queue.count() + (pTarget->m_busy ? 1 : 0);
+    send(job, event);
+
+    pTarget->m_queue.enqueue(job);
+    startNext(pTarget);
+}
+
+void FlashService::startNext(Target_t *a_pTarget)
+{
+    if(a_pTarget->m_busy || a_pTarget->m_queue.isEmpty())
+    {
+        return;
+    }
+
+    a_pTarget->m_busy = true;
+    a_pTarget->m_running = a_pTarget->m_queue.dequeue();
+    a_pTarget->m_jobTimer.start();
+
+    QJsonObject event;
+    event["event"] = "started";
+    send(a_pTarget->m_running, event);
+
+    qCInfo(DBG_IOCFLASH_SERVICE, "%s: %s %s", qPrintable(a_pTarget->m_target.m_port),
+           qPrintable(a_pTarget->m_running.m_op), qPrintable(a_pTarget->m_running.m_file));
+
+    if(a_pTarget->m_running.m_op == "version")
+    {
+        IoControllerCommThread *commThread = new IoControllerCommThread();
+        if(a_pTarget->m_pPort)
+        {
+            commThread->setSerialPort(a_pTarget->m_pPort);
+        }
+        connect(commThread, &IoControllerCommThread::reportVersion, this, [this, a_pTarget, commThread](SWversion_t a_version)
+        {
+            QJsonObject reply;
+            QString version;
+            version.sprintf("%u.%u.%u.%u", a_version.m_verMaj, a_version.m_verMin, a_version.m_verMaint, a_version.m_verBuild);
+            reply["result"] = (a_version.m_verMaj != 0 || a_version.m_verMin != 0 ||
+                               a_version.m_verMaint != 0 || a_version.m_verBuild != 0);
+            reply["version"] = version;
+
+            //Still in its receive handler
+            commThread->deleteLater();
+            finishJob(a_pTarget, reply);
+        });
+        QMetaObject::invokeMethod(commThread, "getVerIOprocessor", Qt::QueuedConnection, Q_ARG(QString, a_pTarget->m_target.m_port));
+        return;
+    }
+
+    //A bad path must fail before the IO Controller is reset into its bootloader
+    QFileInfo image(a_pTarget->m_running.m_file);
+    if(!image.isFile() || !image.isReadable())
+    {
+        QJsonObject reply;
+        reply["result"] = false;
+        reply["message"] = "unable to read file";
+        finishJob(a_pTarget, reply);
+        return;
+    }
+
+    //Same overlap as a single update: the IO Controller resets while the image is read and parsed
+    a_pTarget->m_pUpdater->setOptions(a_pTarget->m_running.m_options);
+    QMetaObject::invokeMethod(a_pTarget->m_pUpdater, "beginUpdate", Qt::QueuedConnection);
+
+    QFutureWatcher<QByteArray> *load = new QFutureWatcher<QByteArray>(this);
+    quint64 serial = a_pTarget->m_running.m_serial;
+    connect(load, &QFutureWatcher<QByteArray>::finished, this, [a_pTarget, load, serial]()
+    {
+        //The job may have failed before its image was read
+        if(a_pTarget->m_busy && a_pTarget->m_running.m_serial == serial)
+        {
+            QMetaObject::invokeMethod(a_pTarget->m_pUpdater, "updateIOcontroller", Q_ARG(QByteArray, load->result()));
+        }
+        load->deleteLater();
+    });
+    QString file = a_pTarget->m_running.m_file;
+    load->setFuture(QtConcurrent::run([file]()
+    {
+        QFile image(file);
+        return image.open(QFile::ReadOnly) ? image.readAll() : QByteArray();
+    }));
+}
+
+void FlashService::finishJob(Target_t *a_pTarget, QJsonObject a_Reply)
+{
+    a_Reply["event"] = "done";
+    a_Reply["ms"] = a_pTarget->m_jobTimer.elapsed();
+    send(a_pTarget->m_running, a_Reply);
+
+    qCInfo(DBG_IOCFLASH_SERVICE, "%s: %s %s in %lld ms", qPrintable(a_pTarget->m_target.m_port), qPrintable(a_pTarget->m_running.m_op),
+           a_Reply.value("result").toBool() ? "done" : "failed", a_pTarget->m_jobTimer.elapsed());
+
+    a_pTarget->m_busy = false;
+    startNext(a_pTarget);
+}
+
+void FlashService::send(const Job_t &a_Job, QJsonObject a_Event)
+{
+    if(!a_Job.m_client)
+    {
+        return;
+    }
+
+    a_Event["id"] = a_Job.m_id;
+    a_Job.m_client->write(QJsonDocument(a_Event).toJson(QJsonDocument::Compact) + '\n');
+}
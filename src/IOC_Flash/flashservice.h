@@ -0,0 +1,122 @@
+#ifndef FLASH_SERVICE_H
+#define FLASH_SERVICE_H
+
+#include <QObject>
+#include <QMap>
+#include <QPointer>
+#include <QQueue>
+#include <QJsonObject>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include "iocontrollerupdatethread.h"
+#include "iocontrollercommthread.h"
+#include "flashoptions.h"
+
+
+//! \brief Long running iocflash (--daemon). The GPIO lines and serial ports of the targets are
+//! claimed once at startup and jobs are taken from clients of a local socket.
+//!
+//! A client writes one JSON object per line:
+//!   {"id": 1, "op": "flash", "file": "/path/image.sim", "port": "/dev/ttymxc3", "delta": true, "verify": true}
+//!   {"id": 2, "op": "verify", "file": "/path/image.sim"}
+//!   {"id": 3, "op": "version"}
+//! "port" defaults to the first target, "delta", "verify", "resume" and "go" to the command line options.
+//! "patch": ["0x0807ff00:0102a0ff", ...] replaces the --patch bytes of the job, I.E a serial number per unit.
+//! Every reply is one JSON object per line carrying the "id" of its job:
+//!   {"event": "queued", "position": 0}
+//!   {"event": "started"}
+//!   {"event": "progress", "phase": "program", "done": 2048, "total": 65536}
+//!   {"event": "done", "result": true, "ms": 5230, "bytes": 65536, "version": "1.2.3.4"}
+//!   {"event": "error", "message": "..."}
+//! Jobs of one target run in order, targets run concurrently.
+class FlashService : public QObject
+{
+    Q_OBJECT
+
+    public:
+        //! \brief ctor, claims the GPIO lines and opens the serial ports of all targets
+        //! \param a_Targets - IO Controllers served
+        //! \param a_Options - defaults of the jobs
+        FlashService(const QList<FlashTarget_t> &a_Targets, const FlashOptions_t &a_Options, QObject *a_pParent = nullptr);
+
+        //! \brief dtor
+        ~FlashService();
+
+        //! \brief Start taking clients. Jobs flash any file the daemon can read, so only the owner of
+        //! the daemon, and members of a_Group if given, may connect.
+        //! \param a_SocketName - socket name or path, a stale socket is replaced
+        //! \param a_Group - group allowed to connect besides the owner, none if empty
+        //! \return false on error, or if another daemon serves a_SocketName
+        bool listen(const QString &a_SocketName, const QString &a_Group = QString());
+
+        //! \brief Default socket name
+        static constexpr const char *DEFAULT_SOCKET = "iocflash";
+
+    private:
+        //! \brief Copy constructor blocked
+        FlashService(const FlashService &a_Right);
+
+        //! \brief Assignment operator blocked
+        FlashService &operator=(const FlashService &a_Right);
+
+        struct Job_t
+        {
+            //! \brief Unique in the service, tells a stale image load from the running one
+            quint64 m_serial;
+
+            //! \brief Gone if the client disconnected, the job still runs to its end
+            QPointer<QLocalSocket> m_client;
+
+            QJsonValue m_id;
+            QString m_op;
+            QString m_file;
+            FlashOptions_t m_options;
+        };
+
+        struct Target_t
+        {
+            FlashTarget_t m_target;
+            IoControllerUpdateThread *m_pUpdater;
+
+            //! \brief Open for the lifetime of the service, nullptr if that failed
+            QextSerialPort *m_pPort;
+
+            QQueue<Job_t> m_queue;
+            Job_t m_running;
+            bool m_busy;
+            QElapsedTimer m_jobTimer;
+        };
+
+        //! \brief Queue a job described by a request line, or reply with an error
+        void request(QLocalSocket *a_pClient, const QByteArray &a_Line);
+
+        //! \brief Start the next queued job of a_pTarget if it is idle
+        void startNext(Target_t *a_pTarget);
+
+        //! \brief The running job of a_pTarget is done
+        //! \param a_Reply - done event, without id
+        void finishJob(Target_t *a_pTarget, QJsonObject a_Reply);
+
+        //! \brief Send a_Event, tagged with the id of a_Job, to the client of a_Job
+        static void send(const Job_t &a_Job, QJsonObject a_Event);
+
+        QLocalServer m_Server;
+        FlashOptions_t m_Options;
+
+        //! \brief Targets by serial port, in command line order
+        QList<Target_t *> m_Targets;
+
+        quint64 m_JobSerial;
+
+        //! \brief Bytes of a request line before it is rejected
+        static const qint32 MAX_REQUEST_LENGTH = 4096;
+
+        //! \brief Time a running daemon has to accept the probe connection at startup
+        static const qint32 SOCKET_PROBE_TIMEOUT = 500; //ms
+
+    private slots:
+        void newConnection(void);
+        void readRequests(void);
+};
+
+#endif // FLASH_SERVICE_H
@@ -0,0 +1,165 @@
+#include "flashstats.h"
+
+#include <QJsonArray>
+#include <algorithm>
+
+FlashStats::FlashStats()
+{
+    start();
+}
+
+void FlashStats::start(void)
+{
+    for(qint32 i = 0; i < ePhaseCount; i++)
+    {
+        m_Phases[i].m_firstStartNs = -1;
+        m_Phases[i].m_totalNs = 0;
+        m_Phases[i].m_count = 0;
+    }
+    m_Current = ePhaseParse;
+    m_CurrentStartNs = 0;
+    m_InPhase = false;
+    m_BlockStartNs = -1;
+    m_BlockRttNs.clear();
+    m_ProgrammedBytes = 0;
+    m_VerifiedBytes = 0;
+    m_Clock.start();
+}
+
+void FlashStats::setPhase(Phase_t a_Phase)
+{
+    if(m_InPhase && m_Current == a_Phase)
+    {
+        return;
+    }
+
+    finish();
+
+    m_Current = a_Phase;
+    m_CurrentStartNs = m_Clock.nsecsElapsed();
+    m_InPhase = true;
+    if(m_Phases[a_Phase].m_firstStartNs < 0)
+    {
+        m_Phases[a_Phase].m_firstStartNs = m_CurrentStartNs;
+    }
+    m_Phases[a_Phase].m_count++;
+}
+
+void FlashStats::finish(void)
+{
+    if(m_InPhase)
+    {
+        m_Phases[m_Current].m_totalNs += m_Clock.nsecsElapsed() - m_CurrentStartNs;
+        m_InPhase = false;
+    }
+}
+
+void FlashStats::addPhase(Phase_t a_Phase, qint64 a_StartNs, qint64 a_Ns)
+{
+    if(m_Phases[a_Phase].m_firstStartNs < 0 || a_StartNs < m_Phases[a_Phase].m_firstStartNs)
+    {
+        m_Phases[a_Phase].m_firstStartNs = a_StartNs;
+    }
+    m_Phases[a_Phase].m_totalNs += a_Ns;
+    m_Phases[a_Phase].m_count++;
+}
+
+void FlashStats::blockStarted(void)
+{
+    m_BlockStartNs = m_Clock.nsecsElapsed();
+}
+
+void FlashStats::blockAcked(qint32 a_Bytes)
+{
+    if(m_BlockStartNs >= 0)
+    {
+        m_BlockRttNs.append(m_Clock.nsecsElapsed() - m_BlockStartNs);
+        m_BlockStartNs = -1;
+    }
+    m_ProgrammedBytes += a_Bytes;
+}
+
+qint64 FlashStats::rate(qint64 a_Bytes, qint64 a_Ns)
+{
+    return a_Ns > 0 ? a_Bytes * 1000000000 / a_Ns : 0;
+}
+
+const char *FlashStats::phaseName(Phase_t a_Phase)
+{
+    switch(a_Phase)
+    {
+        case ePhaseParse:
+            return "parse";
+        case ePhaseBootEntry:
+            return "boot_entry";
+        case ePhaseGetCommands:
+            return "get_commands";
+        case ePhaseReadBack:
+            return "read_back";
+        case ePhaseErase:
+            return "erase";
+        case ePhaseProgram:
+            return "program";
+        case ePhaseVerify:
+            return "verify";
+        case ePhaseExit:
+            return "exit";
+        default:
+            return "unknown";
+    }
+}
+
+QJsonObject FlashStats::toJson(void) const
+{
+    QJsonObject stats;
+    QJsonArray phases;
+    QJsonObject rtt;
+    qint64 totalNs = m_Clock.nsecsElapsed();
+
+    for(qint32 i = 0; i < ePhaseCount; i++)
+    {
+        QJsonObject phase;
+        qint64 ns = m_Phases[i].m_totalNs;
+
+        if(m_InPhase && m_Current == i)
+        {
+            ns += totalNs - m_CurrentStartNs;
+        }
+        if(m_Phases[i].m_count == 0)
+        {
+            continue;
+        }
+        phase["name"] = phaseName(static_cast<Phase_t>(i));
+        phase["start_ms"] = m_Phases[i].m_firstStartNs / 1e6;
+        phase["duration_ms"] = ns / 1e6;
+        phase["count"] = m_Phases[i].m_count;
+        phases.append(phase);
+    }
+
+    if(!m_BlockRttNs.isEmpty())
+    {
+        QVector<qint64> sorted = m_BlockRttNs;
+        qint64 sum = 0;
+
+        std::sort(sorted.begin(), sorted.end());
+        for(qint64 ns : sorted)
+        {
+            sum += ns;
+        }
+        rtt["count"] = sorted.count();
+        rtt["min_ms"] = sorted.first() / 1e6;
+        rtt["avg_ms"] = sum / sorted.count() / 1e6;
+        rtt["p99_ms"] = sorted.at((sorted.count() * 99 + 99) / 100 - 1) / 1e6;
+        rtt["max_ms"] = sorted.last() / 1e6;
+    }
+
+    stats["total_ms"] = totalNs / 1e6;
+    stats["phases"] = phases;
+    stats["block_rtt"] = rtt;
+    stats["programmed_bytes"] = m_ProgrammedBytes;
+    stats["program_bytes_per_s"] = rate(m_ProgrammedBytes, m_Phases[ePhaseProgram].m_totalNs);
+    stats["verified_bytes"] = m_VerifiedBytes;
+    stats["verify_bytes_per_s"] = rate(m_VerifiedBytes, m_Phases[ePhaseVerify].m_totalNs);
+    stats["effective_bytes_per_s"] = rate(m_ProgrammedBytes, totalNs);
+    return stats;
+}
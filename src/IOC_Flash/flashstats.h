@@ -0,0 +1,85 @@
+#ifndef FLASH_STATS_H
+#define FLASH_STATS_H
+
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QVector>
+
+
+//! \brief Timing of one update: time spent per phase on the monotonic clock and
+//! round-trip latency of the block writes
+class FlashStats
+{
+    public:
+        //! \brief Update phases, in the order they normally run
+        enum Phase_t {ePhaseParse = 0x00, ePhaseBootEntry, ePhaseGetCommands, ePhaseReadBack, ePhaseErase,
+                      ePhaseProgram, ePhaseVerify, ePhaseExit, ePhaseCount};
+
+        //! \brief ctor
+        FlashStats();
+
+        //! \brief Forget everything and start the update clock
+        void start(void);
+
+        //! \brief End the current phase and start a_Phase. Phases entered again (retries) add up.
+        void setPhase(Phase_t a_Phase);
+
+        //! \brief End the current phase
+        void finish(void);
+
+        //! \brief Record a phase that ran concurrently with the others
+        //! \param a_StartNs - phase start, from start()
+        //! \param a_Ns - phase duration
+        void addPhase(Phase_t a_Phase, qint64 a_StartNs, qint64 a_Ns);
+
+        //! \brief Time since start()
+        qint64 elapsedNs(void) const { return m_Clock.nsecsElapsed(); }
+
+        //! \brief A block write transaction was started
+        void blockStarted(void);
+
+        //! \brief The block write transaction started last was acknowledged
+        //! \param a_Bytes - image bytes in the block
+        void blockAcked(qint32 a_Bytes);
+
+        //! \brief Bytes read back and compared by verify
+        void addVerifiedBytes(qint64 a_Bytes) { m_VerifiedBytes += a_Bytes; }
+
+        //! \brief Total time spent in a phase
+        qint64 phaseNs(Phase_t a_Phase) const { return m_Phases[a_Phase].m_totalNs; }
+
+        //! \brief Machine readable summary
+        QJsonObject toJson(void) const;
+
+        //! \brief Phase name used in the summary
+        static const char *phaseName(Phase_t a_Phase);
+
+    private:
+        struct PhaseTime_t
+        {
+            //! \brief Time from start() the phase was first entered, -1 if never
+            qint64 m_firstStartNs;
+            qint64 m_totalNs;
+            qint32 m_count;
+        };
+
+        //! \brief Bytes per second for a_Bytes in a_Ns
+        static qint64 rate(qint64 a_Bytes, qint64 a_Ns);
+
+        QElapsedTimer m_Clock;
+        PhaseTime_t m_Phases[ePhaseCount];
+        Phase_t m_Current;
+        qint64 m_CurrentStartNs;
+        bool m_InPhase;
+
+        //! \brief Start of the pending block write, -1 if none
+        qint64 m_BlockStartNs;
+
+        //! \brief Round trip of each acknowledged block write
+        QVector<qint64> m_BlockRttNs;
+
+        qint64 m_ProgrammedBytes;
+        qint64 m_VerifiedBytes;
+};
+
+#endif // FLASH_STATS_H
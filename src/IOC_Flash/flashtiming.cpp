@@ -0,0 +1,218 @@
+#include "flashtiming.h"
+
+#include <QDir>
+#include <QFileInfo>
+
+#include <QLoggingCategory>
+Q_LOGGING_CATEGORY(DBG_IOCFLASH_TIMING,"IOCFlash.Timing", QtInfoMsg)
+
+FlashDeadline::FlashDeadline(qint32 a_DefaultMs)
+    : m_DefaultMs(a_DefaultMs)
+    , m_LatencyNs(0)
+    , m_DeviationNs(0)
+    , m_Samples(0)
+    , m_Backoff(0)
+    , m_Timeouts(0)
+{
+}
+
+qint64 FlashDeadline::wireNs(qint32 a_Bytes)
+{
+    return static_cast<qint64>(a_Bytes) * 1000000000LL / LINE_RATE;
+}
+
+void FlashDeadline::addSample(qint64 a_Ns, qint32 a_Bytes)
+{
+    qint64 latency = qMax<qint64>(a_Ns - wireNs(a_Bytes), 0);
+
+    if(m_Samples == 0)
+    {
+        m_LatencyNs = latency;
+        m_DeviationNs = latency / 2;
+    }
+    else
+    {
+        m_DeviationNs += (qAbs(m_LatencyNs - latency) - m_DeviationNs) / 4;
+        m_LatencyNs += (latency - m_LatencyNs) / 8;
+    }
+    m_Samples++;
+    m_Backoff = 0;
+}
+
+void FlashDeadline::timedOut(void)
+{
+    m_Timeouts++;
+    m_Backoff = qMin(m_Backoff + 1, MAX_BACKOFF);
+}
+
+qint32 FlashDeadline::deadlineMs(qint32 a_Bytes) const
+{
+    if(m_Samples < MIN_SAMPLES)
+    {
+        return m_DefaultMs;
+    }
+
+    //The UART may idle between bytes, allow for twice the wire time
+    qint64 ns = 2 * wireNs(a_Bytes) + m_LatencyNs + 4 * m_DeviationNs;
+    qint64 ms = qMax<qint64>((ns + 999999) / 1000000, MIN_DEADLINE_MS) << m_Backoff;
+    return static_cast<qint32>(qMin<qint64>(ms, m_DefaultMs));
+}
+
+void FlashDeadline::load(const QSettings &a_Settings, const QString &a_Key)
+{
+    m_Samples = a_Settings.value(a_Key + "/samples", 0).toInt();
+    m_LatencyNs = a_Settings.value(a_Key + "/latency_us", 0).toLongLong() * 1000;
+    m_DeviationNs = a_Settings.value(a_Key + "/deviation_us", 0).toLongLong() * 1000;
+}
+
+void FlashDeadline::save(QSettings *a_pSettings, const QString &a_Key) const
+{
+    a_pSettings->setValue(a_Key + "/samples", m_Samples);
+    a_pSettings->setValue(a_Key + "/latency_us", m_LatencyNs / 1000);
+    a_pSettings->setValue(a_Key + "/deviation_us", m_DeviationNs / 1000);
+}
+
+QJsonObject FlashDeadline::toJson(void) const
+{
+    QJsonObject deadline;
+    deadline["samples"] = m_Samples;
+    deadline["latency_ms"] = m_LatencyNs / 1e6;
+    deadline["deviation_ms"] = m_DeviationNs / 1e6;
+    deadline["deadline_ms"] = deadlineMs(0);
+    deadline["timeouts"] = m_Timeouts;
+    return deadline;
+}
+
+FlashEraseModel::FlashEraseModel()
+    : m_NsPerKB(0)
+    , m_Samples(0)
+    , m_Backoff(0)
+    , m_Timeouts(0)
+{
+}
+
+void FlashEraseModel::addSample(qint64 a_Ns, quint32 a_Bytes)
+{
+    if(a_Bytes == 0)
+    {
+        return;
+    }
+
+    qint64 nsPerKB = a_Ns * 1024 / a_Bytes;
+    if(m_Samples == 0)
+    {
+        m_NsPerKB = nsPerKB;
+    }
+    else
+    {
+        m_NsPerKB += (nsPerKB - m_NsPerKB) / 4;
+    }
+    m_Samples++;
+    m_Backoff = 0;
+}
+
+void FlashEraseModel::timedOut(void)
+{
+    m_Timeouts++;
+    m_Backoff = qMin(m_Backoff + 1, FlashDeadline::MAX_BACKOFF);
+}
+
+qint32 FlashEraseModel::deadlineMs(quint32 a_Bytes, qint32 a_MaxMs) const
+{
+    if(m_Samples == 0 || a_Bytes == 0)
+    {
+        return a_MaxMs;
+    }
+
+    qint64 ms = (m_NsPerKB * a_Bytes / 1024 * ERASE_MARGIN / 1000000 + ERASE_SLACK_MS) << m_Backoff;
+    return static_cast<qint32>(qMin<qint64>(ms, a_MaxMs));
+}
+
+void FlashEraseModel::load(const QSettings &a_Settings, const QString &a_Key)
+{
+    m_Samples = a_Settings.value(a_Key + "/samples", 0).toInt();
+    m_NsPerKB = a_Settings.value(a_Key + "/us_per_kb", 0).toLongLong() * 1000;
+}
+
+void FlashEraseModel::save(QSettings *a_pSettings, const QString &a_Key) const
+{
+    a_pSettings->setValue(a_Key + "/samples", m_Samples);
+    a_pSettings->setValue(a_Key + "/us_per_kb", m_NsPerKB / 1000);
+}
+
+QJsonObject FlashEraseModel::toJson(void) const
+{
+    QJsonObject erase;
+    erase["samples"] = m_Samples;
+    erase["ms_per_kb"] = m_NsPerKB / 1e6;
+    erase["timeouts"] = m_Timeouts;
+    return erase;
+}
+
+FlashTiming::FlashTiming()
+{
+    m_Deadlines[eCommand] = FlashDeadline(COMMAND_TIMEOUT);
+    m_Deadlines[eWrite] = FlashDeadline(WRITE_TIMEOUT);
+    m_Deadlines[eApp] = FlashDeadline(APP_TIMEOUT);
+}
+
+const char *FlashTiming::transactionName(Transaction_t a_Transaction)
+{
+    switch(a_Transaction)
+    {
+        case eCommand:
+            return "command";
+        case eWrite:
+            return "write";
+        case eApp:
+            return "app";
+        default:
+            return "unknown";
+    }
+}
+
+void FlashTiming::load(const QString &a_CacheDir, const QString &a_Port)
+{
+    m_Path = QDir(a_CacheDir).filePath("timing-" + QString(a_Port).replace('/', '_'));
+
+    QSettings record(m_Path, QSettings::IniFormat);
+    for(qint32 i = 0; i < eTransactionCount; i++)
+    {
+        m_Deadlines[i].load(record, transactionName(static_cast<Transaction_t>(i)));
+    }
+    m_Erase.load(record, "erase");
+}
+
+void FlashTiming::save(void) const
+{
+    if(m_Path.isEmpty())
+    {
+        return;
+    }
+
+    QDir().mkpath(QFileInfo(m_Path).absolutePath());
+
+    QSettings record(m_Path, QSettings::IniFormat);
+    for(qint32 i = 0; i < eTransactionCount; i++)
+    {
+        m_Deadlines[i].save(&record, transactionName(static_cast<Transaction_t>(i)));
+    }
+    m_Erase.save(&record, "erase");
+    record.sync();
+
+    if(record.status() != QSettings::NoError)
+    {
+        qCWarning(DBG_IOCFLASH_TIMING) << "Unable to write" << qPrintable(m_Path);
+    }
+}
+
+QJsonObject FlashTiming::toJson(void) const
+{
+    QJsonObject timing;
+    for(qint32 i = 0; i < eTransactionCount; i++)
+    {
+        timing[transactionName(static_cast<Transaction_t>(i))] = m_Deadlines[i].toJson();
+    }
+    timing["erase"] = m_Erase.toJson();
+    return timing;
+}
@@ -0,0 +1,145 @@
+#ifndef FLASH_TIMING_H
+#define FLASH_TIMING_H
+
+#include <QJsonObject>
+#include <QSettings>
+#include <QString>
+
+
+//! \brief Deadline of one kind of transaction, learned from its round trips. A round trip is the wire
+//! time of its bytes plus a latency: serial adapter, event loop and the MCU working on the request.
+//! The latency is smoothed like the TCP retransmission timer (RFC 6298) and the deadline never
+//! exceeds the fixed default, so a dead link fails within a few latencies.
+class FlashDeadline
+{
+    public:
+        //! \brief ctor
+        //! \param a_DefaultMs - deadline until MIN_SAMPLES round trips were seen, and the upper bound
+        explicit FlashDeadline(qint32 a_DefaultMs = 1000);
+
+        //! \brief A transaction moving a_Bytes both ways was answered after a_Ns
+        void addSample(qint64 a_Ns, qint32 a_Bytes);
+
+        //! \brief A transaction was not answered, deadlines double until the next answer
+        void timedOut(void);
+
+        //! \brief Deadline of a transaction moving a_Bytes both ways
+        qint32 deadlineMs(qint32 a_Bytes) const;
+
+        //! \brief Round trips learned, including earlier sessions
+        qint32 samples(void) const { return m_Samples; }
+
+        //! \brief Wire time of a_Bytes at LINE_RATE
+        static qint64 wireNs(qint32 a_Bytes);
+
+        void load(const QSettings &a_Settings, const QString &a_Key);
+        void save(QSettings *a_pSettings, const QString &a_Key) const;
+        QJsonObject toJson(void) const;
+
+        //! \brief Bytes per second at 115200 baud, 11 bits per byte as the bootloader runs 8E1
+        static const qint32 LINE_RATE = 115200 / 11;
+
+        //! \brief Round trips needed before the learned deadline is used
+        static const qint32 MIN_SAMPLES = 4;
+
+        //! \brief Lowest deadline, covers the latency timer of USB serial adapters
+        static const qint32 MIN_DEADLINE_MS = 20;
+
+        //! \brief Max doublings after timeouts, the default bounds them anyway
+        static const qint32 MAX_BACKOFF = 6;
+
+    private:
+        qint32 m_DefaultMs;
+
+        //! \brief Smoothed latency and its mean deviation
+        qint64 m_LatencyNs;
+        qint64 m_DeviationNs;
+        qint32 m_Samples;
+
+        //! \brief Doublings after timeouts since the last answer
+        qint32 m_Backoff;
+
+        //! \brief Timeouts seen
+        qint32 m_Timeouts;
+};
+
+//! \brief Erase duration per KB of erased sectors, learned from acknowledged sector erases.
+//! Sector sizes differ within a chip, the time per KB does much less.
+class FlashEraseModel
+{
+    public:
+        //! \brief ctor
+        FlashEraseModel();
+
+        //! \brief Erasing a_Bytes of sectors was acknowledged after a_Ns
+        void addSample(qint64 a_Ns, quint32 a_Bytes);
+
+        //! \brief An erase was not acknowledged, deadlines double towards the maximum until the next answer
+        void timedOut(void);
+
+        //! \brief Deadline of erasing a_Bytes of sectors
+        //! \param a_MaxMs - datasheet maximum, used until an erase was seen
+        qint32 deadlineMs(quint32 a_Bytes, qint32 a_MaxMs) const;
+
+        qint32 samples(void) const { return m_Samples; }
+
+        void load(const QSettings &a_Settings, const QString &a_Key);
+        void save(QSettings *a_pSettings, const QString &a_Key) const;
+        QJsonObject toJson(void) const;
+
+        //! \brief Deadline over the learned time, erase time spreads with temperature and wear
+        static const qint32 ERASE_MARGIN = 3;
+
+        //! \brief Added to every erase deadline for the command round trip
+        static const qint32 ERASE_SLACK_MS = 50;
+
+    private:
+        //! \brief Smoothed erase time per KB
+        qint64 m_NsPerKB;
+        qint32 m_Samples;
+
+        //! \brief Doublings after timeouts since the last answer, at most FlashDeadline::MAX_BACKOFF
+        qint32 m_Backoff;
+
+        //! \brief Timeouts seen
+        qint32 m_Timeouts;
+};
+
+//! \brief Learned transaction deadlines of one IO Controller, kept on disk between sessions
+class FlashTiming
+{
+    public:
+        //! \brief Transactions with a deadline each
+        enum Transaction_t {eCommand = 0x00, eWrite, eApp, eTransactionCount};
+
+        //! \brief ctor, the default deadlines until loaded
+        FlashTiming();
+
+        //! \brief Load what earlier sessions learned about an IO Controller
+        //! \param a_CacheDir - directory of the record, shared with the plan cache and journals
+        //! \param a_Port - serial device of the IO Controller
+        void load(const QString &a_CacheDir, const QString &a_Port);
+
+        //! \brief Store the learned deadlines for the next session
+        void save(void) const;
+
+        FlashDeadline &deadline(Transaction_t a_Transaction) { return m_Deadlines[a_Transaction]; }
+        FlashEraseModel &erase(void) { return m_Erase; }
+
+        //! \brief Learned values for the stats summary
+        QJsonObject toJson(void) const;
+
+        //! \brief Default deadlines, also their upper bounds
+        static const qint32 COMMAND_TIMEOUT = 1000; //ms
+        static const qint32 WRITE_TIMEOUT = 5000; //ms
+        static const qint32 APP_TIMEOUT = 250; //ms
+
+    private:
+        static const char *transactionName(Transaction_t a_Transaction);
+
+        QString m_Path;
+        FlashDeadline m_Deadlines[eTransactionCount];
+        FlashEraseModel m_Erase;
+};
+
+#endif // FLASH_TIMING_H
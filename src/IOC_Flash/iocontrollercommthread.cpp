@@ -5,6 +5,12 @@ Q_LOGGING_CATEGORY(DBG_IOCFLASH_COMMTREAD,"IOCFlash.CommThread", QtInfoMsg)
 
 IoControllerCommThread::IoControllerCommThread()
 {
+    m_SerialPort = nullptr;
+    m_SharedPort = false;
+    m_RequestsLeft = 0;
+    m_RequestCount = REQUEST_COUNT;
+    m_RequestInterval = REQUEST_INTERVAL;
+    m_pDeadline = nullptr;
 
     m_ReceiveStatus = eMessageSyncronizing;
 
@@ -24,6 +30,23 @@ void IoControllerCommThread::run()
 
 }
 
+void IoControllerCommThread::setSerialPort(QextSerialPort *a_pPort)
+{
+    m_SerialPort = a_pPort;
+    m_SharedPort = true;
+}
+
+void IoControllerCommThread::setRequests(qint32 a_Count, qint32 a_IntervalMs)
+{
+    m_RequestCount = a_Count;
+    m_RequestInterval = a_IntervalMs;
+}
+
+void IoControllerCommThread::setDeadline(FlashDeadline *a_pDeadline)
+{
+    m_pDeadline = a_pDeadline;
+}
+
 void IoControllerCommThread::IOcontrCommProc(void)
 {
     //Timer event is used to control the get version progress. When a responce from the iocontroller is recieved, the
@@ -32,6 +55,19 @@ void IoControllerCommThread::IOcontrCommProc(void)
 
     m_IOcontrTimer->stop();
 
+    if(m_IOcontrStatus == eAwaitUserSWver && m_RequestsLeft > 0)
+    {
+        //No answer yet, the app may have missed the request while starting
+        if(m_pDeadline)
+        {
+            m_pDeadline->timedOut();
+        }
+        m_RequestsLeft--;
+        sendReqUserSWver();
+        m_IOcontrTimer->start(requestInterval());
+        return;
+    }
+
     if(m_ReceiveStatus != eMessageReceived && m_IOcontrStatus != eGetUserSWVer)
     {
         qCWarning(DBG_IOCFLASH_COMMTREAD) <<  "- Error! IOController did not respond";
@@ -43,8 +79,9 @@ void IoControllerCommThread::IOcontrCommProc(void)
         {
             case eGetUserSWVer:
                 m_IOcontrStatus = eAwaitUserSWver;
+                m_RequestsLeft = m_RequestCount - 1;
                 sendReqUserSWver();
-                m_IOcontrTimer->start(2000);
+                m_IOcontrTimer->start(requestInterval());
                 break;
             case eAwaitUserSWver:
                 versionReport(m_SWversion); //Timeout
@@ -142,6 +179,18 @@ void IoControllerCommThread::receivedData(void)
 
 bool IoControllerCommThread::configureSerial(QString a_SerialPort, BaudRateType a_BaudRate)
 {
+    if(m_SharedPort)
+    {
+        //Open already, the bootloader runs with even parity
+        m_SerialPort->setBaudRate(a_BaudRate);
+        m_SerialPort->setFlowControl(FLOW_OFF);
+        m_SerialPort->setParity(PAR_NONE);
+        m_SerialPort->setDataBits(DATA_8);
+        m_SerialPort->setStopBits(STOP_1);
+        m_SerialPort->readAll();
+        return m_SerialPort->isOpen();
+    }
+
     if (0 < a_SerialPort.length())
     {
         m_SerialPort = new QextSerialPort(a_SerialPort, QextSerialPort::EventDriven );
@@ -166,7 +215,10 @@ void IoControllerCommThread::versionReport(SWversion_t a_version)
 {
     m_IOcontrTimer->stop();
     m_SerialPort->flush();
-    m_SerialPort->close();
+    if(!m_SharedPort)
+    {
+        m_SerialPort->close();
+    }
 
     disconnect(m_SerialPort, SIGNAL(readyRead()), this, SLOT(receivedData()));
     disconnect(m_IOcontrTimer, SIGNAL(timeout()), this, SLOT(IOcontrCommProc()));
@@ -204,6 +256,12 @@ void IoControllerCommThread::parseMessage(const QVector<quint8> &a_Message)
             m_SWversion.m_verMin = a_Message[2];
             m_SWversion.m_verMaint = a_Message[3];
             m_SWversion.m_verBuild = a_Message[4];
+            if(m_pDeadline && m_RequestsLeft == m_RequestCount - 1)
+            {
+                //Only the answer to a single request tells the reply time, after a resend it may
+                //answer an earlier request
+                m_pDeadline->addSample(m_RequestTimer.nsecsElapsed(), VERSION_FRAME_BYTES);
+            }
             versionReport(m_SWversion);
 
             break;
@@ -213,10 +271,20 @@ void IoControllerCommThread::parseMessage(const QVector<quint8> &a_Message)
     //exit(0);
 }
 
+qint32 IoControllerCommThread::requestInterval(void) const
+{
+    if(m_pDeadline)
+    {
+        return m_pDeadline->deadlineMs(VERSION_FRAME_BYTES);
+    }
+    return m_RequestInterval;
+}
+
 void IoControllerCommThread::sendReqUserSWver(void)
 {
     QByteArray buffer;
     encodeMessage(&buffer, Communication::CommunicationIDs::REQ_USER_SW_VER);
+    m_RequestTimer.start();
     if(m_SerialPort->write(buffer) != buffer.size())
     {
         qCWarning(DBG_IOCFLASH_COMMTREAD) << "Unable to write command REQ_USER_SW_VER";
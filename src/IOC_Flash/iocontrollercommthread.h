@@ -6,9 +6,11 @@
 #include <QCoreApplication>
 #include <QThread>
 #include <QTimer>
+#include <QElapsedTimer>
 #include "Communication/CommunicationIDs.h"
 #include "Communication/CrcCCITT.h"
 #include "SWversion.h"
+#include "flashtiming.h"
 
 
 class IoControllerCommThread : public QThread
@@ -22,6 +24,19 @@ class IoControllerCommThread : public QThread
         //! \brief dtor
         ~IoControllerCommThread();
 
+        //! \brief Use a port kept open by the session instead of opening one.
+        //! Its line settings are changed in place and it is left open.
+        void setSerialPort(QextSerialPort *a_pPort);
+
+        //! \brief Send up to a_Count version requests, a_IntervalMs apart, before giving up.
+        //! Defaults to REQUEST_COUNT and REQUEST_INTERVAL.
+        void setRequests(qint32 a_Count, qint32 a_IntervalMs);
+
+        //! \brief Space the requests by the deadline learned in a_pDeadline instead of the interval of
+        //! setRequests, and learn the reply time in it. Each unanswered request backs the deadline off,
+        //! so the requests spread out while the app is still starting.
+        void setDeadline(FlashDeadline *a_pDeadline);
+
         //! \brief The starting point for the thread
         void run();
 
@@ -53,9 +68,24 @@ class IoControllerCommThread : public QThread
         void sendReqUserSWver(void);
         bool configureSerial(QString a_SerialPort, BaudRateType a_BaudRate);
 
+        //! \brief Time to wait for the answer to a version request
+        qint32 requestInterval(void) const;
+
+        //! \brief Interval of the version requests, the app may still be starting
+        static const qint32 REQUEST_INTERVAL = 250; //ms
+
+        //! \brief Number of version requests sent before giving up
+        static const qint32 REQUEST_COUNT = 8;
+
+        //! \brief Bytes of a version request and its reply, for the deadline
+        static const qint32 VERSION_FRAME_BYTES = 20;
+
         //! \brief Serialport object used to communicate with IO Controller
         QextSerialPort *m_SerialPort;
 
+        //! \brief m_SerialPort belongs to the session, it is not opened, closed or deleted here
+        bool m_SharedPort;
+
         //! \brief Recieve status for the communication with IO Controller
         ReceiveStatus_t m_ReceiveStatus;
 
@@ -67,6 +97,19 @@ class IoControllerCommThread : public QThread
 
         SWversion_t m_SWversion;
 
+        //! \brief Version requests still to send if there is no answer
+        qint32 m_RequestsLeft;
+
+        //! \brief Version requests sent and their interval, see setRequests
+        qint32 m_RequestCount;
+        qint32 m_RequestInterval;
+
+        //! \brief Learned reply time, nullptr for the fixed interval
+        FlashDeadline *m_pDeadline;
+
+        //! \brief Time since the last version request
+        QElapsedTimer m_RequestTimer;
+
 
 
     private slots:
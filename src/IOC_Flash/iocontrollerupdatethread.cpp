@@ -1,4 +1,5 @@
 #include "iocontrollerupdatethread.h"
+#include "iocontrollercommthread.h"
 
 //#include "deviceconfiguration.h"
 
@@ -7,17 +8,68 @@
 #include <QFile>
 #include <QDebug>
 #include <QTimer>
+#include <QtConcurrent>
+#include <algorithm>
+#include <cstring>
+
+#include "Communication/CrcCCITT.h"
 
 #include <QLoggingCategory>
 Q_LOGGING_CATEGORY(DBG_IOCFLASH_UPDATE_THREAD,"IOCFlash.UpdateThread", QtInfoMsg)
 
-IoControllerUpdateThread::IoControllerUpdateThread()
-    : m_RetryCounter(0)
-    , m_iocGPIOmcuBoot0{"mcu_boot0", false}
-    , m_iocGPIOmcuBoot1{"mcu_boot1", false}
-    , m_iocGPIOmcuReset{"mcu_reset", true}
+IoControllerUpdateThread::IoControllerUpdateThread(const FlashTarget_t &a_Target)
+    : m_Target(a_Target)
+    , m_SerialPort(nullptr)
+    , m_SharedPort(false)
+    , m_RetryCounter(0)
+    , m_iocGPIOmcuBoot0{a_Target.m_boot0.toStdString(), false}
+    , m_iocGPIOmcuBoot1{a_Target.m_boot1.toStdString(), false}
+    , m_iocGPIOmcuReset{a_Target.m_reset.toStdString(), true}
 {
+    m_ResponceBytesLeft = 0xffff;
+    m_BytesProgrammed = 0;
+    m_ProgramTotal = 0;
+    m_VerifyTotal = 0;
+    m_SessionRestarts = 0;
+    m_BootProbes = 0;
+    m_BootReadyMs = -1;
+    m_ResyncBytes = 0;
+    m_ResyncNext = eBootFlashCMD;
     m_FlashData_idx = 0;
+    m_FlashStart_idx = 0;
+    m_JournalErasePending = false;
+    m_WritePending = false;
+    m_JournalTrusted = false;
+    m_ResumeCheck = false;
+    m_VerifyEnd_idx = 0;
+    m_ReadBytesLeft = 0;
+    m_DeltaPage_idx = 0;
+    m_DeltaPageOffset = 0;
+    m_Verify_idx = 0;
+    m_VerifyOffset = 0;
+    m_VerifyCrcFlash = 0;
+    m_VerifyCrcImage = 0;
+    m_VerifyMismatchAddr = 0;
+    m_VerifyBytes = 0;
+    m_Dumping = false;
+    m_DumpAddress = 0;
+    m_DumpLength = 0;
+    m_DumpMs = 0;
+    m_ChipId = 0;
+    m_BootloaderVersion = 0;
+    m_InStep = false;
+    m_ContinueNow = false;
+    m_pAppCheck = nullptr;
+    m_AppReadyMs = -1;
+    m_Await = eAwaitNone;
+    m_AwaitBytes = 0;
+    m_AwaitEraseBytes = 0;
+    m_AwaitStartNs = 0;
+    m_TxBytes = 0;
+    m_error = eNoError;
+    m_PlanError = eNoError;
+    m_PlanReady = false;
+    m_PlanStartNs = 0;
 
     m_ReceiveStatus = eMessageSyncronizing;
     m_BootCMDpending = eNoCMD;
@@ -25,17 +77,23 @@ IoControllerUpdateThread::IoControllerUpdateThread()
     //Create a timer for controlling the update state machine
     m_IOcontrUpdateTimer = new QTimer(this);
     connect(m_IOcontrUpdateTimer, &QTimer::timeout, this, &IoControllerUpdateThread::IOcontrUpdateProc);
+
+    //Timer repeating the autobaud probe while the bootloader starts
+    m_BootProbeTimer = new QTimer(this);
+    connect(m_BootProbeTimer, &QTimer::timeout, this, &IoControllerUpdateThread::sendBootProbe);
+
+    connect(&m_PlanWatcher, &QFutureWatcher<bool>::finished, this, &IoControllerUpdateThread::planLoaded);
 }
 
 IoControllerUpdateThread::~IoControllerUpdateThread()
 {
     //Cleanup
     delete(m_IOcontrUpdateTimer);
-    while(!m_FlashData.isEmpty())
+    delete(m_BootProbeTimer);
+    delete(m_pAppCheck);
+    if(!m_SharedPort)
     {
-        FlashData_t *flashData = m_FlashData.at(0);
-        delete flashData; //Cleanup
-        m_FlashData.removeFirst();
+        delete(m_SerialPort);
     }
 }
 
@@ -44,23 +102,157 @@ void IoControllerUpdateThread::run()
 
 }
 
+void IoControllerUpdateThread::setOptions(const FlashOptions_t &a_Options)
+{
+    m_Options = a_Options;
+}
+
+void IoControllerUpdateThread::setSerialPort(QextSerialPort *a_pPort)
+{
+    m_SerialPort = a_pPort;
+    m_SharedPort = true;
+}
+
 
 void IoControllerUpdateThread::IOcontrUpdateProc(void)
 {
-    //Timer event is used to control the update progress. When a responce from the bootloader is recieved, the
-    //timer is set to fire immedeate. If no responce, the timer is preset to fire
-    //in a sufficient amount of time, thus working as a timeout.
+    //Continuation loop. A step sends a frame and arms its deadline with awaitReply, or asks for the
+    //next step right away with continueNow. Replies call this from receivedData, so the next frame
+    //goes out from the read path. The timer only fires when a deadline passes.
+    if(m_InStep)
+    {
+        m_ContinueNow = true;
+        return;
+    }
 
-    m_IOcontrUpdateTimer->stop();
+    m_InStep = true;
+    do
+    {
+        m_ContinueNow = false;
+        m_IOcontrUpdateTimer->stop();
+        updateStep();
+    } while(m_ContinueNow);
+    m_InStep = false;
+}
+
+void IoControllerUpdateThread::continueNow(void)
+{
+    if(m_InStep)
+    {
+        m_ContinueNow = true;
+    }
+    else
+    {
+        m_IOcontrUpdateTimer->start(0);
+    }
+}
+
+void IoControllerUpdateThread::awaitDeadline(qint32 a_TimeoutMs)
+{
+    m_Await = eAwaitNone;
+    m_IOcontrUpdateTimer->start(a_TimeoutMs);
+}
+
+void IoControllerUpdateThread::awaitReply(Await_t a_Await, qint32 a_ReplyBytes)
+{
+    FlashTiming::Transaction_t transaction = (a_Await == eAwaitWrite) ? FlashTiming::eWrite : FlashTiming::eCommand;
+
+    m_Await = a_Await;
+    m_AwaitBytes = m_TxBytes + a_ReplyBytes;
+    m_AwaitStartNs = m_Stats.elapsedNs();
+    m_IOcontrUpdateTimer->start(m_Timing.deadline(transaction).deadlineMs(m_AwaitBytes));
+}
+
+void IoControllerUpdateThread::awaitErase(quint32 a_Bytes, qint32 a_MaxMs)
+{
+    //Sector erases are learned, a mass or bank erase (a_Bytes 0) gets the datasheet time
+    m_Await = eAwaitErase;
+    m_AwaitBytes = m_TxBytes + 1;
+    m_AwaitEraseBytes = a_Bytes;
+    m_AwaitStartNs = m_Stats.elapsedNs();
+    m_IOcontrUpdateTimer->start(m_Timing.deadline(FlashTiming::eCommand).deadlineMs(m_AwaitBytes) +
+                                m_Timing.erase().deadlineMs(a_Bytes, a_MaxMs));
+}
+
+void IoControllerUpdateThread::replyReceived(void)
+{
+    qint64 ns = m_Stats.elapsedNs() - m_AwaitStartNs;
+
+    switch(m_Await)
+    {
+        case eAwaitCommand:
+            m_Timing.deadline(FlashTiming::eCommand).addSample(ns, m_AwaitBytes);
+            break;
+        case eAwaitWrite:
+            m_Timing.deadline(FlashTiming::eWrite).addSample(ns, m_AwaitBytes);
+            break;
+        case eAwaitErase:
+            m_Timing.erase().addSample(ns - FlashDeadline::wireNs(m_AwaitBytes), m_AwaitEraseBytes);
+            break;
+        default:
+            break;
+    }
+    m_Await = eAwaitNone;
+}
+
+void IoControllerUpdateThread::replyTimedOut(void)
+{
+    switch(m_Await)
+    {
+        case eAwaitCommand:
+            m_Timing.deadline(FlashTiming::eCommand).timedOut();
+            break;
+        case eAwaitErase:
+            m_Timing.erase().timedOut();
+            break;
+        case eAwaitWrite:
+            m_Timing.deadline(FlashTiming::eWrite).timedOut();
+            break;
+        default:
+            break;
+    }
+    m_Await = eAwaitNone;
+}
+
+void IoControllerUpdateThread::updateStep(void)
+{
+    if(m_IOcontrUpdateStatus == eBootResync && m_ReceiveStatus != eMessageReceived &&
+       m_ResyncBytes < RESYNC_MAX_BYTES)
+    {
+        //No NACK yet, the bootloader still waits for bytes of the broken transaction
+        sendResyncByte();
+        return;
+    }
 
     if(m_ReceiveStatus != eMessageReceived &&
        m_IOcontrUpdateStatus != eBootEnter)
     {
+        //Bytes of a broken Read Memory reply are not coming any more
+        m_ReadBytesLeft = 0;
+        if(m_ReceiveStatus != eMessageError)
+        {
+            replyTimedOut();
+        }
+        if(m_IOcontrUpdateStatus == eBootGoAddr || m_IOcontrUpdateStatus == eBootGoStarted)
+        {
+            //The update is done, only the fast exit failed
+            qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "GO not acknowledged, starting the application by reset";
+            exitBoot();
+            return;
+        }
+        if(m_IOcontrUpdateStatus != eBootResync && retryBlock())
+        {
+            return;
+        }
+
         qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "Error! IOController did not respond";
         if (4 > m_RetryCounter++)
         {
+            m_SessionRestarts++;
+            //Start the session over, blocks already acknowledged are not written again
+            m_IOcontrUpdateStatus = eBootGetCommands;
             enterBoot();
-            m_IOcontrUpdateTimer->start(2000);
+            awaitDeadline(BOOT_RESTART_TIME + BOOT_PROBE_DEADLINE);
             qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "Retrying...";
             return;
         }
@@ -75,65 +267,260 @@ void IoControllerUpdateThread::IOcontrUpdateProc(void)
         {
             case eBootEnter:
                 m_IOcontrUpdateStatus = eBootGetCommands;
-                m_error = eNoError;
                 enterBoot();
-                m_IOcontrUpdateTimer->start(1000);
+                awaitDeadline(BOOT_RESTART_TIME + BOOT_PROBE_DEADLINE);
                 break;
             case eBootGetCommands:
-                m_IOcontrUpdateStatus = eBootEraseCMD;
+                m_IOcontrUpdateStatus = eBootGetID;
+                m_Stats.setPhase(FlashStats::ePhaseGetCommands);
+                m_FlashStart_idx = 0;
+                m_JournalErasePending = false;
+                m_WritePending = false;
+                m_ResumeCheck = false;
+                m_DeltaPage_idx = 0;
+                m_DeltaPageOffset = 0;
+                m_DeltaDirtyPages.clear();
+                m_RetryErasePages.clear();
                 sendCMD(eGet);
-                m_IOcontrUpdateTimer->start(1000);
+                awaitReply(eAwaitCommand, GET_REPLY_SIZE);
                 qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "Get commands";
                 break;
+            case eBootGetID:
+                m_IOcontrUpdateStatus = eBootIdentify;
+                if(m_IOcontrBootloaderCommandSet.contains(eGetID))
+                {
+                    sendCMD(eGetID);
+                    awaitReply(eAwaitCommand, GET_ID_REPLY_SIZE);
+                }
+                else
+                {
+                    continueNow();
+                }
+                break;
+            case eBootIdentify:
+                if(m_Dumping)
+                {
+                    //No image, only the geometry of the chip is taken
+                    identifyChip();
+                    if(!m_IOcontrBootloaderCommandSet.contains(eReadMem))
+                    {
+                        qCWarning(DBG_IOCFLASH_UPDATE_THREAD) << "Read memory not supported, is the flash read protected?";
+                        m_error = eErrorFlashFailed;
+                        terminateBoot();
+                        break;
+                    }
+                    if(!startDump())
+                    {
+                        m_error = eErrorImageRange;
+                        terminateBoot();
+                        break;
+                    }
+                    m_Stats.setPhase(FlashStats::ePhaseReadBack);
+                    m_IOcontrUpdateStatus = eBootDumpCMD;
+                    continueNow();
+                    break;
+                }
+                if(!m_PlanReady)
+                {
+                    if(m_PlanWatcher.isFinished() && m_PlanError != eNoError)
+                    {
+                        m_error = m_PlanError;
+                        terminateBoot();
+                    }
+                    //Otherwise planLoaded continues, the bootloader waits for a command meanwhile
+                    break;
+                }
+                if(!identifyChip())
+                {
+                    m_error = eErrorImageRange;
+                    terminateBoot();
+                    break;
+                }
+                if(m_Options.m_verifyOnly)
+                {
+                    qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "Verifying flash...";
+                    m_Stats.setPhase(FlashStats::ePhaseVerify);
+                    m_IOcontrUpdateStatus = m_FlashData.isEmpty() ? eBootExit : eBootVerifyCMD;
+                    startVerify(0, m_FlashData.count());
+                }
+                else if(m_Journal.hasProgress())
+                {
+                    m_IOcontrUpdateStatus = eBootResume;
+                }
+                else
+                {
+                    m_IOcontrUpdateStatus = m_Options.m_delta ? eBootReadCMD : eBootEraseCMD;
+                }
+                continueNow();
+                break;
+            case eBootResync:
+                //Bootloader waits for a command again
+                m_IOcontrUpdateStatus = m_ResyncNext;
+                continueNow();
+                break;
+            case eBootResume:
+                m_Stats.setPhase(FlashStats::ePhaseReadBack);
+                if(m_JournalTrusted)
+                {
+                    //Progress made by this process, the flash content is known
+                    if(!applyResume())
+                    {
+                        m_IOcontrUpdateStatus = eBootEraseCMD;
+                    }
+                }
+                else if(m_IOcontrBootloaderCommandSet.contains(eReadMem) && firstUnackedBlock() > 0)
+                {
+                    //Progress from an earlier run, check the last acknowledged block is really there
+                    qint32 lastAcked = firstUnackedBlock() - 1;
+                    m_ResumeCheck = true;
+                    m_IOcontrUpdateStatus = eBootVerifyCMD;
+                    startVerify(lastAcked, lastAcked + 1);
+                }
+                else
+                {
+                    m_Journal.remove();
+                    m_IOcontrUpdateStatus = m_Options.m_delta ? eBootReadCMD : eBootEraseCMD;
+                }
+                continueNow();
+                break;
+            case eBootReadCMD:
+                m_Stats.setPhase(FlashStats::ePhaseReadBack);
+                if(m_DeltaPage_idx == 0 && m_DeltaPageOffset == 0)
+                {
+                    if(m_ErasePages.isEmpty() || !m_IOcontrBootloaderCommandSet.contains(eReadMem))
+                    {
+                        qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "Delta not possible, programming full image";
+                        m_IOcontrUpdateStatus = eBootEraseCMD;
+                        continueNow();
+                        break;
+                    }
+                    qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "Reading back" << m_ErasePages.count() << "flash pages";
+                    m_DeltaExpected = expectedPageData(m_ErasePages.at(0));
+                }
+                m_IOcontrUpdateStatus = eBootReadAddr;
+                sendCMD(eReadMem);
+                awaitReply(eAwaitCommand);
+                break;
+            case eBootReadAddr:
+                {
+                    quint32 addr = m_Geometry.sectorAddress(m_ErasePages.at(m_DeltaPage_idx)) + m_DeltaPageOffset;
+                    m_IOcontrUpdateStatus = eBootReadLen;
+                    sendData(addressBytes(addr));
+                    awaitReply(eAwaitCommand);
+                }
+                break;
+            case eBootReadLen:
+                m_IOcontrUpdateStatus = eBootReadData;
+                sendReadLength(FLASH_MEM_WR_BLOCK_SIZE);
+                awaitReply(eAwaitCommand, FLASH_MEM_WR_BLOCK_SIZE + 1);
+                break;
+            case eBootReadData:
+                if(deltaCompareChunk())
+                {
+                    m_IOcontrUpdateStatus = eBootReadCMD;
+                }
+                else
+                {
+                    finishDelta();
+                    m_IOcontrUpdateStatus = m_ErasePages.isEmpty() ? eBootExit : eBootEraseCMD;
+                }
+                continueNow();
+                break;
             case eBootEraseCMD:
+                m_Stats.setPhase(FlashStats::ePhaseErase);
                 m_IOcontrUpdateStatus = eBootEraseData;
-                sendCMD(eErase);
-                m_IOcontrUpdateTimer->start(1000);
+                //Bootloaders from v3.0 support extended erase only
+                if(m_IOcontrBootloaderCommandSet.contains(eExtErase))
+                {
+                    sendCMD(eExtErase);
+                }
+                else
+                {
+                    sendCMD(eErase);
+                }
+                awaitReply(eAwaitCommand);
                 break;
             case eBootEraseData:
                 {
-                    QByteArray data;
+                    qint32 eraseTimeout;
+                    quint32 eraseBytes;
+                    QByteArray data = buildEraseData(m_BootCMDpending == eExtErase, &eraseTimeout, &eraseBytes);
+                    if(!m_Journal.isOpen())
+                    {
+                        //Flash changes without a journal, one from an earlier update no longer tells its content
+                        QFile::remove(journalPath());
+                    }
                     m_IOcontrUpdateStatus = eBootFlashCMD;
-                    m_FlashData_idx = 0;
-                    qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "Erasing flash";
-                    data.append(static_cast<char>(0xff));   //Erase all
+                    m_FlashData_idx = m_FlashStart_idx;
+                    m_JournalErasePending = true;
+                    m_ProgramTotal = m_BytesProgrammed;
+                    for(qint32 i = m_FlashStart_idx; i < m_FlashData.count(); i++)
+                    {
+                        m_ProgramTotal += m_FlashData.at(i).m_length;
+                    }
                     sendData(data);
-                    m_IOcontrUpdateTimer->start(10000);   //Erasing takes some time
+                    if(erasePages().isEmpty())
+                    {
+                        qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "Erasing flash";
+                    }
+                    else
+                    {
+                        qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "Erasing" << erasePages().count() << "flash pages";
+                    }
+                    awaitErase(eraseBytes, eraseTimeout);
                     qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "Programming flash...";
                 }
                 break;
             case eBootFlashCMD:
+                if(m_JournalErasePending)
+                {
+                    m_Journal.recordErased(erasePages());
+                    m_Journal.save();
+                    m_JournalErasePending = false;
+                }
+                else if(m_WritePending)
+                {
+                    const FlashBlock_t &acked = m_FlashData.at(m_FlashData_idx - 1);
+                    m_WritePending = false;
+                    m_BytesProgrammed += acked.m_length;
+                    m_Stats.blockAcked(acked.m_length);
+                    journalBlockAcked(m_FlashData_idx - 1);
+                    emit progress(FlashStats::ePhaseProgram, m_BytesProgrammed, m_ProgramTotal);
+                }
+
                 if(m_FlashData_idx < m_FlashData.count())
                 {
+                    m_Stats.setPhase(FlashStats::ePhaseProgram);
+                    m_Stats.blockStarted();
                     m_IOcontrUpdateStatus = eBootFlashAddr;
                     sendCMD(eWriteMem);
-                    m_IOcontrUpdateTimer->start(5000);
+                    awaitReply(eAwaitCommand);
+                }
+                else if(m_Options.m_verify && !m_FlashData.isEmpty())
+                {
+                    qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "Verifying flash...";
+                    m_Stats.setPhase(FlashStats::ePhaseVerify);
+                    m_IOcontrUpdateStatus = eBootVerifyCMD;
+                    startVerify(0, m_FlashData.count());
+                    continueNow();
                 }
                 else
                 {
                     m_IOcontrUpdateStatus = eBootExit;
-                    m_IOcontrUpdateTimer->start(1000);
+                    continueNow();
                 }
                 break;
             case eBootFlashAddr:
                 if(m_FlashData_idx < m_FlashData.count())
                 {
                     m_IOcontrUpdateStatus = eBootFlashData;
-                    sendData(m_FlashData.at(m_FlashData_idx)->m_startAddress);
-                    m_IOcontrUpdateTimer->start(5000);
-#if 0
-                    quint32 addr;
-                    addr = ((m_FlashData.at(m_FlashData_idx)->m_startAddress.at(0)) << 24) & 0xff000000u;
-                    addr += ((m_FlashData.at(m_FlashData_idx)->m_startAddress.at(1)) << 16) & 0x00ff0000u;
-                    addr += ((m_FlashData.at(m_FlashData_idx)->m_startAddress.at(2)) << 8) & 0x0000ff00u;
-                    addr += (m_FlashData.at(m_FlashData_idx)->m_startAddress.at(1)) & 0x000000ffu;
-                    qDebug("IoControllerUpdateThread::IOcontrUpdateProc - Writing address %x", addr);
-#endif
+                    sendData(addressBytes(m_FlashData.at(m_FlashData_idx).m_address));
+                    awaitReply(eAwaitCommand);
                 }
                 else
                 {
                     m_IOcontrUpdateStatus = eBootExit;
-                    m_IOcontrUpdateTimer->start(1000);
+                    continueNow();
                 }
 
                 break;
@@ -141,22 +528,118 @@ void IoControllerUpdateThread::IOcontrUpdateProc(void)
                 if(m_FlashData_idx < m_FlashData.count())
                 {
                     m_IOcontrUpdateStatus = eBootFlashCMD;
-                    FlashData_t *flashData = m_FlashData.at(m_FlashData_idx);
-                    flashData->m_data.insert(0, FLASH_MEM_WR_BLOCK_SIZE - 1); //No of databytes to send
-                    sendData(flashData->m_data);
+                    const FlashBlock_t &block = m_FlashData.at(m_FlashData_idx);
+                    //Write length must be a multiple of FLASH_MEM_WR_ALIGN, pad with erased bytes
+                    qint32 length = ((block.m_length + FLASH_MEM_WR_ALIGN - 1) / FLASH_MEM_WR_ALIGN) * FLASH_MEM_WR_ALIGN;
+                    QByteArray frame;
+                    frame.reserve(length + 1);
+                    frame.append(static_cast<char>(length - 1)); //No of databytes to send
+                    frame.append(m_Image.blockData(block), block.m_length);
+                    while(frame.size() <= length)
+                    {
+                        frame.append(static_cast<char>(0xff));
+                    }
+                    sendData(frame);
+                    m_WritePending = true;
                     m_FlashData_idx++;
-                    m_IOcontrUpdateTimer->start(5000);
+                    awaitReply(eAwaitWrite);
                 }
                 else
                 {
                     m_IOcontrUpdateStatus = eBootExit;
-                    m_IOcontrUpdateTimer->start(5000);
+                    continueNow();
                     //End prog
                 }
 
+                break;
+            case eBootVerifyCMD:
+                m_IOcontrUpdateStatus = eBootVerifyAddr;
+                sendCMD(eReadMem);
+                awaitReply(eAwaitCommand);
+                break;
+            case eBootVerifyAddr:
+                m_IOcontrUpdateStatus = eBootVerifyLen;
+                sendData(addressBytes(m_FlashData.at(m_Verify_idx).m_address));
+                awaitReply(eAwaitCommand);
+                break;
+            case eBootVerifyLen:
+                m_IOcontrUpdateStatus = eBootVerifyData;
+                sendReadLength(m_FlashData.at(m_Verify_idx).m_length);
+                awaitReply(eAwaitCommand, m_FlashData.at(m_Verify_idx).m_length + 1);
+                break;
+            case eBootVerifyData:
+                if(!m_ResumeCheck)
+                {
+                    emit progress(FlashStats::ePhaseVerify, m_VerifyBytes, m_VerifyTotal);
+                }
+                if(verifyNextBlock())
+                {
+                    m_IOcontrUpdateStatus = eBootVerifyAddr;
+                    sendCMD(eReadMem);
+                    awaitReply(eAwaitCommand);
+                }
+                else if(m_ResumeCheck)
+                {
+                    finishResumeCheck();
+                    continueNow();
+                }
+                else
+                {
+                    exitBoot();
+                }
+                break;
+            case eBootDumpCMD:
+                m_IOcontrUpdateStatus = eBootDumpAddr;
+                sendCMD(eReadMem);
+                awaitReply(eAwaitCommand);
+                break;
+            case eBootDumpAddr:
+                m_IOcontrUpdateStatus = eBootDumpLen;
+                sendData(addressBytes(m_DumpAddress + static_cast<quint32>(m_DumpData.size())));
+                awaitReply(eAwaitCommand);
+                break;
+            case eBootDumpLen:
+                m_IOcontrUpdateStatus = eBootDumpData;
+                sendReadLength(static_cast<quint16>(qMin<quint32>(READ_MEM_MAX_SIZE, m_DumpLength - static_cast<quint32>(m_DumpData.size()))));
+                awaitReply(eAwaitCommand, m_ReadBytesLeft + 1);
+                break;
+            case eBootDumpData:
+                if(static_cast<quint32>(m_DumpData.size() + m_ReadBuffer.size()) < m_DumpLength)
+                {
+                    //Next request on the wire before the chunk is stored
+                    m_IOcontrUpdateStatus = eBootDumpAddr;
+                    sendCMD(eReadMem);
+                    awaitReply(eAwaitCommand);
+                    m_DumpData.append(m_ReadBuffer);
+                }
+                else
+                {
+                    m_DumpData.append(m_ReadBuffer);
+                    m_DumpMs = m_DumpTimer.elapsed();
+                    m_IOcontrUpdateStatus = eBootExit;
+                    continueNow();
+                }
+                emit progress(FlashStats::ePhaseReadBack, m_DumpData.size(), m_DumpLength);
                 break;
             case eBootExit:
+                if(m_Options.m_fastExit && m_error == eNoError && goAddress() != 0 &&
+                   m_IOcontrBootloaderCommandSet.contains(eGo))
+                {
+                    m_Stats.setPhase(FlashStats::ePhaseExit);
+                    m_IOcontrUpdateStatus = eBootGoAddr;
+                    sendCMD(eGo);
+                    awaitReply(eAwaitCommand);
+                    break;
+                }
                 exitBoot();
+                break;
+            case eBootGoAddr:
+                m_IOcontrUpdateStatus = eBootGoStarted;
+                sendData(addressBytes(goAddress()));
+                awaitReply(eAwaitCommand);
+                break;
+            case eBootGoStarted:
+                startApplication();
 
                 break;
             default:
@@ -172,9 +655,25 @@ void IoControllerUpdateThread::receivedData(void)
 {
     QByteArray data = m_SerialPort->readAll();
     qint32 dataIdx = 0;
-    static qint32 noBytesLeftOfResponce = 0xffff;
     qint32 bytesRemaining = data.size();
 
+    //Nothing is expected while the IO Controller restarts, drop whatever it sends
+    if(data.isEmpty() || m_ReceiveStatus == eMessageInit)
+    {
+        return;
+    }
+
+    if(m_IOcontrUpdateStatus == eBootResync)
+    {
+        //ACKs for frames completed by the fill bytes are skipped, a NACK means the bootloader waits for a command
+        if(data.contains(static_cast<char>(BOOT_NACK)))
+        {
+            m_ReceiveStatus = eMessageReceived;
+            IOcontrUpdateProc();
+        }
+        return;
+    }
+
     if(m_ReceiveStatus == eMessageSyncronizing)
     {
         //Sync
@@ -184,13 +683,23 @@ void IoControllerUpdateThread::receivedData(void)
             {
                 qCDebug(DBG_IOCFLASH_UPDATE_THREAD) <<  "Received NACK on CMD:" << m_BootCMDpending;
 
+                if(m_BootCMDpending == eAutoBaudSig)
+                {
+                    //Already synchronised, a probe was taken as a command. Bootloader is up and waits for a command.
+                    m_ReceiveStatus = eMessageReceived;
+                    bootReady();
+                    IOcontrUpdateProc();
+                    return;
+                }
+
                 m_ReceiveStatus = eMessageError;
+                IOcontrUpdateProc();   //Handle the failed transaction right away
                 return;
             }
             if(data.at(dataIdx++) == BOOT_ACK)
             {
                 m_ReceiveStatus = eMessageReceiving;
-                noBytesLeftOfResponce = 0xffff; //Indicate that next byte to read is responce length
+                m_ResponceBytesLeft = 0xffff; //Indicate that next byte to read is responce length
             }
             bytesRemaining--;
         } while(bytesRemaining && m_ReceiveStatus == eMessageSyncronizing);
@@ -201,28 +710,30 @@ void IoControllerUpdateThread::receivedData(void)
         switch(m_BootCMDpending)
         {
             case eGet:
+            case eGetID:
             {
                 if(bytesRemaining)
                 {
-                    if(noBytesLeftOfResponce == 0xffff)
+                    if(m_ResponceBytesLeft == 0xffff)
                     {
-                        noBytesLeftOfResponce = data.at(dataIdx++) + 1;
+                        m_ResponceBytesLeft = static_cast<quint8>(data.at(dataIdx++)) + 1;
 
                         bytesRemaining--;
-                        m_IOcontrBootloaderCommandSet.clear();
+                        m_ReadBuffer.clear();
 
                     }
-                    while(bytesRemaining && noBytesLeftOfResponce)
+                    while(bytesRemaining && m_ResponceBytesLeft)
                     {
-                        m_IOcontrBootloaderCommandSet.append(static_cast<quint8>(data.at(dataIdx++)));
+                        m_ReadBuffer.append(data.at(dataIdx++));
                         bytesRemaining--;
-                        noBytesLeftOfResponce--;
+                        m_ResponceBytesLeft--;
                     }
-                    if(noBytesLeftOfResponce == 0 && bytesRemaining) //Look for ACK
+                    if(m_ResponceBytesLeft == 0 && bytesRemaining) //Look for ACK
                     {
                         if(data.at(dataIdx) == BOOT_ACK)
                         {
                             m_ReceiveStatus = eMessageReceived;
+                            bootInfoReceived();
                         }
                         else
                         {
@@ -235,11 +746,35 @@ void IoControllerUpdateThread::receivedData(void)
             }
             case eGetVerAndReadProtStat:
                 break;
-            case eGetID:
-                break;
             case eReadMem:
+                if(m_ReadBytesLeft == 0)
+                {
+                    //ACK for command or address
+                    m_ReceiveStatus = eMessageReceived;
+                    break;
+                }
+                if(bytesRemaining)
+                {
+                    qint32 chunk = qMin(bytesRemaining, m_ReadBytesLeft);
+                    if(m_IOcontrUpdateStatus == eBootVerifyData)
+                    {
+                        verifyChunk(data.constData() + dataIdx, chunk);
+                    }
+                    else
+                    {
+                        m_ReadBuffer.append(data.constData() + dataIdx, chunk);
+                    }
+                    dataIdx += chunk;
+                    bytesRemaining -= chunk;
+                    m_ReadBytesLeft -= chunk;
+                }
+                if(m_ReadBytesLeft == 0)
+                {
+                    m_ReceiveStatus = eMessageReceived;
+                }
                 break;
             case eGo:
+                m_ReceiveStatus = eMessageReceived;
                 break;
             case eWriteMem:
                 m_ReceiveStatus = eMessageReceived;
@@ -248,6 +783,7 @@ void IoControllerUpdateThread::receivedData(void)
                 m_ReceiveStatus = eMessageReceived;
                 break;
             case eExtErase:
+                m_ReceiveStatus = eMessageReceived;
                 break;
             case eWriteProt:
                 break;
@@ -259,6 +795,7 @@ void IoControllerUpdateThread::receivedData(void)
                 break;
             case eAutoBaudSig:
                 m_ReceiveStatus = eMessageReceived;
+                bootReady();
                 break;
             case eNoCMD:
                 break;
@@ -268,7 +805,8 @@ void IoControllerUpdateThread::receivedData(void)
     }
     if(m_ReceiveStatus == eMessageReceived)
     {
-        m_IOcontrUpdateTimer->start(1);   //Fire update timer immedate if recieved message
+        replyReceived();
+        IOcontrUpdateProc();   //Send the next frame right away
     }
 }
 
@@ -303,6 +841,10 @@ void IoControllerUpdateThread::sendCMD(BootCMD_t a_CMD)
     m_ReceiveStatus = eMessageSyncronizing;
     m_BootCMDpending = a_CMD;
 
+    //Only the length sent after a Read Memory command makes its reply data
+    m_ReadBytesLeft = 0;
+
+    m_TxBytes = byteArray.size();
     int bytesSent = m_SerialPort->write(byteArray);
     if (bytesSent != byteArray.size())
     {
@@ -321,7 +863,7 @@ void IoControllerUpdateThread::sendData(QByteArray a_bytesToSend)
         chSum ^= byte;
     }
 
-    if(m_BootCMDpending == eErase && ((unsigned char) a_bytesToSend.at(0)) == 0xff)
+    if(m_BootCMDpending == eErase && a_bytesToSend.size() == 1 && ((unsigned char) a_bytesToSend.at(0)) == 0xff)
     {
         chSum = 0;
     }
@@ -330,6 +872,7 @@ void IoControllerUpdateThread::sendData(QByteArray a_bytesToSend)
 
     m_ReceiveStatus = eMessageSyncronizing;
 
+    m_TxBytes = byteArray.size();
     int bytesSent = m_SerialPort->write(byteArray);
     if (bytesSent != byteArray.size())
     {
@@ -337,6 +880,26 @@ void IoControllerUpdateThread::sendData(QByteArray a_bytesToSend)
     }
 }
 
+void IoControllerUpdateThread::sendReadLength(quint16 a_Length)
+{
+    QByteArray byteArray;
+    quint8 length = static_cast<quint8>(a_Length - 1);
+
+    byteArray.append(static_cast<char>(length));
+    byteArray.append(static_cast<char>(~length));
+
+    m_ReadBuffer.clear();
+    m_ReadBytesLeft = a_Length;
+    m_ReceiveStatus = eMessageSyncronizing;
+
+    m_TxBytes = byteArray.size();
+    int bytesSent = m_SerialPort->write(byteArray);
+    if (bytesSent != byteArray.size())
+    {
+        qCWarning(DBG_IOCFLASH_UPDATE_THREAD) << "Failed sending read length";
+    }
+}
+
 void IoControllerUpdateThread::setBootMode(IOCtrlBootMode_t a_BootMode)
 {
     qCDebug(DBG_IOCFLASH_UPDATE_THREAD) << "BootMode:" << a_BootMode;
@@ -359,269 +922,1100 @@ void IoControllerUpdateThread::ioControllerReset(bool a_Reset)
     m_iocGPIOmcuReset.set(a_Reset);
 }
 
+void IoControllerUpdateThread::restartIOcontroller(IOCtrlBootMode_t a_BootMode, void (IoControllerUpdateThread::*a_pStarted)(void))
+{
+    //Timers instead of sleeping, other updates share the event loop
+    m_ReceiveStatus = eMessageInit;
+    m_BootProbeTimer->stop();
+    setBootMode(a_BootMode);
+    QTimer::singleShot(BOOT_RESET_PULSE_TIME, this, [this]() { ioControllerReset(true); });
+    QTimer::singleShot(BOOT_RESTART_TIME, this, [this, a_pStarted]()
+    {
+        ioControllerReset(false);
+        (this->*a_pStarted)();
+    });
+}
+
 void IoControllerUpdateThread::enterBoot(void)
 {
-    qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "Restart IOProc in boot mode";
+    qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "Restart IOProc in boot mode:" << qPrintable(m_Target.m_port);
 
-    //Restart IOProc in boot mode
-    setBootMode(IOCTRLBOOT_REPROGRAM);
-    msleep(5);
-    ioControllerReset(true);
-    msleep(5);
-    ioControllerReset(false);
-    msleep(500);
+    m_Stats.setPhase(FlashStats::ePhaseBootEntry);
+
+    restartIOcontroller(IOCTRLBOOT_REPROGRAM, &IoControllerUpdateThread::bootStarted);
+}
 
+void IoControllerUpdateThread::bootStarted(void)
+{
     qCInfo(DBG_IOCFLASH_UPDATE_THREAD, "Enter boot");
 
+    //Probe until the bootloader answers instead of waiting a fixed startup time
+    m_BootProbes = 0;
+    m_BootReadyTimer.start();
+    sendBootProbe();
+    m_BootProbeTimer->start(BOOT_PROBE_INTERVAL);
+}
+
+void IoControllerUpdateThread::sendBootProbe(void)
+{
+    if(m_BootReadyTimer.elapsed() >= BOOT_PROBE_DEADLINE)
+    {
+        //Left to the update state machine timeout
+        m_BootProbeTimer->stop();
+        return;
+    }
+
+    m_BootProbes++;
     sendCMD(eAutoBaudSig);
 }
 
+void IoControllerUpdateThread::bootReady(void)
+{
+    m_BootProbeTimer->stop();
+    m_BootReadyMs = m_BootReadyTimer.elapsed();
+
+    qCInfo(DBG_IOCFLASH_UPDATE_THREAD, "Bootloader ready %lld ms after reset, %d probes", m_BootReadyMs, m_BootProbes);
+}
+
 void IoControllerUpdateThread::exitBoot(void)
 {
-    qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "Exit boot";
+    qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "Exit boot:" << qPrintable(m_Target.m_port);
 
-    //Restart IOProc in user prog mode
-    setBootMode(IOCTRLBOOT_NORMAL);
-    msleep(5);
-    ioControllerReset(true);
-    msleep(5);
-    ioControllerReset(false);
-    msleep(500);
+    m_Stats.setPhase(FlashStats::ePhaseExit);
 
     m_IOcontrUpdateTimer->stop();
-    m_SerialPort->flush();
-    m_SerialPort->close();
-
-    disconnect(m_SerialPort, &QIODevice::readyRead, this, &IoControllerUpdateThread::receivedData);
     disconnect(m_IOcontrUpdateTimer, &QTimer::timeout, this, &IoControllerUpdateThread::IOcontrUpdateProc);
 
-    if(m_error)
-    {
-        emit updateFinished(false);
-    }
-    else
-    {
-        emit updateFinished(true);
-    }
+    //Restart IOProc in user prog mode
+    restartIOcontroller(IOCTRLBOOT_NORMAL, &IoControllerUpdateThread::finishUpdate);
 }
 
-
-void IoControllerUpdateThread::terminateBoot(void)
+void IoControllerUpdateThread::startApplication(void)
 {
-    qCInfo(DBG_IOCFLASH_UPDATE_THREAD);
-    exitBoot();
+    qCInfo(DBG_IOCFLASH_UPDATE_THREAD, "Started application at 0x%08x: %s", goAddress(), qPrintable(m_Target.m_port));
+
+    m_IOcontrUpdateTimer->stop();
+    disconnect(m_IOcontrUpdateTimer, &QTimer::timeout, this, &IoControllerUpdateThread::IOcontrUpdateProc);
+    disconnect(m_SerialPort, &QIODevice::readyRead, this, &IoControllerUpdateThread::receivedData);
+
+    //A later reset runs the application, not the bootloader
+    setBootMode(IOCTRLBOOT_NORMAL);
 
+    //Short retries, the application answers within its startup time or it is restarted by reset
+    m_GoTimer.start();
+    m_pAppCheck = new IoControllerCommThread();
+    m_pAppCheck->setSerialPort(m_SerialPort);
+    m_pAppCheck->setRequests(APP_POLL_COUNT, APP_POLL_INTERVAL);
+    m_pAppCheck->setDeadline(&m_Timing.deadline(FlashTiming::eApp));
+    connect(m_pAppCheck, &IoControllerCommThread::reportVersion, this, &IoControllerUpdateThread::appStarted);
+    QMetaObject::invokeMethod(m_pAppCheck, "getVerIOprocessor", Qt::QueuedConnection, Q_ARG(QString, m_Target.m_port));
 }
 
-bool IoControllerUpdateThread::configureSerial(QString a_SerialPort, BaudRateType a_BaudRate)
+void IoControllerUpdateThread::appStarted(SWversion_t a_version)
 {
-    if (0 < a_SerialPort.length())
+    //Still in its receive handler
+    m_pAppCheck->deleteLater();
+    m_pAppCheck = nullptr;
+
+    if(a_version.m_verMaj == 0 &&
+       a_version.m_verMin == 0 &&
+       a_version.m_verMaint == 0 &&
+       a_version.m_verBuild == 0)
     {
-        m_SerialPort = new QextSerialPort(a_SerialPort, QextSerialPort::EventDriven );
-        m_SerialPort->setBaudRate(a_BaudRate);
-        m_SerialPort->setFlowControl(FLOW_OFF);
-        m_SerialPort->setParity(PAR_EVEN);
-        m_SerialPort->setDataBits(DATA_8);
-        m_SerialPort->setStopBits(STOP_1);
-        if(!m_SerialPort->open(QIODevice::ReadWrite))
-        {
-            qCWarning(DBG_IOCFLASH_UPDATE_THREAD) << "Unable to open serial port:" << qPrintable(m_SerialPort->errorString());
-            return false;
-        }
-        return true;
+        qCWarning(DBG_IOCFLASH_UPDATE_THREAD, "No answer %lld ms after GO, starting the application by reset", m_GoTimer.elapsed());
+        restartIOcontroller(IOCTRLBOOT_NORMAL, &IoControllerUpdateThread::finishUpdate);
+        return;
     }
 
-    qCWarning(DBG_IOCFLASH_UPDATE_THREAD) <<  "No COM port defined";
-    return false;
+    m_AppReadyMs = m_GoTimer.elapsed();
+    qCInfo(DBG_IOCFLASH_UPDATE_THREAD, "Application %u.%u.%u.%u answered %lld ms after GO",
+           a_version.m_verMaj, a_version.m_verMin, a_version.m_verMaint, a_version.m_verBuild, m_AppReadyMs);
+    finishUpdate();
 }
 
-void IoControllerUpdateThread::updateIOcontroller(QString a_SerialPort, QByteArray a_SimFileData)
+quint32 IoControllerUpdateThread::goAddress(void) const
 {
-    if(configureSerial(a_SerialPort, BAUD115200))
+    if(m_Image.segments().isEmpty() || m_Image.segments().first().m_length < 8)
     {
-        m_SerialPort->flush();
+        return 0;
+    }
+
+    //Initial stack pointer in SRAM and a thumb reset handler in flash
+    const FlashSegment_t &first = m_Image.segments().first();
+    const uchar *vectors = reinterpret_cast<const uchar *>(m_Image.constData(first.m_offset));
+    quint32 stack = vectors[0] | (vectors[1] << 8) | (vectors[2] << 16) | (static_cast<quint32>(vectors[3]) << 24);
+    quint32 reset = vectors[4] | (vectors[5] << 8) | (vectors[6] << 16) | (static_cast<quint32>(vectors[7]) << 24);
+    if((stack & 0xff000000u) != SRAM_BASE_ADDRESS || (reset & 1) == 0 ||
+       !m_Geometry.contains(first.m_address, 8) || !m_Geometry.contains(reset & ~1u, 2))
+    {
+        return 0;
+    }
+    return first.m_address;
+}
+
+void IoControllerUpdateThread::finishUpdate(void)
+{
+    //The session failed before the plan was built, the worker still uses the plan
+    m_PlanWatcher.waitForFinished();
+
+    if(m_error == eNoError || m_error == eErrorVerifyFailed)
+    {
+        //Nothing to resume, or the acknowledged blocks can not be trusted
+        m_Journal.remove();
+    }
+    else
+    {
+        m_Journal.save();
+    }
+    m_Timing.save();
+    qCInfo(DBG_IOCFLASH_UPDATE_THREAD, "Deadlines: command %d ms, block write %d ms, from %d and %d round trips",
+           m_Timing.deadline(FlashTiming::eCommand).deadlineMs(1), m_Timing.deadline(FlashTiming::eWrite).deadlineMs(FLASH_MEM_WR_BLOCK_SIZE + 8),
+           m_Timing.deadline(FlashTiming::eCommand).samples(), m_Timing.deadline(FlashTiming::eWrite).samples());
+
+    m_SerialPort->flush();
+    if(!m_SharedPort)
+    {
+        m_SerialPort->close();
+    }
+
+    disconnect(m_SerialPort, &QIODevice::readyRead, this, &IoControllerUpdateThread::receivedData);
+
+    if(!m_BlockRetryCounts.isEmpty() || m_SessionRestarts > 0)
+    {
+        qCInfo(DBG_IOCFLASH_UPDATE_THREAD, "%d block retries, %d session restarts", blockRetries(), m_SessionRestarts);
+        for(auto it = m_BlockRetryCounts.constBegin(); it != m_BlockRetryCounts.constEnd(); ++it)
+        {
+            qCInfo(DBG_IOCFLASH_UPDATE_THREAD, "  block 0x%08x: %d retries", it.key(), it.value());
+        }
+    }
+
+    if(m_VerifyBytes > 0)
+    {
+        qint64 elapsed = qMax<qint64>(m_VerifyTimer.elapsed(), 1);
+        if(m_VerifyMismatchAddr != 0)
+        {
+            qCWarning(DBG_IOCFLASH_UPDATE_THREAD, "Verify failed, first mismatch at 0x%08x", m_VerifyMismatchAddr);
+        }
+        qCInfo(DBG_IOCFLASH_UPDATE_THREAD, "Verified %lld bytes in %lld ms (%lld bytes/s)",
+               m_VerifyBytes, elapsed, m_VerifyBytes * 1000 / elapsed);
+    }
+
+    m_Stats.addVerifiedBytes(m_VerifyBytes);
+    m_Stats.finish();
+
+    if(m_error)
+    {
+        emit updateFinished(false);
+    }
+    else
+    {
+        emit updateFinished(true);
+    }
+}
+
+
+void IoControllerUpdateThread::terminateBoot(void)
+{
+    qCInfo(DBG_IOCFLASH_UPDATE_THREAD);
+    exitBoot();
+
+}
+
+bool IoControllerUpdateThread::configureSerial(QString a_SerialPort, BaudRateType a_BaudRate)
+{
+    if(m_SharedPort)
+    {
+        //Open already, the app protocol runs without parity
+        m_SerialPort->setBaudRate(a_BaudRate);
+        m_SerialPort->setFlowControl(FLOW_OFF);
+        m_SerialPort->setParity(PAR_EVEN);
+        m_SerialPort->setDataBits(DATA_8);
+        m_SerialPort->setStopBits(STOP_1);
+        m_SerialPort->readAll();
+        return m_SerialPort->isOpen();
+    }
+
+    if (0 < a_SerialPort.length())
+    {
+        delete m_SerialPort;
+        m_SerialPort = new QextSerialPort(a_SerialPort, QextSerialPort::EventDriven );
+        m_SerialPort->setBaudRate(a_BaudRate);
+        m_SerialPort->setFlowControl(FLOW_OFF);
+        m_SerialPort->setParity(PAR_EVEN);
+        m_SerialPort->setDataBits(DATA_8);
+        m_SerialPort->setStopBits(STOP_1);
+        if(!m_SerialPort->open(QIODevice::ReadWrite))
+        {
+            qCWarning(DBG_IOCFLASH_UPDATE_THREAD) << "Unable to open serial port:" << qPrintable(m_SerialPort->errorString());
+            return false;
+        }
+        return true;
+    }
+
+    qCWarning(DBG_IOCFLASH_UPDATE_THREAD) <<  "No COM port defined";
+    return false;
+}
+
+void IoControllerUpdateThread::beginUpdate(void)
+{
+    m_SessionTimer.start();
+    m_Stats.start();
+    m_Geometry = FlashGeometry(m_Options.m_chipId);
+    m_ChipId = 0;
+    m_BytesProgrammed = 0;
+    m_ProgramTotal = 0;
+    m_BootReadyMs = -1;
+    m_VerifyBytes = 0;
+    m_VerifyMismatchAddr = 0;
+    m_Dumping = false;
+    m_DumpData.clear();
+    m_DumpMs = 0;
+    m_DumpTimer.invalidate();
+    m_BlockRetryCounts.clear();
+    m_AppReadyMs = -1;
+    m_SessionRestarts = 0;
+    m_Await = eAwaitNone;
+    m_Timing.load(m_Options.m_cacheDir, m_Target.m_port);
+    m_RetryCounter = 0;
+    m_error = eNoError;
+    m_PlanError = eNoError;
+    m_PlanReady = false;
+    m_ReceiveStatus = eMessageSyncronizing;
+    m_BootCMDpending = eNoCMD;
+
+    //An instance may run several updates, the last one left the journal and the state machine timer behind
+    m_Journal = FlashJournal();
+    connect(m_IOcontrUpdateTimer, &QTimer::timeout, this, &IoControllerUpdateThread::IOcontrUpdateProc, Qt::UniqueConnection);
+
+    if(configureSerial(m_Target.m_port, BAUD115200))
+    {
+        m_SerialPort->flush();
 
         connect(m_SerialPort, &QIODevice::readyRead, this, &IoControllerUpdateThread::receivedData);
 
+        //Reset into the bootloader while the image is read and parsed
         m_IOcontrUpdateStatus = eBootEnter;
+        m_IOcontrUpdateTimer->start(1);
+    }
+    else
+    {
+        emit updateFinished(false);
+    }
+}
 
-        if(!SimpleCodeProcessFile(a_SimFileData))
+void IoControllerUpdateThread::beginDump(void)
+{
+    beginUpdate();
+    m_Dumping = true;
+}
+
+void IoControllerUpdateThread::updateIOcontroller(QByteArray a_SimFileData)
+{
+    //m_Geometry is only changed by identifyChip, which waits for the plan
+    m_PlanStartNs = m_Stats.elapsedNs();
+    m_PlanWatcher.setFuture(QtConcurrent::run([this, a_SimFileData]() { return loadFlashPlan(a_SimFileData); }));
+}
+
+void IoControllerUpdateThread::planLoaded(void)
+{
+    m_Stats.addPhase(FlashStats::ePhaseParse, m_PlanStartNs, m_Stats.elapsedNs() - m_PlanStartNs);
+
+    if(m_PlanWatcher.result())
+    {
+        //The journal tracks erased pages, a global erase can not be resumed
+        m_JournalTrusted = false;
+        if(m_Options.m_resume && !m_Options.m_verifyOnly && !m_ErasePages.isEmpty())
         {
-            emit updateFinished(false);
+            m_Journal.open(journalPath(), m_ImageHash);
         }
-        else
+        m_PlanReady = true;
+    }
+    else
+    {
+        qCWarning(DBG_IOCFLASH_UPDATE_THREAD) << "No flash plan:" << m_PlanError;
+    }
+
+    if(m_IOcontrUpdateStatus == eBootIdentify && !m_IOcontrUpdateTimer->isActive())
+    {
+        //The bootloader was ready first and waits for the plan
+        m_IOcontrUpdateTimer->start(1);
+    }
+}
+
+bool IoControllerUpdateThread::SimpleCodeProcessFile(const QByteArray &a_FileData)
+{
+    m_PlanError = eNoError;
+    m_FlashData.clear();
+
+    if(!m_Image.load(reinterpret_cast<const uchar *>(a_FileData.constData()), a_FileData.size(), m_Options.m_binBaseAddress))
+    {
+        switch(m_Image.error())
+        {
+            case FlashImage::eErrorFormat:
+                qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "ERR_SIM_BAD_FORMAT";
+                m_PlanError = eErrorSimFile;
+                break;
+            case FlashImage::eErrorChecksum:
+                qCWarning(DBG_IOCFLASH_UPDATE_THREAD) << "ERR_SIM_CHECKSUM";
+                m_PlanError = eErrorSimFileChSum;
+                break;
+            default:
+                m_PlanError = eErrorSimFileBadRecord;
+                break;
+        }
+        qCWarning(DBG_IOCFLASH_UPDATE_THREAD) << m_PlanError;
+        return false;
+    }
+
+    m_Image.buildBlocks(FLASH_MEM_WR_BLOCK_SIZE, FLASH_MEM_WR_ALIGN);
+    m_FlashData = m_Image.blocks();
+
+    qCInfo(DBG_IOCFLASH_UPDATE_THREAD, "Parsed %s image, %lld bytes in %lld us, %d allocations, %d blocks",
+           formatName(m_Image.format()), m_Image.size(), m_Image.parseTimeNs() / 1000, m_Image.allocations(), m_FlashData.count());
+
+    buildErasePageList();
+    skipErasedBlocks(&m_FlashData);
+
+    return true;
+}
+
+const char *IoControllerUpdateThread::formatName(FlashImage::Format_t a_Format)
+{
+    switch(a_Format)
+    {
+        case FlashImage::eFormatSim:
+            return "sim";
+        case FlashImage::eFormatIntelHex:
+            return "Intel HEX";
+        case FlashImage::eFormatSrec:
+            return "S-record";
+        case FlashImage::eFormatBin:
+            return "binary";
+        default:
+            return "unknown";
+    }
+}
+
+FlashPlanLayout_t IoControllerUpdateThread::planLayout(void) const
+{
+    FlashPlanLayout_t layout;
+    layout.m_blockSize = FLASH_MEM_WR_BLOCK_SIZE;
+    layout.m_writeAlign = FLASH_MEM_WR_ALIGN;
+    layout.m_flashBase = FLASH_BASE_ADDRESS;
+    layout.m_chipId = m_Geometry.pid();
+    layout.m_binBaseAddress = m_Options.m_binBaseAddress;
+    return layout;
+}
+
+bool IoControllerUpdateThread::loadFlashPlan(const QByteArray &a_FileData)
+{
+    QElapsedTimer timer;
+    QByteArray key;
+    qint32 parseError;
+    bool ok;
+
+    if(a_FileData.isEmpty())
+    {
+        m_PlanError = eErrorSimFile;
+        return false;
+    }
+
+    timer.start();
+    key = FlashPlanCache::contentHash(a_FileData);
+    m_ImageHash = key;
+
+    if(!m_Options.m_useCache)
+    {
+        ok = SimpleCodeProcessFile(a_FileData);
+        if(ok)
+        {
+            applyPatches();
+        }
+        return ok;
+    }
+
+    m_PlanCache.setDirectory(m_Options.m_cacheDir);
+
+    if(m_PlanCache.load(key, planLayout(), &m_Image, &m_FlashData, &m_ErasePages, &parseError))
+    {
+        m_PlanError = static_cast<Error_t>(parseError);
+        if(m_PlanError != eNoError)
+        {
+            qCWarning(DBG_IOCFLASH_UPDATE_THREAD) << "Cached plan records a bad image:" << m_PlanError;
+            return false;
+        }
+        qCInfo(DBG_IOCFLASH_UPDATE_THREAD, "Loaded cached plan in %lld us, %lld bytes, %d blocks, %d pages to erase",
+               timer.nsecsElapsed() / 1000, m_Image.size(), m_FlashData.count(), m_ErasePages.count());
+        applyPatches();
+        return true;
+    }
+
+    //Bad images are cached too, so a repeated run fails without parsing
+    ok = SimpleCodeProcessFile(a_FileData);
+    m_PlanCache.store(key, planLayout(), m_Image, m_FlashData, m_ErasePages, m_PlanError);
+
+    //The plan is cached unpatched, every unit patches its own copy
+    if(ok)
+    {
+        applyPatches();
+    }
+    return ok;
+}
+
+void IoControllerUpdateThread::applyPatches(void)
+{
+    QElapsedTimer timer;
+    qint32 segments = m_Image.segments().count();
+
+    if(m_Options.m_patches.isEmpty())
+    {
+        return;
+    }
+
+    timer.start();
+    QVector<FlashBlock_t> rebuilt = m_Image.applyPatches(m_Options.m_patches, FLASH_MEM_WR_BLOCK_SIZE, FLASH_MEM_WR_ALIGN, &m_FlashData);
+    skipErasedBlocks(&rebuilt);
+    m_FlashData += rebuilt;
+    std::sort(m_FlashData.begin(), m_FlashData.end(),
+              [](const FlashBlock_t &a, const FlashBlock_t &b) { return a.m_address < b.m_address; });
+
+    if(m_Image.segments().count() != segments)
+    {
+        //Patched bytes outside the image data, their sectors need erasing too
+        buildErasePageList();
+    }
+
+    m_ImageHash = FlashPlanCache::contentHash(m_ImageHash, m_Options.m_patches);
+
+    qCInfo(DBG_IOCFLASH_UPDATE_THREAD, "Applied %d patches in %lld us, %d blocks rebuilt, %d pages to erase",
+           m_Options.m_patches.count(), timer.nsecsElapsed() / 1000, rebuilt.count(), m_ErasePages.count());
+}
+
+QByteArray IoControllerUpdateThread::addressBytes(quint32 a_Address)
+{
+    QByteArray data;
+    data.append(static_cast<char>((a_Address >> 24) & 0xff));
+    data.append(static_cast<char>((a_Address >> 16) & 0xff));
+    data.append(static_cast<char>((a_Address >> 8) & 0xff));
+    data.append(static_cast<char>(a_Address & 0xff));
+    return data;
+}
+
+void IoControllerUpdateThread::buildErasePageList(void)
+{
+    m_ErasePages.clear();
+
+    //Segments, not blocks: blank blocks are dropped from m_FlashData but their pages still need erasing
+    for(const FlashSegment_t &segment : m_Image.segments())
+    {
+        qint32 firstPage = m_Geometry.sectorAt(segment.m_address);
+        qint32 lastPage = m_Geometry.sectorAt(segment.m_address + segment.m_length - 1);
+
+        if(firstPage < 0 || lastPage < 0)
+        {
+            //Not in main flash, fall back to erasing everything
+            qCWarning(DBG_IOCFLASH_UPDATE_THREAD) << "Segment outside flash at" << QString::number(segment.m_address, 16);
+            m_ErasePages.clear();
+            return;
+        }
+
+        for(qint32 page = firstPage; page <= lastPage; page++)
+        {
+            //Segments are in address order, so only the last page can be a duplicate
+            if(m_ErasePages.isEmpty() || m_ErasePages.last() < page)
+            {
+                m_ErasePages.append(static_cast<quint16>(page));
+            }
+        }
+    }
+
+    qCDebug(DBG_IOCFLASH_UPDATE_THREAD) << "Pages to erase:" << m_ErasePages;
+}
+
+void IoControllerUpdateThread::skipErasedBlocks(QVector<FlashBlock_t> *a_pBlocks)
+{
+    qint32 skippedBlocks = 0;
+    qint32 skippedBytes = 0;
+
+    for(qint32 i = 0; i < a_pBlocks->count();)
+    {
+        FlashBlock_t &block = (*a_pBlocks)[i];
+        const char *data = m_Image.blockData(block);
+        qint32 lastUsed = block.m_length - 1;
+
+        while(lastUsed >= 0 && static_cast<quint8>(data[lastUsed]) == 0xff)
+        {
+            lastUsed--;
+        }
+
+        if(lastUsed < 0)
+        {
+            //Nothing to write, the page is blank after erase
+            skippedBlocks++;
+            skippedBytes += block.m_length;
+            a_pBlocks->remove(i);
+            continue;
+        }
+
+        skippedBytes += block.m_length - (lastUsed + 1);
+        block.m_length = static_cast<quint16>(lastUsed + 1);
+        i++;
+    }
+
+    qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "Skipped" << skippedBlocks << "blank blocks," << skippedBytes << "bytes of 0xff";
+}
+
+QByteArray IoControllerUpdateThread::buildEraseData(bool a_Extended, qint32 *a_pTimeoutMs, quint32 *a_pBytes)
+{
+    QByteArray data;
+    const QList<quint16> &pages = erasePages();
+    quint16 specialErase = specialEraseCode();
+
+    *a_pTimeoutMs = m_Geometry.massEraseTimeoutMs();
+    *a_pBytes = 0;
+
+    if(a_Extended)
+    {
+        if(pages.isEmpty() || specialErase != 0)
+        {
+            //Mass or bank erase, one command instead of a sector erase per page
+            specialErase = pages.isEmpty() ? MASS_ERASE_CODE : specialErase;
+            data.append(static_cast<char>(specialErase >> 8));
+            data.append(static_cast<char>(specialErase & 0xff));
+            return data;
+        }
+
+        data.append(static_cast<char>(((pages.count() - 1) >> 8) & 0xff));
+        data.append(static_cast<char>((pages.count() - 1) & 0xff));
+        for(quint16 page : pages)
         {
-            m_IOcontrUpdateTimer->start(1000);
+            data.append(static_cast<char>((page >> 8) & 0xff));
+            data.append(static_cast<char>(page & 0xff));
+            *a_pBytes += m_Geometry.sectorSize(page);
+        }
+        *a_pTimeoutMs = pageEraseTimeoutMs();
+        return data;
+    }
+
+    if(specialErase == MASS_ERASE_CODE)
+    {
+        //All pages listed, erasing all keeps them in m_ErasePages for the journal
+        data.append(static_cast<char>(0xff));
+        return data;
+    }
+
+    //Standard erase only holds up to 255 one byte page numbers. retryBlock never asks for such a page.
+    if(pages.isEmpty() || pages.count() > 0xff || pages.last() > 0xff)
+    {
+        m_ErasePages.clear();
+        data.append(static_cast<char>(0xff));   //Erase all
+        return data;
+    }
+
+    data.append(static_cast<char>(pages.count() - 1));
+    for(quint16 page : pages)
+    {
+        data.append(static_cast<char>(page));
+        *a_pBytes += m_Geometry.sectorSize(page);
+    }
+    *a_pTimeoutMs = pageEraseTimeoutMs();
+    return data;
+}
+
+quint16 IoControllerUpdateThread::specialEraseCode(void) const
+{
+    qint32 bankSectors = m_Geometry.bankSectors();
+    const QList<quint16> &pages = erasePages();
+
+    //The pages are sorted without duplicates
+    if(pages.isEmpty())
+    {
+        return 0;
+    }
+    if(pages.count() == m_Geometry.sectorCount())
+    {
+        return MASS_ERASE_CODE;
+    }
+    if(bankSectors > 0 && pages.count() == bankSectors)
+    {
+        if(pages.last() == bankSectors - 1)
+        {
+            return BANK1_ERASE_CODE;
+        }
+        if(pages.first() == bankSectors && pages.last() == 2 * bankSectors - 1)
+        {
+            return BANK2_ERASE_CODE;
+        }
+    }
+    return 0;
+}
+
+qint32 IoControllerUpdateThread::pageEraseTimeoutMs(void) const
+{
+    qint32 timeout = 0;
+
+    for(quint16 page : erasePages())
+    {
+        timeout += m_Geometry.eraseTimeoutMs(page);
+    }
+    return timeout;
+}
+
+const QList<quint16> &IoControllerUpdateThread::erasePages(void) const
+{
+    return m_RetryErasePages.isEmpty() ? m_ErasePages : m_RetryErasePages;
+}
+
+void IoControllerUpdateThread::bootInfoReceived(void)
+{
+    if(m_BootCMDpending == eGet)
+    {
+        //Bootloader version first, then the supported commands
+        m_BootloaderVersion = static_cast<quint8>(m_ReadBuffer.at(0));
+        m_IOcontrBootloaderCommandSet.clear();
+        for(qint32 i = 1; i < m_ReadBuffer.size(); i++)
+        {
+            m_IOcontrBootloaderCommandSet.append(static_cast<quint8>(m_ReadBuffer.at(i)));
         }
     }
     else
     {
-        emit updateFinished(false);
+        m_ChipId = 0;
+        for(char byte : m_ReadBuffer)
+        {
+            m_ChipId = static_cast<quint16>((m_ChipId << 8) | static_cast<quint8>(byte));
+        }
     }
 }
 
-bool IoControllerUpdateThread::SimpleCodeProcessFile(QByteArray a_FileData)
+bool IoControllerUpdateThread::identifyChip(void)
 {
-    quint32 drec_start;
-    quint32 drec_bytes;
-    qint16 record_tag;
-    qint16 record_number = 0;
-    quint32 curr_addr;
-    quint32 i; // Also used for checksum calculation.
-    quint8 byte;
-    quint8 proceed;
-    qint8 record_error = 0;
-    QByteArray simFileData = a_FileData;
-    qint32 simFileDataIdx = 0;
-    FlashData_t *flashData;
-    qint32 flashDataIdx = 0;
+    if(m_ChipId == 0)
+    {
+        qCInfo(DBG_IOCFLASH_UPDATE_THREAD, "Bootloader v%u.%u, chip not identified, assuming %s",
+               m_BootloaderVersion >> 4, m_BootloaderVersion & 0xf, m_Geometry.name());
+        return true;
+    }
+    if(!FlashGeometry::isKnown(m_ChipId))
+    {
+        qCWarning(DBG_IOCFLASH_UPDATE_THREAD, "Unknown chip, product ID 0x%03x, assuming %s", m_ChipId, m_Geometry.name());
+        return true;
+    }
 
-    m_checksum=0;
-    m_error = eNoError;
+    FlashGeometry geometry(m_ChipId);
+    qCInfo(DBG_IOCFLASH_UPDATE_THREAD, "%s, product ID 0x%03x, %u KB flash in %d sectors, bootloader v%u.%u",
+           geometry.name(), m_ChipId, geometry.flashSize() / 1024, geometry.sectorCount(),
+           m_BootloaderVersion >> 4, m_BootloaderVersion & 0xf);
+
+    if(geometry != m_Geometry)
+    {
+        //The plan was made for another chip. Write blocks do not depend on the sectors, the erase list does.
+        m_Geometry = geometry;
+        buildErasePageList();
+        qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << m_ErasePages.count() << "sectors to erase";
+    }
+
+    for(const FlashSegment_t &segment : m_Image.segments())
+    {
+        if(!m_Geometry.contains(segment.m_address, segment.m_length))
+        {
+            qCWarning(DBG_IOCFLASH_UPDATE_THREAD, "Image data at 0x%08x-0x%08x is outside the %u KB flash",
+                      segment.m_address, segment.m_address + segment.m_length - 1, m_Geometry.flashSize() / 1024);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool IoControllerUpdateThread::startDump(void)
+{
+    if(m_DumpTimer.isValid())
+    {
+        //Restarted session, continue after the chunks read
+        return true;
+    }
 
-    // Read file header.
-    if (SimFileReadUint(simFileData, &simFileDataIdx, 4) != 0x7f494152) // magic
+    m_DumpAddress = m_Options.m_dumpAddress;
+    m_DumpLength = m_Options.m_dumpLength;
+    if(m_DumpLength == 0)
     {
-        qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "ERR_SIM_BAD_FORMAT";
-        m_error = eErrorSimFile;
+        if(!m_Geometry.contains(m_DumpAddress, 1))
+        {
+            qCWarning(DBG_IOCFLASH_UPDATE_THREAD, "0x%08x is outside the %u KB flash, give the length to read",
+                      m_DumpAddress, m_Geometry.flashSize() / 1024);
+            return false;
+        }
+        m_DumpLength = m_Geometry.flashSize() - (m_DumpAddress - FLASH_BASE_ADDRESS);
+    }
+    else if(static_cast<quint64>(m_DumpAddress) + m_DumpLength > 0x100000000ull)
+    {
+        qCWarning(DBG_IOCFLASH_UPDATE_THREAD, "Range 0x%08x+%u runs past the address space", m_DumpAddress, m_DumpLength);
         return false;
     }
 
-    SimFileReadUint(simFileData, &simFileDataIdx, 4); // flags (not used)
-    SimFileReadUint(simFileData, &simFileDataIdx, 4); // hdr_bytes (not used in tiny mode)
-    SimFileReadUint(simFileData, &simFileDataIdx, 2); // version (not used)
+    qCInfo(DBG_IOCFLASH_UPDATE_THREAD, "Reading %u bytes at 0x%08x...", m_DumpLength, m_DumpAddress);
+    m_DumpData.reserve(static_cast<int>(m_DumpLength));
+    m_DumpTimer.start();
+    return true;
+}
+
+QByteArray IoControllerUpdateThread::expectedPageData(quint16 a_Page)
+{
+    quint32 pageAddr = m_Geometry.sectorAddress(a_Page);
+    quint32 pageSize = m_Geometry.sectorSize(a_Page);
+    QByteArray page(pageSize, static_cast<char>(0xff));
 
-    // Loop over all records.
-    for (proceed = 1; proceed;)
+    for(const FlashSegment_t &segment : m_Image.segments())
     {
+        quint32 endAddr = segment.m_address + segment.m_length;
+        quint32 from = qMax(segment.m_address, pageAddr);
+        quint32 to = qMin(endAddr, pageAddr + pageSize);
 
-        // Read record tag.
-        record_tag = SimFileReadUint(simFileData, &simFileDataIdx, 1);
-        switch (record_tag)
+        if(from < to)
         {
+            memcpy(page.data() + (from - pageAddr), m_Image.constData(segment.m_offset + (from - segment.m_address)), to - from);
+        }
+    }
+    return page;
+}
 
-            case 1: // Data record.
+bool IoControllerUpdateThread::deltaCompareChunk(void)
+{
+    bool pageDone = false;
 
-                SimFileReadUint(simFileData, &simFileDataIdx, 1); // segtype (not used)
-                SimFileReadUint(simFileData, &simFileDataIdx, 2); // flags (not used)
-                drec_start = SimFileReadUint(simFileData, &simFileDataIdx, 4);
-                drec_bytes = SimFileReadUint(simFileData, &simFileDataIdx, 4);
+    if(m_ReadBuffer != m_DeltaExpected.mid(m_DeltaPageOffset, FLASH_MEM_WR_BLOCK_SIZE))
+    {
+        //No need to read the rest of a page that will be erased anyway
+        m_DeltaDirtyPages.append(m_ErasePages.at(m_DeltaPage_idx));
+        pageDone = true;
+    }
+    else
+    {
+        m_DeltaPageOffset += FLASH_MEM_WR_BLOCK_SIZE;
+        pageDone = (m_DeltaPageOffset >= m_Geometry.sectorSize(m_ErasePages.at(m_DeltaPage_idx)));
+    }
 
-                curr_addr = drec_start;
+    if(pageDone)
+    {
+        m_DeltaPageOffset = 0;
+        m_DeltaPage_idx++;
+        if(m_DeltaPage_idx >= m_ErasePages.count())
+        {
+            return false;
+        }
+        m_DeltaExpected = expectedPageData(m_ErasePages.at(m_DeltaPage_idx));
+    }
+    return true;
+}
 
+void IoControllerUpdateThread::finishDelta(void)
+{
+    bool changed = true;
 
+    //A block spanning a changed and an unchanged page needs both erased
+    while(changed)
+    {
+        changed = false;
+        for(const FlashBlock_t &block : m_FlashData)
+        {
+            quint16 firstPage = pageOf(block.m_address);
+            quint16 lastPage = pageOf(block.m_address + block.m_length - 1);
 
-                // Loop over all data bytes in the record.
-                for (i = 0; i < drec_bytes; i++)
+            if(firstPage != lastPage &&
+               m_DeltaDirtyPages.contains(firstPage) != m_DeltaDirtyPages.contains(lastPage))
+            {
+                for(quint16 page = firstPage; page <= lastPage; page++)
                 {
-                    if(flashDataIdx % FLASH_MEM_WR_BLOCK_SIZE == 0)
+                    if(!m_DeltaDirtyPages.contains(page))
                     {
-                        if(flashDataIdx > 0)
-                        {
-                            m_FlashData.append(flashData);
-                        }
-
-                        flashData = new FlashData_t;
-                        flashData->m_startAddress.append((curr_addr & 0xff000000u) >> 24);
-                        flashData->m_startAddress.append((curr_addr & 0xff0000u) >> 16);
-                        flashData->m_startAddress.append((curr_addr & 0xff00u) >> 8);
-                        flashData->m_startAddress.append(curr_addr & 0xff);
-
+                        m_DeltaDirtyPages.append(page);
                     }
-
-                    byte = SimFileReadUint(simFileData, &simFileDataIdx, 1);
-                    flashData->m_data.append(byte);
-                    flashDataIdx++;
-                    curr_addr++;
-                    //bytes_written++;
                 }
-                record_number++;
-                break;
-            case 2: // Entry record (not used in flash loader).
-                SimFileReadUint(simFileData, &simFileDataIdx, 4);
-                SimFileReadUint(simFileData, &simFileDataIdx, 1);
-                break;
-            case 3: // End record.
-                // The checksum itself is not part of the calculated checsum.
-                i = m_checksum; // Save calculated checksum before reading checksum from file.
-                m_checksum = SimFileReadUint(simFileData, &simFileDataIdx, 4);;
-                m_checksum += i; // Should be zero, verified below.
-                proceed = 0;
-                break;
-            default:
-                record_error = 1;
-                break;
+                changed = true;
+            }
         }
     }
+    std::sort(m_DeltaDirtyPages.begin(), m_DeltaDirtyPages.end());
+
+    qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << m_DeltaDirtyPages.count() << "of" << m_ErasePages.count() << "pages differ";
 
-    quint16 currentBytes = flashDataIdx % FLASH_MEM_WR_BLOCK_SIZE;
-    if(currentBytes)
+    for(qint32 i = 0; i < m_FlashData.count();)
     {
-        for(; currentBytes < FLASH_MEM_WR_BLOCK_SIZE; currentBytes++)
+        if(!m_DeltaDirtyPages.contains(pageOf(m_FlashData.at(i).m_address)))
         {
-            flashData->m_data.append(0xff); //Fill the flash data buffer block
+            m_FlashData.remove(i);
         }
+        else
+        {
+            i++;
+        }
+    }
+
+    m_ErasePages = m_DeltaDirtyPages;
 
-        m_FlashData.append(flashData);
+    if(m_ErasePages.isEmpty())
+    {
+        qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "Flash already matches image";
     }
+}
+
+void IoControllerUpdateThread::verifyChunk(const char *a_Data, qint32 a_Length)
+{
+    const FlashBlock_t &block = m_FlashData.at(m_Verify_idx);
+    const char *expected = m_Image.blockData(block) + m_VerifyOffset;
 
+    m_VerifyCrcFlash = Communication::CrcCCITT::continueCrc(m_VerifyCrcFlash, reinterpret_cast<const quint8 *>(a_Data), a_Length);
+    m_VerifyCrcImage = Communication::CrcCCITT::continueCrc(m_VerifyCrcImage, reinterpret_cast<const quint8 *>(expected), a_Length);
 
-    if (record_error)
+    if(m_VerifyMismatchAddr == 0 && memcmp(a_Data, expected, a_Length) != 0)
     {
-        m_error = eErrorSimFileBadRecord;
+        qint32 i = 0;
+        while(a_Data[i] == expected[i])
+        {
+            i++;
+        }
+        m_VerifyMismatchAddr = block.m_address + m_VerifyOffset + i;
     }
 
-    if (m_checksum)
+    m_VerifyOffset += a_Length;
+    m_VerifyBytes += a_Length;
+}
+
+bool IoControllerUpdateThread::verifyNextBlock(void)
+{
+    if(m_VerifyCrcFlash != m_VerifyCrcImage || m_VerifyMismatchAddr != 0)
     {
-        qCWarning(DBG_IOCFLASH_UPDATE_THREAD) << "ERR_SIM_CHECKSUM";
-        m_error = eErrorSimFileChSum;
+        m_error = eErrorVerifyFailed;
+        return false;
     }
 
-    if(m_error)
+    m_VerifyOffset = 0;
+    m_VerifyCrcFlash = Communication::CrcCCITT::CRC_INIT;
+    m_VerifyCrcImage = Communication::CrcCCITT::CRC_INIT;
+    m_Verify_idx++;
+
+    return m_Verify_idx < m_VerifyEnd_idx;
+}
+
+bool IoControllerUpdateThread::retryBlock(void)
+{
+    bool nacked = (m_ReceiveStatus == eMessageError);
+    bool dataSent;
+    qint32 block;
+
+    switch(m_IOcontrUpdateStatus)
+    {
+        case eBootFlashAddr:    //Write memory command not acknowledged
+        case eBootFlashData:    //Address not acknowledged
+            block = m_FlashData_idx;
+            dataSent = false;
+            break;
+        case eBootFlashCMD:     //Data not acknowledged
+            if(m_JournalErasePending || !m_WritePending)
+            {
+                return false;
+            }
+            m_WritePending = false;
+            block = m_FlashData_idx - 1;
+            dataSent = true;
+            break;
+        default:
+            return false;
+    }
+
+    const FlashBlock_t &failed = m_FlashData.at(block);
+    if(m_BlockRetryCounts.value(failed.m_address) >= BLOCK_RETRY_MAX)
     {
-        qCWarning(DBG_IOCFLASH_UPDATE_THREAD) << m_error;
         return false;
     }
 
+    if(dataSent && !nacked)
+    {
+        //The block may have been written, and flash can only be written once after erase.
+        //Erase its page again and rewrite the blocks of that page.
+        if(m_ErasePages.isEmpty())
+        {
+            return false;
+        }
+        quint16 page = pageOf(failed.m_address);
+        if(page > 0xff && !m_IOcontrBootloaderCommandSet.contains(eExtErase))
+        {
+            //The standard erase command can not name this page
+            return false;
+        }
+        m_FlashStart_idx = block;
+        while(m_FlashStart_idx > 0 &&
+              pageOf(m_FlashData.at(m_FlashStart_idx - 1).m_address) == page)
+        {
+            m_FlashStart_idx--;
+        }
+        m_RetryErasePages.clear();
+        m_RetryErasePages.append(page);
+        m_ResyncNext = eBootEraseCMD;
+        qCInfo(DBG_IOCFLASH_UPDATE_THREAD, "Block 0x%08x not acknowledged, erasing page %u again", failed.m_address, page);
+    }
+    else
+    {
+        //A NACKed block was not written
+        m_FlashData_idx = block;
+        m_ResyncNext = eBootFlashCMD;
+        qCInfo(DBG_IOCFLASH_UPDATE_THREAD, "Block 0x%08x failed, retrying", failed.m_address);
+    }
+    m_BlockRetryCounts[failed.m_address]++;
+
+    if(nacked)
+    {
+        //After a NACK the bootloader waits for a command
+        m_IOcontrUpdateStatus = m_ResyncNext;
+        m_ReceiveStatus = eMessageReceived;
+        continueNow();
+    }
+    else
+    {
+        m_IOcontrUpdateStatus = eBootResync;
+        m_ResyncBytes = 0;
+        sendResyncByte();
+    }
     return true;
 }
 
-quint8 IoControllerUpdateThread::SimFileReadByte(QByteArray a_SimFile, qint32 *a_pCurrIdx)
+void IoControllerUpdateThread::sendResyncByte(void)
 {
-    quint8 c;
+    //Fill bytes may complete an address or data frame, programming 0xff leaves flash unchanged
+    m_ResyncBytes++;
+    m_ReceiveStatus = eMessageSyncronizing;
 
-    if(a_SimFile.isEmpty() || *a_pCurrIdx >= a_SimFile.length())
+    if(m_SerialPort->write(QByteArray(1, static_cast<char>(0xff))) != 1)
     {
-        m_error = eErrorSimFile;
-        return 0;
+        qCWarning(DBG_IOCFLASH_UPDATE_THREAD) << "Failed sending resync byte";
+    }
+    awaitDeadline(RESYNC_BYTE_TIMEOUT);
+}
+
+qint32 IoControllerUpdateThread::blockRetries(void) const
+{
+    qint32 retries = 0;
+
+    for(qint32 count : m_BlockRetryCounts)
+    {
+        retries += count;
+    }
+    return retries;
+}
+
+void IoControllerUpdateThread::startVerify(qint32 a_First, qint32 a_End)
+{
+    m_Verify_idx = a_First;
+    m_VerifyEnd_idx = a_End;
+    m_VerifyOffset = 0;
+    m_VerifyCrcFlash = Communication::CrcCCITT::CRC_INIT;
+    m_VerifyCrcImage = Communication::CrcCCITT::CRC_INIT;
+    m_VerifyMismatchAddr = 0;
+    m_VerifyBytes = 0;
+    m_VerifyTotal = 0;
+    for(qint32 i = a_First; i < a_End; i++)
+    {
+        m_VerifyTotal += m_FlashData.at(i).m_length;
     }
+    m_VerifyTimer.start();
+}
+
+QString IoControllerUpdateThread::journalPath(void) const
+{
+    return QDir(m_Options.m_cacheDir).filePath("journal-" + QString(m_Target.m_port).replace('/', '_'));
+}
+
+void IoControllerUpdateThread::journalBlockAcked(qint32 a_Block_idx)
+{
+    const FlashBlock_t &block = m_FlashData.at(a_Block_idx);
+    quint32 page = pageOf(block.m_address);
+
+    m_Journal.recordAcked(block.m_address + block.m_length);
+    m_JournalTrusted = true;
+
+    //Resuming restarts at a page boundary, so the journal is only written once per page
+    if(a_Block_idx + 1 == m_FlashData.count() ||
+       pageOf(m_FlashData.at(a_Block_idx + 1).m_address) != page)
+    {
+        m_Journal.save();
+    }
+}
 
-    c = a_SimFile.at(*a_pCurrIdx);
-    (*a_pCurrIdx)++;
+qint32 IoControllerUpdateThread::firstUnackedBlock(void) const
+{
+    qint32 i = 0;
 
-    return c;
+    while(i < m_FlashData.count() && m_FlashData.at(i).m_address < m_Journal.ackedAddress())
+    {
+        i++;
+    }
+    return i;
 }
 
-quint32 IoControllerUpdateThread::SimFileReadUint(QByteArray a_SimFile, qint32 *a_pCurrIdx, qint16 a_Size)
+bool IoControllerUpdateThread::applyResume(void)
 {
-    qint16 i;
-    quint8 c;
-    quint32 value = 0;
+    qint32 first = firstUnackedBlock();
+    QList<quint16> pages;
+    quint16 resumePage;
+
+    if(first == 0 || m_ErasePages.isEmpty())
+    {
+        return false;
+    }
 
-    // Loop over all bytes to be read and shift them in.
-    for (i = 0; i < a_Size; i++)
+    if(first == m_FlashData.count())
     {
-        if(*a_pCurrIdx >= a_SimFile.length())
+        qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "All blocks already programmed";
+        m_FlashStart_idx = first;
+        m_FlashData_idx = first;
+        m_IOcontrUpdateStatus = eBootFlashCMD;
+        return true;
+    }
+
+    //The first unacknowledged block may be half written, its page is erased and written again.
+    //Later pages are erased unless this process erased them already: pages an earlier run
+    //erased may have been written since by another tool.
+    resumePage = pageOf(m_FlashData.at(first).m_address);
+    pages.append(resumePage);
+    for(quint16 page : m_ErasePages)
+    {
+        if(page > resumePage && (!m_JournalTrusted || !m_Journal.erasedPages().contains(page)))
         {
-            m_error = eErrorSimFile;
-            return 0;
+            pages.append(page);
         }
+    }
+    if(pages.count() > 255 && !m_IOcontrBootloaderCommandSet.contains(eExtErase))
+    {
+        return false;
+    }
 
-        c = SimFileReadByte(a_SimFile, a_pCurrIdx);
-        value <<= 8;
-        value |= c;
-        m_checksum += c; // Calculate checksum.
+    while(first > 0 && pageOf(m_FlashData.at(first - 1).m_address) == resumePage)
+    {
+        first--;
     }
-    return value;
+
+    qCInfo(DBG_IOCFLASH_UPDATE_THREAD, "Resuming at 0x%08x, %d of %d blocks left, %d pages to erase",
+           m_FlashData.at(first).m_address, m_FlashData.count() - first, m_FlashData.count(), pages.count());
+
+    m_ErasePages = pages;
+    m_FlashStart_idx = first;
+    m_IOcontrUpdateStatus = eBootEraseCMD;
+    return true;
 }
 
+void IoControllerUpdateThread::finishResumeCheck(void)
+{
+    bool match = (m_error != eErrorVerifyFailed);
+
+    m_ResumeCheck = false;
+    m_error = eNoError;
+    m_VerifyMismatchAddr = 0;
+    m_VerifyBytes = 0;
+
+    if(!match || !applyResume())
+    {
+        qCInfo(DBG_IOCFLASH_UPDATE_THREAD) << "Flash does not match the journal, programming full image";
+        m_Journal.remove();
+        m_IOcontrUpdateStatus = m_Options.m_delta ? eBootReadCMD : eBootEraseCMD;
+    }
+}
@@ -10,13 +10,20 @@
 #include <QTimer>
 #include <QSettings>
 #include <QSharedPointer>
+#include <QElapsedTimer>
+#include <QFutureWatcher>
+#include <QMap>
 #include <gpio.h>
+#include "flashoptions.h"
+#include "flashimage.h"
+#include "flashplancache.h"
+#include "flashjournal.h"
+#include "flashstats.h"
+#include "flashgeometry.h"
+#include "flashtiming.h"
+#include "SWversion.h"
 
-struct FlashData_t
-{
-    QByteArray m_startAddress;
-    QByteArray m_data;
-};
+class IoControllerCommThread;
 
 
 class IoControllerUpdateThread : public QThread
@@ -25,7 +32,8 @@ class IoControllerUpdateThread : public QThread
 
     public:
         //! \brief ctor
-        IoControllerUpdateThread();
+        //! \param a_Target - the IO Controller to update, its GPIO lines are claimed here
+        explicit IoControllerUpdateThread(const FlashTarget_t &a_Target);
 
         //! \brief dtor
         ~IoControllerUpdateThread();
@@ -33,6 +41,56 @@ class IoControllerUpdateThread : public QThread
         //! \brief The starting point for the thread
         void run();
 
+        //! \brief Set the options used for the next update
+        void setOptions(const FlashOptions_t &a_Options);
+
+        //! \brief Use a port kept open by the session instead of opening the target port.
+        //! Its line settings are changed in place and it is left open.
+        void setSerialPort(QextSerialPort *a_pPort);
+
+        //! \brief The IO Controller updated by this instance
+        const FlashTarget_t &target(void) const { return m_Target; }
+
+        //! \brief Number of image bytes written to flash by the last update
+        qint64 bytesProgrammed(void) const { return m_BytesProgrammed; }
+
+        //! \brief Number of write transactions retried by the last update
+        qint32 blockRetries(void) const;
+
+        //! \brief Number of times the last update restarted the bootloader session
+        qint32 sessionRestarts(void) const { return m_SessionRestarts; }
+
+        //! \brief Time from the last reset release until the bootloader answered, -1 if it never did
+        qint64 bootReadyMs(void) const { return m_BootReadyMs; }
+
+        //! \brief Duration of the last update, from start until the IO Controller was restarted
+        qint64 elapsedMs(void) const { return m_SessionTimer.elapsed(); }
+
+        //! \brief Phase timing and block latency of the last update
+        const FlashStats &stats(void) const { return m_Stats; }
+
+        //! \brief Deadlines learned for this target, including the last update
+        const FlashTiming &timing(void) const { return m_Timing; }
+
+        //! \brief Product ID returned by the bootloader in the last update, 0 if not identified
+        quint16 chipId(void) const { return m_ChipId; }
+
+        //! \brief Content hash of the image of the last update
+        const QByteArray &imageHash(void) const { return m_ImageHash; }
+
+        //! \brief Memory read by the last dump, and its first address
+        const QByteArray &dumpData(void) const { return m_DumpData; }
+        quint32 dumpAddress(void) const { return m_DumpAddress; }
+
+        //! \brief Time the last dump spent reading, from its first read memory command to its last byte
+        qint64 dumpMs(void) const { return m_DumpMs; }
+
+        //! \brief Time from GO until the application answered in the last update, -1 if it was started by reset
+        qint64 appReadyMs(void) const { return m_AppReadyMs; }
+
+        //! \brief Bootloader UART line rate, bytes per second at 115200 baud 8E1
+        static const qint32 BOOT_LINE_RATE = 115200 / 11;
+
         //! \brief IO Controller bootloader ACK signal def
         static const quint8 BOOT_ACK = 0x79;
 
@@ -46,13 +104,17 @@ class IoControllerUpdateThread : public QThread
         Q_ENUM(BootCMD_t)
 
         //! \brief The update state machine states
-        enum BootStatus_t {eBootInit = 0x00, eBootEnter, eBootGetCommands, eBootEraseCMD, eBootEraseData,
+        enum BootStatus_t {eBootInit = 0x00, eBootEnter, eBootGetCommands, eBootGetID, eBootIdentify, eBootResync, eBootResume, eBootEraseCMD, eBootEraseData,
                            eBootFlashCMD, eBootFlashAddr, eBootFlashData,
-                           eBootExit};
+                           eBootReadCMD, eBootReadAddr, eBootReadLen, eBootReadData,
+                           eBootVerifyCMD, eBootVerifyAddr, eBootVerifyLen, eBootVerifyData,
+                           eBootDumpCMD, eBootDumpAddr, eBootDumpLen, eBootDumpData,
+                           eBootExit, eBootGoAddr, eBootGoStarted};
         Q_ENUM(BootStatus_t)
 
         //! \brief Error states
-        enum Error_t {eNoError = 0x00, eErrorSimFile, eErrorSimFileBadRecord, eErrorSimFileChSum, eErrorFlashFailed};
+        enum Error_t {eNoError = 0x00, eErrorSimFile, eErrorSimFileBadRecord, eErrorSimFileChSum, eErrorFlashFailed, eErrorVerifyFailed,
+                      eErrorImageRange};
         Q_ENUM(Error_t)
 
         //! \brief Receive status for the IO Controller communication
@@ -76,6 +138,10 @@ class IoControllerUpdateThread : public QThread
         //! \param a_bytesToSend - byte array with data
         void sendData(QByteArray a_bytesToSend);
 
+        //! \brief Send the read memory length byte and its complement
+        //! \param a_Length - number of bytes to read (1-256)
+        void sendReadLength(quint16 a_Length);
+
         //! \brief Get IO Controller in boot strap mode
         void enterBoot(void);
 
@@ -85,29 +151,149 @@ class IoControllerUpdateThread : public QThread
         //! \brief Terminate IO Controller update. Will start user program
         void terminateBoot(void);
 
-        //! \brief Convert binary sim file data to a format thet will fit the IO Controller bootloader
-        //! \param a_SimFileData - byte array from a binary file read
-        bool SimpleCodeProcessFile(QByteArray a_FileData);
+        //! \brief GO acknowledged: release the boot pin and ask the application for its version
+        void startApplication(void);
+
+        //! \brief Vector table of the image to start with GO, 0 if the image does not begin with a valid one
+        quint32 goAddress(void) const;
+
+        //! \brief Set the boot pins and pulse reset without blocking the event loop
+        //! \param a_BootMode - boot mode the IO Controller restarts in
+        //! \param a_pStarted - called when reset is released
+        void restartIOcontroller(IOCtrlBootMode_t a_BootMode, void (IoControllerUpdateThread::*a_pStarted)(void));
+
+        //! \brief Reset released by enterBoot, start probing for the bootloader
+        void bootStarted(void);
+
+        //! \brief The bootloader answered a probe, stop probing and record the latency
+        void bootReady(void);
+
+        //! \brief Reset released by exitBoot, close the port and report the result
+        void finishUpdate(void);
+
+        //! \brief Convert image file data (.sim, Intel HEX, S-record or raw binary) to a format thet will fit the IO Controller bootloader
+        //! \param a_FileData - byte array from a binary file read
+        bool SimpleCodeProcessFile(const QByteArray &a_FileData);
+
+        //! \brief Load the flash plan for an image from the plan cache, or build and cache it.
+        //! Runs on a worker thread while the bootloader session starts, it only touches the plan:
+        //! m_Image, m_FlashData, m_ErasePages, m_ImageHash, m_PlanCache and m_PlanError.
+        //! \param a_FileData - image file content
+        bool loadFlashPlan(const QByteArray &a_FileData);
+
+        //! \brief Parameters the flash plan is built for
+        FlashPlanLayout_t planLayout(void) const;
+
+        //! \brief Image format name for logging
+        static const char *formatName(FlashImage::Format_t a_Format);
+
+        //! \brief Big endian address bytes as sent to the bootloader (checksum not included)
+        static QByteArray addressBytes(quint32 a_Address);
+
+        //! \brief Collect the flash sectors of m_Geometry covered by the image into m_ErasePages
+        void buildErasePageList(void);
+
+        //! \brief Drop blocks that are all 0xff and trim trailing 0xff from the rest.
+        //! Must run after buildErasePageList, the pages of skipped blocks still need erasing.
+        void skipErasedBlocks(QVector<FlashBlock_t> *a_pBlocks);
+
+        //! \brief Write the --patch bytes over the loaded plan. Only the blocks of patched windows
+        //! are rebuilt, the erase list only when a patch is outside the image data.
+        //! m_ImageHash becomes the hash of the patched image.
+        void applyPatches(void);
+
+        //! \brief The expected content of a flash page after programming m_FlashData
+        //! \param a_Page - page number
+        QByteArray expectedPageData(quint16 a_Page);
+
+        //! \brief Compare the last read back chunk with the image and step to the next chunk to read
+        //! \return false when all pages in m_ErasePages have been read
+        bool deltaCompareChunk(void);
+
+        //! \brief Reduce m_ErasePages and m_FlashData to the pages that differ from the image
+        void finishDelta(void);
 
-        //! \brief Read a single byte (uint8) from the sim file byte array
-        //! \param a_SimFile - byte array from a binary file read
-        //! \param a_pCurrIdx - reference to the current read index
-        quint8 SimFileReadByte(QByteArray a_SimFile, qint32 *a_pCurrIdx);
+        //! \brief Check read back data against the block being verified, straight from the receive buffer
+        //! \param a_Data - read back data
+        //! \param a_Length - number of bytes in a_Data
+        void verifyChunk(const char *a_Data, qint32 a_Length);
 
-        //! \brief Read up to a uint32 from the sim file byte array. Will convert bytes written to correct size
-        //! \param a_SimFile - byte array from a binary file read
-        //! \param a_pCurrIdx - reference to the current read index
-        //! \param a_Size - number of bytes to read and convert
-        quint32 SimFileReadUint(QByteArray a_SimFile, qint32 *a_pCurrIdx, qint16 a_Size);
+        //! \brief Check the CRC of the block just read back and step to the next block
+        //! \return false when verification is finished (all blocks read or a mismatch found)
+        bool verifyNextBlock(void);
+
+        //! \brief Retry the write transaction that was NACKed or timed out, resynchronising first after a timeout
+        //! \return false if the failure was not in a block write, or the block has been retried too often
+        bool retryBlock(void);
+
+        //! \brief Send one fill byte, repeated until the bootloader NACKs and waits for a command again
+        void sendResyncByte(void);
+
+        //! \brief Prepare verification of blocks a_First up to (not including) a_End in m_FlashData
+        void startVerify(qint32 a_First, qint32 a_End);
+
+        //! \brief Journal file of this target
+        QString journalPath(void) const;
+
+        //! \brief Record a block acknowledged by the IO Controller in the journal
+        void journalBlockAcked(qint32 a_Block_idx);
+
+        //! \brief Index in m_FlashData of the first block not acknowledged according to the journal
+        qint32 firstUnackedBlock(void) const;
+
+        //! \brief Reduce m_ErasePages and set m_FlashStart_idx to continue from the journal, and pick the next state
+        //! \return false if the update can not be resumed
+        bool applyResume(void);
+
+        //! \brief Resume if the last acknowledged block read back as expected, else start over
+        void finishResumeCheck(void);
+
+        //! \brief Build the erase command payload for the pages in m_ErasePages
+        //! \param a_Extended - true for the extended erase command (two byte page numbers)
+        //! \param a_pTimeoutMs - max time the erase may take
+        //! \param a_pBytes - size of the sectors erased one by one, 0 for a mass or bank erase
+        QByteArray buildEraseData(bool a_Extended, qint32 *a_pTimeoutMs, quint32 *a_pBytes);
+
+        //! \brief Extended erase code erasing exactly erasePages() in one go (mass or bank erase), 0 if none does
+        quint16 specialEraseCode(void) const;
+
+        //! \brief Max time to erase the pages in erasePages() one by one
+        qint32 pageEraseTimeoutMs(void) const;
+
+        //! \brief Pages the next erase command erases: the page of a block being retried, else m_ErasePages
+        const QList<quint16> &erasePages(void) const;
+
+        //! \brief Set the dump range from the options and the identified chip, a restarted session keeps it
+        //! \return false if the range can not be read
+        bool startDump(void);
+
+        //! \brief Take the bootloader version and commands, or the product ID, from a complete responce
+        void bootInfoReceived(void);
+
+        //! \brief Switch to the geometry of the identified chip and check the image fits its flash
+        //! \return false if the image is outside the flash of the chip
+        bool identifyChip(void);
+
+        //! \brief Flash sector holding a_Address
+        quint16 pageOf(quint32 a_Address) const { return static_cast<quint16>(m_Geometry.sectorAt(a_Address)); }
 
         bool configureSerial(QString a_SerialPort, BaudRateType a_BaudRate);
 
+        //! \brief The IO Controller to update
+        FlashTarget_t m_Target;
+
         //! \brief Serialport object used to communicate with IO Controller
         QextSerialPort *m_SerialPort;
 
+        //! \brief m_SerialPort belongs to the session, it is not opened, closed or deleted here
+        bool m_SharedPort;
+
         //! \brief Recieve status for the communication with IO Controller
         ReceiveStatus_t m_ReceiveStatus;
 
+        //! \brief Bytes left of a variable length responce, 0xffff while its length byte is expected
+        qint32 m_ResponceBytesLeft;
+
         //! \brief IO Controller bootloader current command set
         QList<quint8> m_IOcontrBootloaderCommandSet;
 
@@ -119,21 +305,176 @@ class IoControllerUpdateThread : public QThread
 
         qint8 m_RetryCounter;
 
+        //! \brief Timer repeating the autobaud probe until the bootloader answers
+        QTimer *m_BootProbeTimer;
+
+        //! \brief Probes sent since the last reset
+        qint32 m_BootProbes;
+
+        //! \brief Time since the last reset was released
+        QElapsedTimer m_BootReadyTimer;
+
+        //! \brief Time from reset release until the bootloader answered, -1 if it never did
+        qint64 m_BootReadyMs;
+
+        //! \brief Number of bootloader session restarts in this update
+        qint32 m_SessionRestarts;
+
+        //! \brief Retries per block address in this update
+        QMap<quint32, qint32> m_BlockRetryCounts;
+
+        //! \brief Fill bytes sent while resynchronising
+        qint32 m_ResyncBytes;
+
+        //! \brief State to continue in once resynchronised
+        BootStatus_t m_ResyncNext;
+
         //! \brief The update state machine current state
         BootStatus_t m_IOcontrUpdateStatus;
 
-        //! \brief Flashdata ready for transmit to IO Controller
-        QList<FlashData_t *> m_FlashData;
+        //! \brief The parsed image
+        FlashImage m_Image;
+
+        //! \brief Cache of flash plans, owns the mapping m_Image may point into
+        FlashPlanCache m_PlanCache;
+
+        //! \brief Flashdata ready for transmit to IO Controller, views into m_Image
+        QVector<FlashBlock_t> m_FlashData;
 
         //! \brief Flashdata curr index ready for transmit to IO Controller
         qint32 m_FlashData_idx;
 
-        //! \brief Checksum used to validate the binary sim file data
-        quint32 m_checksum;
+        //! \brief Index in m_FlashData programming starts at, past the blocks already programmed when resuming
+        qint32 m_FlashStart_idx;
+
+        //! \brief Content hash of the image file
+        QByteArray m_ImageHash;
+
+        //! \brief Erased pages and acknowledged blocks of the current image on this target
+        FlashJournal m_Journal;
+
+        //! \brief True once this process has written blocks, resuming needs no read back check
+        bool m_JournalTrusted;
+
+        //! \brief Erase command sent, pages are recorded in the journal when acknowledged
+        bool m_JournalErasePending;
+
+        //! \brief Data of block m_FlashData_idx - 1 sent, not yet acknowledged
+        bool m_WritePending;
+
+        //! \brief Verifying the last acknowledged block before resuming
+        bool m_ResumeCheck;
+
+        //! \brief Sorted list of flash pages touched by m_FlashData, erased before programming
+        QList<quint16> m_ErasePages;
+
+        //! \brief Page erased again to retry a block, the plan in m_ErasePages stays for session restarts
+        QList<quint16> m_RetryErasePages;
+
+        //! \brief Flash layout of the chip being updated, the default chip until it is identified
+        FlashGeometry m_Geometry;
+
+        //! \brief Product ID from Get ID, 0 if not asked
+        quint16 m_ChipId;
+
+        //! \brief Bootloader version from Get, major version in the high nibble
+        quint8 m_BootloaderVersion;
+
+        //! \brief Options for the current update
+        FlashOptions_t m_Options;
+
+        //! \brief Data received from the last read memory command
+        QByteArray m_ReadBuffer;
+
+        //! \brief Number of bytes still expected from the pending read memory command
+        qint32 m_ReadBytesLeft;
+
+        //! \brief Delta mode: index in m_ErasePages of the page being read back
+        qint32 m_DeltaPage_idx;
+
+        //! \brief Delta mode: offset in the current page of the chunk being read back
+        quint32 m_DeltaPageOffset;
+
+        //! \brief Delta mode: expected content of the page being read back
+        QByteArray m_DeltaExpected;
+
+        //! \brief Delta mode: pages that differ from the image
+        QList<quint16> m_DeltaDirtyPages;
+
+        //! \brief Dump: started by beginDump, no image is flashed
+        bool m_Dumping;
+
+        //! \brief Dump: first address and number of bytes to read
+        quint32 m_DumpAddress;
+        quint32 m_DumpLength;
+
+        //! \brief Dump: chunks read so far
+        QByteArray m_DumpData;
+
+        //! \brief Dump: time since the first read memory command, invalid until the range is set
+        QElapsedTimer m_DumpTimer;
+        qint64 m_DumpMs;
+
+        //! \brief Verify: index in m_FlashData of the block being read back
+        qint32 m_Verify_idx;
+
+        //! \brief Verify: index in m_FlashData verification stops at
+        qint32 m_VerifyEnd_idx;
+
+        //! \brief Verify: number of bytes of the current block checked so far
+        qint32 m_VerifyOffset;
+
+        //! \brief Verify: running CRC of the read back data and of the image for the current block
+        quint16 m_VerifyCrcFlash;
+        quint16 m_VerifyCrcImage;
+
+        //! \brief Verify: address of the first byte differing from the image, 0 if none
+        quint32 m_VerifyMismatchAddr;
+
+        //! \brief Verify: total bytes read back
+        qint64 m_VerifyBytes;
+
+        //! \brief Verify: time spent verifying
+        QElapsedTimer m_VerifyTimer;
+
+        //! \brief Image bytes written by the current update
+        qint64 m_BytesProgrammed;
+
+        //! \brief Image bytes the current update programs, m_BytesProgrammed counts up to it
+        qint64 m_ProgramTotal;
+
+        //! \brief Image bytes read back by the running verification, m_VerifyBytes counts up to it
+        qint64 m_VerifyTotal;
+
+        //! \brief Time since the update was started
+        QElapsedTimer m_SessionTimer;
+
+        FlashStats m_Stats;
 
         //! \brief Error
         Error_t m_error;
 
+        //! \brief Flash plan being built on a worker thread
+        QFutureWatcher<bool> m_PlanWatcher;
+
+        //! \brief Error of the flash plan, set by the worker thread
+        Error_t m_PlanError;
+
+        //! \brief Flash plan built and its journal opened
+        bool m_PlanReady;
+
+        //! \brief Time in m_Stats the image arrived, the parse phase overlaps boot entry
+        qint64 m_PlanStartNs;
+
+        //! \brief Version request to the application started by GO, nullptr if none is running
+        IoControllerCommThread *m_pAppCheck;
+
+        //! \brief Time since GO was acknowledged
+        QElapsedTimer m_GoTimer;
+
+        //! \brief Time from GO until the application answered, -1 if it was started by reset
+        qint64 m_AppReadyMs;
+
         //! \brief IOController MCU boot 0 GPIO Pin
         Gpio m_iocGPIOmcuBoot0;
 
@@ -146,25 +487,140 @@ class IoControllerUpdateThread : public QThread
         //! \brief No of databytes for each write of IO Controller flash (max 256)
         static const quint16 FLASH_MEM_WR_BLOCK_SIZE = 256; //Bytes
 
+        //! \brief Max databytes of one read memory command
+        static const quint16 READ_MEM_MAX_SIZE = 256; //Bytes
+
+        //! \brief Write length must be a multiple of this, blocks are padded with 0xff when sent
+        static const quint16 FLASH_MEM_WR_ALIGN = 4; //Bytes
+
+        //! \brief Start of IO Controller flash, page 0
+        static const quint32 FLASH_BASE_ADDRESS = FlashGeometry::FLASH_BASE_ADDRESS;
+
+        //! \brief Start of IO Controller SRAM, the initial stack pointer of an application points into it
+        static const quint32 SRAM_BASE_ADDRESS = 0x20000000u;
+
+        //! \brief Extended erase special codes
+        static const quint16 MASS_ERASE_CODE = 0xffff;
+        static const quint16 BANK1_ERASE_CODE = 0xfffe;
+        static const quint16 BANK2_ERASE_CODE = 0xfffd;
+
+        //! \brief Max retries of a single block before the session is restarted
+        static const qint32 BLOCK_RETRY_MAX = 3;
+
+        //! \brief Time to wait for a NACK after each resync fill byte
+        static const qint32 RESYNC_BYTE_TIMEOUT = 10; //ms
+
+        //! \brief Max resync fill bytes, enough to complete a full write data frame
+        static const qint32 RESYNC_MAX_BYTES = FLASH_MEM_WR_BLOCK_SIZE + 8;
+
+        //! \brief Boot pin setup time before and length of the reset pulse
+        static const qint32 BOOT_RESET_PULSE_TIME = 5; //ms
+
+        //! \brief Time from restartIOcontroller until reset is released
+        static const qint32 BOOT_RESTART_TIME = 2 * BOOT_RESET_PULSE_TIME; //ms
+
+        //! \brief Interval of the autobaud probes after reset
+        static const qint32 BOOT_PROBE_INTERVAL = 10; //ms
+
+        //! \brief Max time for the bootloader to answer the autobaud probes after reset
+        static const qint32 BOOT_PROBE_DEADLINE = 1000; //ms
+
+        //! \brief Version requests to the application started by GO, and their interval
+        static const qint32 APP_POLL_COUNT = 10;
+        static const qint32 APP_POLL_INTERVAL = 50; //ms
+
+        //! \brief Bytes answering Get and Get ID, for their deadlines
+        static const qint32 GET_REPLY_SIZE = 16;
+        static const qint32 GET_ID_REPLY_SIZE = 5;
+
+        //! \brief Reply the armed deadline waits for, its round trip is learned in m_Timing
+        enum Await_t {eAwaitNone = 0x00, eAwaitCommand, eAwaitWrite, eAwaitErase};
+
+        //! \brief Run one step of the update, see IOcontrUpdateProc
+        void updateStep(void);
+
+        //! \brief Run the next step once the current one returns, no frame is waited for
+        void continueNow(void);
+
+        //! \brief A frame was sent, its answer runs the next step. The deadline is learned from earlier
+        //! round trips of the same kind, the step times out without an answer.
+        //! \param a_ReplyBytes - bytes of the answer, ACK included
+        void awaitReply(Await_t a_Await, qint32 a_ReplyBytes = 1);
+
+        //! \brief An erase frame was sent, wait for its ACK
+        //! \param a_Bytes - size of the sectors erased one by one, 0 for a mass or bank erase
+        //! \param a_MaxMs - datasheet time of the erase
+        void awaitErase(quint32 a_Bytes, qint32 a_MaxMs);
+
+        //! \brief Run the next step in a_TimeoutMs unless an answer comes first, nothing is learned
+        void awaitDeadline(qint32 a_TimeoutMs);
+
+        //! \brief The awaited reply came, learn its round trip
+        void replyReceived(void);
+
+        //! \brief The awaited reply did not come, widen the deadlines of its kind
+        void replyTimedOut(void);
+
+        //! \brief Learned deadlines of this target
+        FlashTiming m_Timing;
+
+        //! \brief Reply waited for, the bytes of its round trip and when its frame was sent
+        Await_t m_Await;
+        qint32 m_AwaitBytes;
+        quint32 m_AwaitEraseBytes;
+        qint64 m_AwaitStartNs;
+
+        //! \brief Bytes of the last frame sent
+        qint32 m_TxBytes;
+
+        //! \brief IOcontrUpdateProc is running a step
+        bool m_InStep;
+
+        //! \brief The running step asked for the next one
+        bool m_ContinueNow;
+
         void setBootMode(IOCtrlBootMode_t a_BootMode);
 
         void ioControllerReset(bool a_Reset);
 
 private slots:
-        //! \brief Start update
-        void updateIOcontroller(QString a_SerialPort, QByteArray a_SimFileData);
+        //! \brief Start update: open the port and reset the IO Controller into its bootloader.
+        //! The image follows by updateIOcontroller, programming starts when both are ready.
+        void beginUpdate(void);
+
+        //! \brief Start a dump: reset the IO Controller into its bootloader and read the --dump range
+        //! of memory instead of flashing an image. Reported by updateFinished, see dumpData.
+        void beginDump(void);
+
+        //! \brief Build the flash plan for the image on a worker thread
+        void updateIOcontroller(QByteArray a_SimFileData);
+
+        //! \brief The flash plan is built, continue the session if it waits for it
+        void planLoaded(void);
 
         //! \brief Received data event from serial port object
         void receivedData(void);
 
-        //! \brief State machine for updating IO Processor
+        //! \brief State machine for updating IO Processor. Runs steps until one waits for the bootloader,
+        //! called by receivedData when it answers and by the timer when a deadline passes.
         void IOcontrUpdateProc(void);
 
+        //! \brief Send an autobaud probe, stops probing once the deadline is passed
+        void sendBootProbe(void);
+
+        //! \brief Version reported by the application started by GO, all zero if it did not answer
+        void appStarted(SWversion_t a_version);
+
     signals:
         //! \brief For signal parent that we are finished updating
         //! \param Result - false if failed, true if succeed
         void updateFinished(bool);
 
+        //! \brief A block was programmed or verified, or a dump chunk read
+        //! \param a_Phase - ePhaseProgram, ePhaseVerify or ePhaseReadBack
+        //! \param a_Done, a_Total - image bytes done and to do in the phase
+        void progress(FlashStats::Phase_t a_Phase, qint64 a_Done, qint64 a_Total);
+
 };
 
 #endif // IOCtrlCommController_H
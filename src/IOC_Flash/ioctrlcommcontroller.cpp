@@ -1,26 +1,106 @@
 #include "ioctrlcommcontroller.h"
+#include "flashinstalled.h"
+#include <QCryptographicHash>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <QtConcurrent>
 #include <QLoggingCategory>
 Q_LOGGING_CATEGORY(DBG_IOCFLASH_COMMCONTROLEER,"IOCFlash.CommController", QtInfoMsg)
 
 
-IOCtrlCommController::IOCtrlCommController(QString a_Port, QString a_filepathName, QString a_command)
+IOCtrlCommController::IOCtrlCommController(QString a_Port, QString a_filepathName, QStringList a_Commands, const FlashOptions_t &a_Options)
 {
     m_COMport = a_Port;
     m_IOprocInUpdateMode = false;
     m_Filename = a_filepathName;
-    m_Command = a_command;
+    m_Commands = a_Commands;
+    m_CommandIdx = 0;
+    m_ExitStatus = 0;
+    m_SerialPort = nullptr;
+    m_Options = a_Options;
+    m_UpdatesStarted = 0;
+    m_UpdatesPending = 0;
+    m_UpdatesFailed = 0;
+    m_BytesProgrammed = 0;
+    m_LoadMs = 0;
+    m_ImageLoaded = false;
+    m_ChecksPending = 0;
+    m_UpdatesUnchanged = 0;
+    m_pProgress = nullptr;
+    if(m_Options.m_progressFd >= 0)
+    {
+        m_pProgress = new FlashProgress(m_Options.m_progressFd, this);
+    }
+    connect(&m_LoadWatcher, SIGNAL(finished()), this, SLOT(imageLoaded()));
     QTimer::singleShot(1, this, SLOT(onInit()));
 
 }
 
 IOCtrlCommController::~IOCtrlCommController()
 {
-
+    delete m_SerialPort;
 }
 
 void IOCtrlCommController::onInit()
 {
-    onCommand(m_Command);
+    m_SessionTimer.start();
+    onCommand(m_Commands.value(0));
+}
+
+void IOCtrlCommController::runNextCommand()
+{
+    onCommand(m_Commands.at(m_CommandIdx));
+}
+
+void IOCtrlCommController::commandFinished(int a_Status)
+{
+    //A failure outweighs a skipped update
+    if(m_ExitStatus == 0 || a_Status == EXIT_FAILURE)
+    {
+        m_ExitStatus = a_Status;
+    }
+
+    m_CommandIdx++;
+    if(m_CommandIdx < m_Commands.count())
+    {
+        //Called from the signal of a thread being deleted, continue from the event loop
+        QMetaObject::invokeMethod(this, "runNextCommand", Qt::QueuedConnection);
+        return;
+    }
+
+    if(m_Commands.count() > 1)
+    {
+        qCInfo(DBG_IOCFLASH_COMMCONTROLEER, "Versions %s, %lld ms total",
+               qPrintable(m_Versions.join(" -> ")), m_SessionTimer.elapsed());
+    }
+    exit(m_ExitStatus);
+}
+
+QextSerialPort *IOCtrlCommController::sharedPort(const QString &a_Port)
+{
+    //Only worth it when several commands talk to the same IO Controller
+    if(m_Commands.count() < 2 || a_Port != m_COMport)
+    {
+        return nullptr;
+    }
+
+    if(!m_SerialPort)
+    {
+        m_SerialPort = new QextSerialPort(m_COMport, QextSerialPort::EventDriven);
+        //Not the QextSerialPort defaults, the UART has no RTS/CTS. Baud rate and parity are set per protocol.
+        m_SerialPort->setFlowControl(FLOW_OFF);
+        m_SerialPort->setDataBits(DATA_8);
+        m_SerialPort->setStopBits(STOP_1);
+        if(!m_SerialPort->open(QIODevice::ReadWrite))
+        {
+            qCWarning(DBG_IOCFLASH_COMMCONTROLEER) << "Unable to open serial port:" << qPrintable(m_SerialPort->errorString());
+            delete m_SerialPort;
+            m_SerialPort = nullptr;
+        }
+    }
+    return m_SerialPort;
 }
 
 
@@ -28,21 +108,84 @@ void IOCtrlCommController::onCommand(QString a_command)
 {
     if(a_command == "Update")
     {
-        m_ioControllerUpdateThread = new IoControllerUpdateThread();
-        connect(this, SIGNAL(flashIOprocessor(QString, QByteArray)), m_ioControllerUpdateThread, SLOT(updateIOcontroller(QString, QByteArray)));
-        connect(m_ioControllerUpdateThread, SIGNAL(updateFinished(bool)), this, SLOT(updateFinished(bool)));
-        m_ioControllerUpdateThread->start();
+        QList<FlashTarget_t> targets = m_Options.m_targets;
+        if(targets.isEmpty())
+        {
+            FlashTarget_t target;
+            target.m_port = m_COMport;
+            targets.append(target);
+        }
+
+        //A bad path must fail before any target is reset into its bootloader
+        QFileInfo image(m_Filename);
+        if(!image.isFile() || !image.isReadable())
+        {
+            qCWarning(DBG_IOCFLASH_COMMCONTROLEER, "Unable to read %s, no target updated", qPrintable(m_Filename));
+            commandFinished(EXIT_FAILURE);
+            return;
+        }
 
-        QByteArray simFileData = getSimFile(m_Filename);
-        updateIOprocessor(simFileData);
+        //The image is read on a worker thread while the targets reset into their bootloaders
+        m_UpdateTimer.start();
+        m_LoadWatcher.setFuture(QtConcurrent::run([this]()
+        {
+            QElapsedTimer loadTimer;
+            loadTimer.start();
+            QByteArray simFileData = getSimFile(m_Filename);
+            if(m_Options.m_ifChanged)
+            {
+                m_ImageHash = FlashPlanCache::contentHash(FlashPlanCache::contentHash(simFileData), m_Options.m_patches);
+            }
+            m_LoadMs = loadTimer.elapsed();
+            return simFileData;
+        }));
+
+        if(m_Options.m_ifChanged)
+        {
+            checkTargets(targets);
+        }
+        else
+        {
+            startUpdates(targets);
+        }
     }
     else if(a_command == "GetVersion")
     {
         m_ioControllerCommThread = new IoControllerCommThread();
+        if(QextSerialPort *port = sharedPort(m_COMport))
+        {
+            m_ioControllerCommThread->setSerialPort(port);
+        }
+        //An update earlier in the session may have learned more
+        m_Timing.load(m_Options.m_cacheDir, m_COMport);
+        m_ioControllerCommThread->setDeadline(&m_Timing.deadline(FlashTiming::eApp));
         connect(this, SIGNAL(getVerIOprocessor(QString)), m_ioControllerCommThread, SLOT(getVerIOprocessor(QString)));
         connect(m_ioControllerCommThread, SIGNAL(reportVersion(SWversion_t)), this, SLOT(reportVersion(SWversion_t)));
         getVersionIOprocessor();
     }
+    else if(a_command == "Dump")
+    {
+        //The first target, the --com-port controller if none is given
+        FlashTarget_t target;
+        target.m_port = m_COMport;
+        if(!m_Options.m_targets.isEmpty())
+        {
+            target = m_Options.m_targets.first();
+        }
+
+        IoControllerUpdateThread *dumpThread = new IoControllerUpdateThread(target);
+        dumpThread->setOptions(m_Options);
+        if(QextSerialPort *port = sharedPort(target.m_port))
+        {
+            dumpThread->setSerialPort(port);
+        }
+        connect(dumpThread, SIGNAL(updateFinished(bool)), this, SLOT(dumpFinished(bool)));
+        if(m_pProgress)
+        {
+            m_pProgress->track(dumpThread);
+        }
+        QMetaObject::invokeMethod(dumpThread, "beginDump", Qt::QueuedConnection);
+    }
 
     else
     {
@@ -50,6 +193,108 @@ void IOCtrlCommController::onCommand(QString a_command)
     }
 }
 
+void IOCtrlCommController::startUpdates(const QList<FlashTarget_t> &a_Targets)
+{
+    //All targets are driven from this event loop, each by its own bootloader session
+    for(const FlashTarget_t &target : a_Targets)
+    {
+        IoControllerUpdateThread *updateThread = new IoControllerUpdateThread(target);
+        updateThread->setOptions(m_Options);
+        if(QextSerialPort *port = sharedPort(target.m_port))
+        {
+            updateThread->setSerialPort(port);
+        }
+        connect(this, SIGNAL(startIOprocessor()), updateThread, SLOT(beginUpdate()));
+        connect(this, SIGNAL(flashIOprocessor(QByteArray)), updateThread, SLOT(updateIOcontroller(QByteArray)));
+        connect(updateThread, SIGNAL(updateFinished(bool)), this, SLOT(updateFinished(bool)));
+        if(m_pProgress)
+        {
+            m_pProgress->track(updateThread);
+        }
+        updateThread->start();
+        m_ioControllerUpdateThreads.append(updateThread);
+    }
+    m_UpdatesStarted = m_ioControllerUpdateThreads.count();
+    m_UpdatesPending = m_UpdatesStarted;
+
+    emit startIOprocessor();
+}
+
+void IOCtrlCommController::checkTargets(const QList<FlashTarget_t> &a_Targets)
+{
+    //The running firmware is asked with the app protocol, nothing is reset before the answers are in
+    for(const FlashTarget_t &target : a_Targets)
+    {
+        IoControllerCommThread *commThread = new IoControllerCommThread();
+        if(QextSerialPort *port = sharedPort(target.m_port))
+        {
+            commThread->setSerialPort(port);
+        }
+        connect(commThread, SIGNAL(reportVersion(SWversion_t)), this, SLOT(targetVersion(SWversion_t)));
+        m_VersionChecks.insert(commThread, target);
+        QMetaObject::invokeMethod(commThread, "getVerIOprocessor", Qt::QueuedConnection, Q_ARG(QString, target.m_port));
+    }
+    m_ChecksPending = m_VersionChecks.count();
+}
+
+void IOCtrlCommController::targetVersion(SWversion_t a_version)
+{
+    IoControllerCommThread *commThread = qobject_cast<IoControllerCommThread *>(sender());
+    QString version;
+
+    if(a_version.m_verMaj != 0 ||
+       a_version.m_verMin != 0 ||
+       a_version.m_verMaint != 0 ||
+       a_version.m_verBuild != 0)
+    {
+        version.sprintf("%u.%u.%u.%u",
+                        a_version.m_verMaj,
+                        a_version.m_verMin,
+                        a_version.m_verMaint,
+                        a_version.m_verBuild);
+    }
+
+    m_RunningVersions.append(qMakePair(m_VersionChecks.take(commThread), version));
+    commThread->wait();
+    commThread->deleteLater();
+
+    m_ChecksPending--;
+    if(m_ChecksPending == 0 && m_ImageLoaded)
+    {
+        updateChangedTargets();
+    }
+}
+
+void IOCtrlCommController::updateChangedTargets(void)
+{
+    QList<FlashTarget_t> changed;
+
+    for(const QPair<FlashTarget_t, QString> &running : m_RunningVersions)
+    {
+        //No answer: the firmware is broken, or does not run at all
+        if(!running.second.isEmpty() &&
+           FlashInstalled(m_Options.m_stateDir, running.first.m_port).matches(m_ImageHash, running.second))
+        {
+            qCInfo(DBG_IOCFLASH_COMMCONTROLEER, "%s: running %s flashed from this image, skipped",
+                   qPrintable(running.first.m_port), qPrintable(running.second));
+            m_UpdatesUnchanged++;
+        }
+        else
+        {
+            changed.append(running.first);
+        }
+    }
+
+    if(changed.isEmpty())
+    {
+        updateFinished(true);
+        return;
+    }
+
+    startUpdates(changed);
+    updateIOprocessor(m_LoadWatcher.result());
+}
+
 void IOCtrlCommController::updateIOprocessor(QByteArray a_SimFileData)
 {
 
@@ -63,14 +308,25 @@ void IOCtrlCommController::updateIOprocessor(QByteArray a_SimFileData)
 
     if(a_SimFileData.length() == 0)
     {
+        //The targets are in their bootloaders already, they fail the update and restart
         qCWarning(DBG_IOCFLASH_COMMCONTROLEER, "No simfile found");
-        updateFinished(false);
     }
-    else
+    emit flashIOprocessor(a_SimFileData);
+
+}
+
+void IOCtrlCommController::imageLoaded(void)
+{
+    m_ImageLoaded = true;
+
+    if(!m_Options.m_ifChanged)
     {
-        emit flashIOprocessor(m_COMport, a_SimFileData);
+        updateIOprocessor(m_LoadWatcher.result());
+    }
+    else if(m_ChecksPending == 0)
+    {
+        updateChangedTargets();
     }
-
 }
 
 void IOCtrlCommController::getVersionIOprocessor(void)
@@ -80,28 +336,201 @@ void IOCtrlCommController::getVersionIOprocessor(void)
 
 void IOCtrlCommController::updateFinished(bool a_result)
 {
-    m_ioControllerUpdateThread->wait();
-    delete m_ioControllerUpdateThread;
+    IoControllerUpdateThread *updateThread = qobject_cast<IoControllerUpdateThread *>(sender());
+
+    if(updateThread)
+    {
+        if(a_result)
+        {
+            qCInfo(DBG_IOCFLASH_COMMCONTROLEER, "%s: updated, %lld bytes in %lld ms, %d block retries, %d session restarts",
+                   qPrintable(updateThread->target().m_port), updateThread->bytesProgrammed(), updateThread->elapsedMs(),
+                   updateThread->blockRetries(), updateThread->sessionRestarts());
+        }
+        else
+        {
+            qCWarning(DBG_IOCFLASH_COMMCONTROLEER, "%s: update failed, %d block retries, %d session restarts",
+                      qPrintable(updateThread->target().m_port), updateThread->blockRetries(), updateThread->sessionRestarts());
+            m_UpdatesFailed++;
+        }
+        m_BytesProgrammed += updateThread->bytesProgrammed();
+        m_UpdatesPending--;
+        if(m_pProgress)
+        {
+            m_pProgress->finished(updateThread, a_result);
+        }
+
+        //A failed update may have left anything in flash
+        FlashInstalled installed(m_Options.m_stateDir, updateThread->target().m_port);
+        if(a_result)
+        {
+            installed.recordImage(updateThread->imageHash());
+        }
+        else
+        {
+            installed.remove();
+        }
+
+        if(!m_Options.m_statsJson.isEmpty())
+        {
+            QJsonObject stats = updateThread->stats().toJson();
+            stats["port"] = updateThread->target().m_port;
+            stats["result"] = a_result;
+            stats["block_retries"] = updateThread->blockRetries();
+            stats["session_restarts"] = updateThread->sessionRestarts();
+            stats["boot_ready_ms"] = updateThread->bootReadyMs();
+            stats["app_ready_ms"] = updateThread->appReadyMs();
+            stats["timing"] = updateThread->timing().toJson();
+            stats["chip_id"] = updateThread->chipId();
+            m_TargetStats.append(stats);
+        }
+
+        m_ioControllerUpdateThreads.removeOne(updateThread);
+        disconnect(this, nullptr, updateThread, nullptr);
+        updateThread->wait();
+        updateThread->deleteLater();
+
+        if(m_UpdatesPending > 0)
+        {
+            return;
+        }
+    }
+    else if(!a_result)
+    {
+        m_UpdatesFailed++;
+    }
+
+    //Nothing may run on the worker thread at exit
+    m_LoadWatcher.waitForFinished();
+
+    if(m_UpdateTimer.isValid())
+    {
+        qint64 elapsed = qMax<qint64>(m_UpdateTimer.elapsed(), 1);
+        qCInfo(DBG_IOCFLASH_COMMCONTROLEER, "%d of %d targets updated, %lld bytes in %lld ms (%lld bytes/s)",
+               m_UpdatesStarted - m_UpdatesFailed, m_UpdatesStarted, m_BytesProgrammed, elapsed, m_BytesProgrammed * 1000 / elapsed);
+        if(m_UpdatesUnchanged > 0)
+        {
+            qCInfo(DBG_IOCFLASH_COMMCONTROLEER, "%d targets unchanged", m_UpdatesUnchanged);
+        }
+        writeStats();
+    }
 
     m_IOprocInUpdateMode = false;
 
-    if(a_result)
+    if(m_UpdatesFailed == 0 && m_UpdatesStarted == 0 && m_UpdatesUnchanged > 0)
+    {
+        qCInfo(DBG_IOCFLASH_COMMCONTROLEER, "Unchanged");
+        commandFinished(EXIT_UNCHANGED);
+    }
+    else if(m_UpdatesFailed == 0)
     {
         qCInfo(DBG_IOCFLASH_COMMCONTROLEER, "Succeed");
-        exit(0);
+        commandFinished(EXIT_SUCCESS);
     }
     else
     {
         qCWarning(DBG_IOCFLASH_COMMCONTROLEER, "Fail to get IO Processor version!");
-        exit(1);
+        commandFinished(EXIT_FAILURE);
+    }
+
+}
+
+void IOCtrlCommController::writeStats(void)
+{
+    if(m_Options.m_statsJson.isEmpty())
+    {
+        return;
+    }
+
+    qint64 elapsed = qMax<qint64>(m_UpdateTimer.elapsed(), 1);
+    QJsonObject summary;
+    summary["image"] = m_Filename;
+    summary["load_ms"] = m_LoadMs;
+    summary["total_ms"] = elapsed;
+    summary["programmed_bytes"] = m_BytesProgrammed;
+    summary["bytes_per_s"] = m_BytesProgrammed * 1000 / elapsed;
+    summary["targets_failed"] = m_UpdatesFailed;
+    summary["targets_unchanged"] = m_UpdatesUnchanged;
+    summary["targets"] = m_TargetStats;
+
+    QSaveFile file(m_Options.m_statsJson);
+    if(!file.open(QIODevice::WriteOnly) ||
+       file.write(QJsonDocument(summary).toJson()) < 0 ||
+       !file.commit())
+    {
+        qCWarning(DBG_IOCFLASH_COMMCONTROLEER, "Unable to write stats: %s", qPrintable(m_Options.m_statsJson));
+    }
+}
+
+void IOCtrlCommController::dumpFinished(bool a_result)
+{
+    IoControllerUpdateThread *dumpThread = qobject_cast<IoControllerUpdateThread *>(sender());
+
+    if(a_result)
+    {
+        a_result = writeDump(dumpThread);
+    }
+    else
+    {
+        qCWarning(DBG_IOCFLASH_COMMCONTROLEER, "%s: dump failed after %d bytes", qPrintable(dumpThread->target().m_port),
+                  dumpThread->dumpData().size());
+    }
+
+    if(m_pProgress)
+    {
+        m_pProgress->finished(dumpThread, a_result);
+    }
+
+    //Still in its finish handler
+    dumpThread->wait();
+    dumpThread->deleteLater();
+
+    commandFinished(a_result ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+bool IOCtrlCommController::writeDump(const IoControllerUpdateThread *a_pThread)
+{
+    const QByteArray &data = a_pThread->dumpData();
+    bool sim = m_Options.m_dumpFile.endsWith(".sim", Qt::CaseInsensitive);
+    QByteArray hash = QCryptographicHash::hash(data, QCryptographicHash::Sha256).toHex();
+
+    //A .sim file carries its own checksum, a raw binary gets a sha256sum file next to it
+    QSaveFile file(m_Options.m_dumpFile);
+    if(!file.open(QIODevice::WriteOnly) ||
+       file.write(sim ? FlashImage::simFile(a_pThread->dumpAddress(), data) : data) < 0 ||
+       !file.commit())
+    {
+        qCWarning(DBG_IOCFLASH_COMMCONTROLEER, "Unable to write dump: %s", qPrintable(m_Options.m_dumpFile));
+        return false;
+    }
+    if(!sim)
+    {
+        QSaveFile sum(m_Options.m_dumpFile + ".sha256");
+        if(!sum.open(QIODevice::WriteOnly) ||
+           sum.write(hash + "  " + QFileInfo(m_Options.m_dumpFile).fileName().toUtf8() + '\n') < 0 ||
+           !sum.commit())
+        {
+            qCWarning(DBG_IOCFLASH_COMMCONTROLEER, "Unable to write checksum: %s.sha256", qPrintable(m_Options.m_dumpFile));
+            return false;
+        }
     }
 
+    qint64 elapsed = qMax<qint64>(a_pThread->dumpMs(), 1);
+    qint64 rate = data.size() * 1000LL / elapsed;
+    qCInfo(DBG_IOCFLASH_COMMCONTROLEER, "%s: %d bytes at 0x%08x dumped to %s, sha256 %s",
+           qPrintable(a_pThread->target().m_port), data.size(), a_pThread->dumpAddress(),
+           qPrintable(m_Options.m_dumpFile), hash.constData());
+    qCInfo(DBG_IOCFLASH_COMMCONTROLEER, "Read in %lld ms (%lld bytes/s, %lld%% of the line rate)",
+           elapsed, rate, rate * 100 / IoControllerUpdateThread::BOOT_LINE_RATE);
+    return true;
 }
 
 void IOCtrlCommController::reportVersion(SWversion_t a_version)
 {
+    //Still in its receive handler, the session goes on after this
+    disconnect(this, nullptr, m_ioControllerCommThread, nullptr);
     m_ioControllerCommThread->wait();
-    delete m_ioControllerCommThread;
+    m_ioControllerCommThread->deleteLater();
+    m_Timing.save();
 
 
     if(a_version.m_verMaj == 0 &&
@@ -110,7 +539,8 @@ void IOCtrlCommController::reportVersion(SWversion_t a_version)
        a_version.m_verBuild == 0)
     {
         qCWarning(DBG_IOCFLASH_COMMCONTROLEER, "No version found");
-        exit(1);
+        m_Versions.append("none");
+        commandFinished(EXIT_FAILURE);
     }
     else
     {
@@ -120,8 +550,11 @@ void IOCtrlCommController::reportVersion(SWversion_t a_version)
                         a_version.m_verMin,
                         a_version.m_verMaint,
                         a_version.m_verBuild);
-        std::cout << std::endl << version.toStdString() << std::endl << std::flush;
-        exit(0);
+        //Standard output carries the JSON lines of --progress=json then
+        std::ostream &out = (m_Options.m_progressFd == 1) ? std::cerr : std::cout;
+        out << std::endl << version.toStdString() << std::endl << std::flush;
+        m_Versions.append(version);
+        commandFinished(EXIT_SUCCESS);
     }
 
 }
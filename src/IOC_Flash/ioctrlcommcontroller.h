@@ -5,10 +5,15 @@
 #include "iocontrollercommthread.h"
 //#include <QVector>
 #include <iostream>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QFutureWatcher>
 //#include <QTimer>
 //#include "Communication/CommunicationIDs.h"
 //#include "Communication/CrcCCITT.h"
 #include "SWversion.h"
+#include "flashoptions.h"
+#include "flashprogress.h"
 
 
 
@@ -23,11 +28,16 @@ class IOCtrlCommController : public QObject
         //! \brief IOCtrlCommController constructor
         //! \param a_Port - The COM port, I.E "COM1"
         //! \param a_filepathName - The path and filename of the sim file, I.E "IOProc\\IoController000100.sim"
-        IOCtrlCommController(QString a_Port, QString a_filepathName, QString a_command);
+        //! \param a_Commands - "GetVersion", "Update" and "Dump", run in order in one session
+        //! \param a_Options - Options for the update
+        IOCtrlCommController(QString a_Port, QString a_filepathName, QStringList a_Commands, const FlashOptions_t &a_Options);
 
         //! \brief IOCtrlCommController destructor
         ~IOCtrlCommController();
 
+        //! \brief Exit status when --if-changed found every target running the image
+        static const int EXIT_UNCHANGED = 2;
+
 
     private:
         //! \brief Copy constructor blocked
@@ -36,8 +46,57 @@ class IOCtrlCommController : public QObject
         //! \brief Assignment operator blocked
         IOCtrlCommController &operator=(const IOCtrlCommController &a_Right);
 
-        //! \brief The thread used for updating IO controller (speak with bootloader)
-        IoControllerUpdateThread *m_ioControllerUpdateThread;
+        //! \brief The threads used for updating IO controllers (speak with bootloader), one per target
+        QList<IoControllerUpdateThread *> m_ioControllerUpdateThreads;
+
+        //! \brief Number of updates started, one per target
+        qint32 m_UpdatesStarted;
+
+        //! \brief Number of updates not finished yet
+        qint32 m_UpdatesPending;
+
+        //! \brief Number of updates that failed
+        qint32 m_UpdatesFailed;
+
+        //! \brief Number of targets --if-changed found running the image
+        qint32 m_UpdatesUnchanged;
+
+        //! \brief --if-changed: version queries of the running firmware, by target
+        QMap<IoControllerCommThread *, FlashTarget_t> m_VersionChecks;
+
+        //! \brief --if-changed: number of version queries not answered yet
+        qint32 m_ChecksPending;
+
+        //! \brief --if-changed: user SW version reported per target, empty if it did not answer
+        QList<QPair<FlashTarget_t, QString> > m_RunningVersions;
+
+        //! \brief Time since the updates were started
+        QElapsedTimer m_UpdateTimer;
+
+        //! \brief Image bytes written by all finished updates
+        qint64 m_BytesProgrammed;
+
+        //! \brief Image file being read on a worker thread
+        QFutureWatcher<QByteArray> m_LoadWatcher;
+
+        //! \brief Time spent reading the image file, set by the worker thread
+        qint64 m_LoadMs;
+
+        //! \brief --if-changed: content hash of the image, set by the worker thread
+        QByteArray m_ImageHash;
+
+        //! \brief The image file has been read
+        bool m_ImageLoaded;
+
+        //! \brief Per target summaries for --stats-json
+        QJsonArray m_TargetStats;
+
+        //! \brief Write the --stats-json summary of all finished updates
+        void writeStats(void);
+
+        //! \brief Write the memory read by a dump to the --dump file, with a checksum
+        //! \return false if the file could not be written
+        bool writeDump(const IoControllerUpdateThread *a_pThread);
 
         //! \brief The thread used for communication with IO controller (speak with user app)
         IoControllerCommThread *m_ioControllerCommThread;
@@ -46,34 +105,86 @@ class IOCtrlCommController : public QObject
         //! \param a_SimFileData - bytearray from a binary file read
         void updateIOprocessor(QByteArray a_SimFileData);
 
+        //! \brief Create the update threads and reset the targets into their bootloaders
+        void startUpdates(const QList<FlashTarget_t> &a_Targets);
+
+        //! \brief --if-changed: ask the firmware running on each target for its version
+        void checkTargets(const QList<FlashTarget_t> &a_Targets);
+
+        //! \brief --if-changed: update the targets not running the image, exit if there are none
+        void updateChangedTargets(void);
+
         //! \brief getSimFile - Read the update sim file from media
         //! \param a_filepathName - The path and filename of the sim file, I.E "IOProc\\IoController000100.sim"
         QByteArray getSimFile(QString a_filepathName);
 
         void getVersionIOprocessor(void);
 
+        //! \brief A command is done, run the next one or exit when all are
+        //! \param a_Status - exit status of the command
+        void commandFinished(int a_Status);
+
+        //! \brief The port shared by the commands of the session, opened on first use.
+        //! nullptr if a_Port is not the --com-port controller or there is a single command.
+        QextSerialPort *sharedPort(const QString &a_Port);
+
         QString m_COMport;
         bool m_IOprocInUpdateMode;
         QString m_Filename;
-        QString m_Command;
+        FlashOptions_t m_Options;
+
+        //! \brief Commands of the session and the one running
+        QStringList m_Commands;
+        qint32 m_CommandIdx;
+
+        //! \brief Exit status of the session, the worst of its commands
+        int m_ExitStatus;
+
+        //! \brief Time since the session started
+        QElapsedTimer m_SessionTimer;
+
+        //! \brief Versions reported by the GetVersion commands, "none" if there was no answer
+        QStringList m_Versions;
+
+        //! \brief Serial port kept open across the commands of the session
+        QextSerialPort *m_SerialPort;
+
+        //! \brief --progress lines, nullptr without the option
+        FlashProgress *m_pProgress;
+
+        //! \brief Learned deadlines of the --com-port controller, GetVersion spaces its requests by them
+        FlashTiming m_Timing;
 
 
     private slots:
         void onInit();
         void onCommand(QString a_command);
+        void runNextCommand();
+
+        //! \brief The image file has been read, hand it to the update threads
+        void imageLoaded(void);
+
+        //! \brief --if-changed: version reported by the firmware running on a target
+        void targetVersion(SWversion_t a_version);
+
+        //! \brief The dump thread is done, write its file
+        void dumpFinished(bool a_result);
 
     public slots:
-        //! \brief Signal received from the update thread when update is finished
+        //! \brief Signal received from an update thread when its update is finished.
+        //! Exits when all updates are finished. Called directly to abort all updates.
         //! \param a_result - True if succeeded update, false if failed
         void updateFinished(bool a_result);
         void reportVersion(SWversion_t a_version);
 
 
     signals:
-        //! \brief Signal to thread for starting the update process
-        //! \param pointer to the ready set-up serial port object
+        //! \brief Signal to the update threads for starting the update process, resetting into the bootloader
+        void startIOprocessor(void);
+
+        //! \brief Signal to the update threads with the image, programming starts when it is parsed
         //! \param bytearray from a binary file read
-        void flashIOprocessor(QString a_SerialPort, QByteArray a_SimFileData);
+        void flashIOprocessor(QByteArray a_SimFileData);
         void getVerIOprocessor(QString a_SerialPort);
 
 };
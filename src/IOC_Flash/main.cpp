@@ -1,9 +1,11 @@
 //#include "systemApi/deviceconfiguration.h"
 //#include "AppConfig.h"
 #include "ioctrlcommcontroller.h"
+#include "flashservice.h"
 
 #include <QCoreApplication>
 #include <QSettings>
+#include <QFile>
 #include <QJsonValue>
 #include <iostream>
 #include <cstdlib>
@@ -19,6 +21,63 @@ void signal_handler(__attribute__((unused)) int a_signal)
 }
 #endif
 #endif
+
+//! \brief Parse a target description "port[,boot0[,boot1[,reset]]]", omitted GPIO lines keep their defaults
+static bool parseTarget(const QString &a_Arg, FlashTarget_t *a_pTarget)
+{
+    QStringList fields = a_Arg.split(',');
+
+    if(fields.size() > 4 || fields.at(0).isEmpty())
+    {
+        return false;
+    }
+
+    a_pTarget->m_port = fields.at(0);
+    if(fields.size() > 1)
+    {
+        a_pTarget->m_boot0 = fields.at(1);
+    }
+    if(fields.size() > 2)
+    {
+        a_pTarget->m_boot1 = fields.at(2);
+    }
+    if(fields.size() > 3)
+    {
+        a_pTarget->m_reset = fields.at(3);
+    }
+    return true;
+}
+
+//! \brief Read patches from a file, one "ADDR:HEX" per line, empty lines and lines starting with # are skipped
+static bool readPatchFile(const QString &a_Path, QList<FlashPatch_t> *a_pPatches)
+{
+    QFile file(a_Path);
+
+    if(!file.open(QIODevice::ReadOnly | QIODevice::Text))
+    {
+        std::cerr << "Unable to read patch file: " << qPrintable(a_Path) << std::endl << std::flush;
+        return false;
+    }
+
+    for(qint32 line = 1; !file.atEnd(); line++)
+    {
+        QString text = QString::fromLatin1(file.readLine()).trimmed();
+        FlashPatch_t patch;
+
+        if(text.isEmpty() || text.startsWith("#"))
+        {
+            continue;
+        }
+        if(!FlashImage::parsePatch(text, &patch))
+        {
+            std::cerr << "Bad patch in " << qPrintable(a_Path) << " line " << line << ": " << qPrintable(text) << std::endl << std::flush;
+            return false;
+        }
+        a_pPatches->append(patch);
+    }
+    return true;
+}
+
 int main(int argc, char *argv[])
 {
 #if 0
@@ -41,7 +100,10 @@ int main(int argc, char *argv[])
 
     QStringList cmdLineArgs = a.arguments();
     QString fn;
-    QString cmd;
+    QStringList cmds;
+    QString daemonSocket;
+    QString daemonGroup;
+    FlashOptions_t options;
     IOCtrlCommController *ioCtrlCommController;
 
     if(cmdLineArgs.size() > 1)
@@ -50,38 +112,221 @@ int main(int argc, char *argv[])
         {
             if(cmdLineArgs.at(i) == "--get-version")
             {
-                cmd = "GetVersion";
+                cmds.append("GetVersion");
             }
             else if(cmdLineArgs.at(i).startsWith("--file-name="))
             {
                 fn = cmdLineArgs.at(i).toLatin1();
                 fn.remove(0,12); //Remove --file-name=
-                cmd = "Update";
+                if(!cmds.contains("Update"))
+                {
+                    cmds.append("Update");
+                }
             }
             else if(cmdLineArgs.at(i).startsWith("--com-port="))
             {
                 commPort = cmdLineArgs.at(i).toLatin1();
                 commPort.remove(0,11); //Remove --com-port=
             }
+            else if(cmdLineArgs.at(i) == "--delta")
+            {
+                options.m_delta = true;
+            }
+            else if(cmdLineArgs.at(i) == "--verify")
+            {
+                options.m_verify = true;
+            }
+            else if(cmdLineArgs.at(i) == "--target" || cmdLineArgs.at(i).startsWith("--target="))
+            {
+                FlashTarget_t target;
+                QString arg = cmdLineArgs.at(i).size() > 8 ? cmdLineArgs.at(i).mid(9) : (i + 1 < cmdLineArgs.size() ? cmdLineArgs.at(++i) : QString());
+                if(!parseTarget(arg, &target))
+                {
+                    std::cerr << "Bad target: " << qPrintable(arg) << std::endl << std::flush;
+                    return EXIT_FAILURE;
+                }
+                options.m_targets.append(target);
+            }
+            else if(cmdLineArgs.at(i).startsWith("--base-address="))
+            {
+                bool ok;
+                options.m_binBaseAddress = cmdLineArgs.at(i).mid(15).toUInt(&ok, 0); //Remove --base-address=
+                if(!ok)
+                {
+                    std::cerr << "Bad base address: " << qPrintable(cmdLineArgs.at(i).mid(15)) << std::endl << std::flush;
+                    return EXIT_FAILURE;
+                }
+            }
+            else if(cmdLineArgs.at(i).startsWith("--chip="))
+            {
+                bool ok;
+                options.m_chipId = cmdLineArgs.at(i).mid(7).toUShort(&ok, 0); //Remove --chip=
+                if(!ok || !FlashGeometry::isKnown(options.m_chipId))
+                {
+                    std::cerr << "Unknown chip: " << qPrintable(cmdLineArgs.at(i).mid(7)) << std::endl << std::flush;
+                    return EXIT_FAILURE;
+                }
+            }
+            else if(cmdLineArgs.at(i) == "--daemon" || cmdLineArgs.at(i).startsWith("--daemon="))
+            {
+                daemonSocket = cmdLineArgs.at(i).size() > 8 ? cmdLineArgs.at(i).mid(9) : QString(FlashService::DEFAULT_SOCKET);
+            }
+            else if(cmdLineArgs.at(i).startsWith("--daemon-group="))
+            {
+                daemonGroup = cmdLineArgs.at(i).mid(15); //Remove --daemon-group=
+            }
+            else if(cmdLineArgs.at(i).startsWith("--dump="))
+            {
+                options.m_dumpFile = cmdLineArgs.at(i).mid(7); //Remove --dump=
+                if(!cmds.contains("Dump"))
+                {
+                    cmds.append("Dump");
+                }
+            }
+            else if(cmdLineArgs.at(i).startsWith("--range="))
+            {
+                //START[:LENGTH], up to the end of flash without a length
+                QStringList range = cmdLineArgs.at(i).mid(8).split(':'); //Remove --range=
+                bool ok;
+                bool lengthOk = true;
+                options.m_dumpAddress = range.at(0).toUInt(&ok, 0);
+                options.m_dumpLength = range.size() > 1 ? range.at(1).toUInt(&lengthOk, 0) : 0;
+                if(!ok || !lengthOk || range.size() > 2)
+                {
+                    std::cerr << "Bad range: " << qPrintable(cmdLineArgs.at(i).mid(8)) << std::endl << std::flush;
+                    return EXIT_FAILURE;
+                }
+            }
+            else if(cmdLineArgs.at(i).startsWith("--patch="))
+            {
+                FlashPatch_t patch;
+                if(!FlashImage::parsePatch(cmdLineArgs.at(i).mid(8), &patch)) //Remove --patch=
+                {
+                    std::cerr << "Bad patch: " << qPrintable(cmdLineArgs.at(i).mid(8)) << std::endl << std::flush;
+                    return EXIT_FAILURE;
+                }
+                options.m_patches.append(patch);
+            }
+            else if(cmdLineArgs.at(i).startsWith("--patch-file="))
+            {
+                if(!readPatchFile(cmdLineArgs.at(i).mid(13), &options.m_patches)) //Remove --patch-file=
+                {
+                    return EXIT_FAILURE;
+                }
+            }
+            else if(cmdLineArgs.at(i) == "--verify-only")
+            {
+                options.m_verifyOnly = true;
+            }
+            else if(cmdLineArgs.at(i) == "--go")
+            {
+                options.m_fastExit = true;
+            }
+            else if(cmdLineArgs.at(i) == "--if-changed")
+            {
+                options.m_ifChanged = true;
+            }
+            else if(cmdLineArgs.at(i) == "--no-resume")
+            {
+                options.m_resume = false;
+            }
+            else if(cmdLineArgs.at(i) == "--no-cache")
+            {
+                options.m_useCache = false;
+            }
+            else if(cmdLineArgs.at(i).startsWith("--cache-dir="))
+            {
+                options.m_cacheDir = cmdLineArgs.at(i).mid(12); //Remove --cache-dir=
+            }
+            else if(cmdLineArgs.at(i).startsWith("--state-dir="))
+            {
+                options.m_stateDir = cmdLineArgs.at(i).mid(12); //Remove --state-dir=
+            }
+            else if(cmdLineArgs.at(i).startsWith("--progress="))
+            {
+                //json: standard output, a number: a descriptor opened by the caller
+                QString progress = cmdLineArgs.at(i).mid(11); //Remove --progress=
+                bool ok = true;
+                options.m_progressFd = (progress == "json") ? 1 : progress.toInt(&ok);
+                if(!ok || options.m_progressFd < 0)
+                {
+                    std::cerr << "Bad progress output: " << qPrintable(progress) << std::endl << std::flush;
+                    return EXIT_FAILURE;
+                }
+            }
+            else if(cmdLineArgs.at(i).startsWith("--stats-json="))
+            {
+                options.m_statsJson = cmdLineArgs.at(i).mid(13); //Remove --stats-json=
+            }
             else if(cmdLineArgs.at(i).size() > 0 && !cmdLineArgs.at(i).startsWith("--"))
             {
                 //Assume this is file name
                 fn = cmdLineArgs.at(i).toLatin1();
-                cmd = "Update";
+                if(!cmds.contains("Update"))
+                {
+                    cmds.append("Update");
+                }
             }
         }
     }
 
-    if(cmd.length() == 0)
+    if(!daemonSocket.isEmpty())
+    {
+        QList<FlashTarget_t> targets = options.m_targets;
+        if(targets.isEmpty())
+        {
+            FlashTarget_t target;
+            target.m_port = commPort;
+            targets.append(target);
+        }
+
+        FlashService service(targets, options);
+        if(!service.listen(daemonSocket, daemonGroup))
+        {
+            return EXIT_FAILURE;
+        }
+        return a.exec();
+    }
+
+    if(cmds.isEmpty())
     {
         std::cout << "Usage: " << argv[0] << " file name" << std::endl 
                   << " or " << argv[0] << " --get-version" << std::endl
-                  << " or " << argv[0] << " --com-port=DEVICE_FILE --file-name=FILE_NAME" << std::endl << std::flush;
+                  << " or " << argv[0] << " --com-port=DEVICE_FILE --file-name=FILE_NAME" << std::endl
+                  << " or " << argv[0] << " --target PORT[,BOOT0,BOOT1,RESET] [--target ...] --file-name=FILE_NAME" << std::endl
+                  << " or " << argv[0] << " --get-version --file-name=FILE_NAME --get-version" << std::endl
+                  << "Commands run in the given order in one session, sharing the open --com-port" << std::endl
+                  << " or " << argv[0] << " --daemon[=SOCKET] [--com-port=DEVICE_FILE | --target ...] [update options]" << std::endl
+                  << "Serves flash, verify and version jobs as JSON lines on a local socket (default " << FlashService::DEFAULT_SOCKET << ")," << std::endl
+                  << "the GPIO lines and serial ports stay claimed between jobs. Only the daemon's user may connect," << std::endl
+                  << "and members of NAME with --daemon-group=NAME" << std::endl
+                  << " or " << argv[0] << " --dump=FILE [--range=START[:LENGTH]]" << std::endl
+                  << "Reads memory through the bootloader into FILE, .sim or raw binary with a .sha256 file," << std::endl
+                  << "the range defaults to the whole flash" << std::endl
+                  << "The image may be .sim, Intel HEX, S-record or raw binary, the format is detected" << std::endl
+                  << "Update options:" << std::endl
+                  << "  --base-address=ADDR  flash address of a raw binary image (default 0x08000000)" << std::endl
+                  << "  --chip=PID   product ID of the expected MCU, planning starts with its flash layout (default 0x410)" << std::endl
+                  << "  --delta      only erase and program flash pages that differ from the image" << std::endl
+                  << "  --verify     read back and compare the programmed flash before exit" << std::endl
+                  << "  --verify-only  read back and compare the flash with the image, do not program" << std::endl
+                  << "  --patch=ADDR:HEX  write these bytes over the image, I.E a serial number, may be repeated" << std::endl
+                  << "  --patch-file=FILE  read patches from FILE, one ADDR:HEX per line" << std::endl
+                  << "  --go         start the new firmware with the bootloader GO command and wait for it to" << std::endl
+                  << "               report its version, instead of a reset cycle" << std::endl
+                  << "  --if-changed skip targets running the firmware last flashed from this image," << std::endl
+                  << "               exit status " << IOCtrlCommController::EXIT_UNCHANGED << " if all are skipped" << std::endl
+                  << "  --no-cache   always parse the image, do not use or update the plan cache" << std::endl
+                  << "  --no-resume  program the full image even if an earlier update of it was interrupted" << std::endl
+                  << "  --cache-dir=DIR  plan cache and journal directory (default " << qPrintable(options.m_cacheDir) << ")" << std::endl
+                  << "  --state-dir=DIR  installed image records for --if-changed, must survive a reboot (default " << qPrintable(options.m_stateDir) << ")" << std::endl
+                  << "  --stats-json=FILE  write per phase timing and block latency of the update as JSON" << std::endl
+                  << "  --progress=json|FD  write progress, rate and ETA as JSON lines to standard output or descriptor FD" << std::endl << std::flush;
         return EXIT_FAILURE;
     }
     else
     {
-        ioCtrlCommController = new IOCtrlCommController(commPort, fn, cmd);
+        ioCtrlCommController = new IOCtrlCommController(commPort, fn, cmds, options);
         //IOCtrlCommController IOCtrlCommController(commPort, fn, cmd);
     }
 
@@ -1,5 +1,7 @@
 #include "gpio.h"
 #include <filesystem>
+#include <fstream>
+#include <cstdlib>
 
 #include <QLoggingCategory>
 Q_LOGGING_CATEGORY(DBG_GPIO, "IOC.Gpio", QtInfoMsg)
@@ -9,8 +11,15 @@ const std::unordered_map<std::string, ::gpiod::line> Gpio::namedGpioLines_ {Gpio
 
 Gpio::Gpio(const std::string& name, const bool activateLow)
     : QObject{}
-    , gpiodLine_{getNamedGpioLine(name)}
+    , simPath_{getSimPath(name)}
+    , gpiodLine_{simPath_.empty() ? getNamedGpioLine(name) : ::gpiod::line()}
 {
+    if(!simPath_.empty())
+    {
+        qCDebug(DBG_GPIO) << "name:" << name.c_str() << "simulated by" << simPath_.c_str();
+        return;
+    }
+
     qCDebug(DBG_GPIO) << "name:" << gpiodLine_.name().c_str() << ", active low:" << (gpiodLine_.active_state() == ::gpiod::line::ACTIVE_LOW);
 
     gpiodLine_.request({
@@ -22,11 +31,21 @@ Gpio::Gpio(const std::string& name, const bool activateLow)
 
 Gpio::~Gpio()
 {
-    gpiodLine_.release();
+    if(simPath_.empty())
+    {
+        gpiodLine_.release();
+    }
 }
 
 void Gpio::set(bool state)
 {
+    if(!simPath_.empty())
+    {
+        qCDebug(DBG_GPIO) << "name:" << simPath_.c_str() << "state:" << state;
+        std::ofstream(simPath_, std::ios::app) << (state ? "1" : "0") << std::endl;
+        return;
+    }
+
     qCDebug(DBG_GPIO) << "name:" << gpiodLine_.name().c_str() << "state:" << state;
 
     gpiodLine_.set_value(state ? 1 : 0);
@@ -34,6 +53,18 @@ void Gpio::set(bool state)
 
 bool Gpio::get()
 {
+    if(!simPath_.empty())
+    {
+        std::string line;
+        std::string last;
+        std::ifstream file(simPath_);
+        while(std::getline(file, line))
+        {
+            last = line;
+        }
+        return last == "1";
+    }
+
     return gpiodLine_.get_value() == 1;
 }
 
@@ -75,3 +106,14 @@ gpiod::line Gpio::getNamedGpioLine(const std::string &name)
         return it->second;
     }
 }
+
+std::string Gpio::getSimPath(const std::string &name)
+{
+    const char *dir = std::getenv(SIM_DIR_ENV);
+
+    if(dir == nullptr || *dir == '\0')
+    {
+        return std::string();
+    }
+    return (std::filesystem::path(dir) / name).string();
+}
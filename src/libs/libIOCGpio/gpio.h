@@ -14,17 +14,25 @@ class Gpio : public QObject
     Q_OBJECT
 
 public:
+    //! \brief Request the named GPIO line as output. When IOC_GPIO_SIM_DIR is set the line is
+    //! simulated by a file of that name in the directory: every set() appends the logical state
+    //! as a line, "0" or "1", so a reader sees short pulses too. The last line is the current state.
     explicit Gpio(const std::string& name, const bool activateLow);
     ~Gpio();
 
     void set(bool state);
     bool get();
 
+    //! \brief Environment variable naming the simulated GPIO directory
+    static constexpr const char *SIM_DIR_ENV = "IOC_GPIO_SIM_DIR";
+
 private:
     static const std::unordered_map<std::string, ::gpiod::line> namedGpioLines_;
     static std::unordered_map<std::string, ::gpiod::line> getNamedLines();
+    std::string simPath_;
     ::gpiod::line gpiodLine_;
     static ::gpiod::line getNamedGpioLine(const std::string& name);
+    static std::string getSimPath(const std::string& name);
 };
 
 #endif // GPIO_H
@@ -40,5 +40,30 @@ namespace Communication
         return crc;
     }
 
+    /********************************************************************* continueCrc
+     * Name:    continueCrc
+     *
+     * Purpose: Continues a CRC calculation over one more buffer, so data arriving
+     *          in pieces can be checked without collecting it first
+     *
+     * Input Parameters: CRC so far (CRC_INIT for the first buffer), pointer to buffer, length of buffer
+     *
+     * Permitted range:  any (it is up to the caller to set these up correctly)
+     *
+     * Return Parameter: the CRC, 16 bits unsigned
+     *
+     */
+
+    uint16_t CrcCCITT::continueCrc(uint16_t crc, const uint8_t *pBuf, size_t len)
+    {
+        const uint8_t *pEnd = pBuf + len;
+
+        while (pBuf < pEnd)
+        {
+            crcUpdate(crc, *pBuf++);
+        }
+        return crc;
+    }
+
 }// end namespace LittleSister
 
@@ -18,12 +18,12 @@ namespace Communication
 
     public:
         static const uint8_t CRC_LEN = sizeof(uint16_t);
+        static const uint16_t CRC_INIT = 0xFFFFu;
         static uint16_t calcCrc(uint8_t *pBuf, size_t len);
+        static uint16_t continueCrc(uint16_t crc, const uint8_t *pBuf, size_t len);
 
     private:
         static void crcUpdate(uint16_t& crc, uint8_t val);
-
-        static const uint16_t CRC_INIT = 0xFFFFu;
     };
 
 }
@@ -13,11 +13,12 @@ OUT_PWD =  $$(PWD)
 TEMPLATE = subdirs
 CONFIG  += ordered
 
-SUBDIRS += libs IOC_Test IOC_Flash 
+SUBDIRS += libs IOC_Test IOC_Flash IOC_BootEmu 
 #WinmateTest qws_input eeprom_gen nvram
 
 IOC_Test.depends = libs
 IOC_Flash.depends = libs
+IOC_BootEmu.depends = libs
 nvram.depends = libs
 
 target.path += $$(OUT_PWD)/opt/